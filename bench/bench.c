@@ -0,0 +1,463 @@
+// Microbenchmarks of the link-layer hot paths.
+// Runs each kernel over representative payloads, cut into frames of
+// MAX_PAYLOAD_SIZE bytes, and reports bytes per second, cycles per byte and
+// allocations per frame.
+//
+// Usage: bench [-t seconds] [-j results_file] [file...]
+//   -t seconds : time spent on each kernel and payload (default 0.5)
+//   -j file    : also write the results as JSON lines, one per measurement,
+//                to compare builds (e.g. with jq or diff)
+//   file       : extra payloads, e.g. the bundled images
+//
+// Kernels:
+//   bcc     BCC2 of the data (XOR)
+//   crc16   CRC-16 of the data
+//   stuff   BCC2 and byte stuffing, as in the handshake frames
+//   cobs    COBS encoding
+//   encode  information field of an I-frame as llwrite builds it (CRC-16,
+//           byte stuffing, and the size of both framings for the statistics)
+//   parse   receiver frame parser, byte by byte
+//   llread  llread over a socket pair, one read() per byte as on the serial
+//           port, including the RR it sends back
+//
+// The link layer is compiled into this program so its internal functions are
+// measured as they are. Allocations are counted by wrapping malloc, calloc
+// and realloc at link time (-Wl,--wrap), so only the calls made by the
+// project's code are seen.
+
+#include "../src/link_layer.c"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+// Compiler and flags, to tell the results of different builds apart
+#ifndef BENCH_BUILD
+#define BENCH_BUILD ""
+#endif
+
+#define SYNTHETIC_SIZE 65536 // Size of the generated payloads
+#define MAX_PAYLOADS 16
+
+typedef struct
+{
+    const char *name;
+    unsigned char *data;
+    int size;
+} Payload;
+
+typedef struct
+{
+    Link *link;                                  // Receiver link of the parse and llread kernels
+    int peer;                                    // Transmitter end of the socket pair of llread
+    unsigned char (*encoded)[ENCODED_DATA_SIZE]; // Stuffed information field of each frame
+    int *encodedSize;
+    volatile unsigned long sink;                 // Keeps the results alive
+} Context;
+
+typedef int (*Kernel)(Context *ctx, const Payload *payload);
+
+////////////////////////////////////////////////
+// Allocation counter
+////////////////////////////////////////////////
+
+unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+////////////////////////////////////////////////
+// Kernels
+////////////////////////////////////////////////
+
+// Each kernel processes the whole payload once and returns the number of frames
+
+int frameSize(const Payload *payload, int offset)
+{
+    int left = payload->size - offset;
+    return left < MAX_PAYLOAD_SIZE ? left : MAX_PAYLOAD_SIZE;
+}
+
+int benchFcs(Context *ctx, const Payload *payload, int fcs)
+{
+    unsigned char out[FRAME_DATA_SIZE];
+    int frames = 0;
+    for (int offset = 0; offset < payload->size; offset += MAX_PAYLOAD_SIZE)
+    {
+        int size = frameSize(payload, offset);
+        ctx->sink += appendFcs(payload->data + offset, size, out, fcs) + out[size];
+        frames++;
+    }
+    return frames;
+}
+
+int benchBcc(Context *ctx, const Payload *payload)
+{
+    return benchFcs(ctx, payload, FCS_XOR);
+}
+
+int benchCrc16(Context *ctx, const Payload *payload)
+{
+    return benchFcs(ctx, payload, FCS_CRC16);
+}
+
+int benchStuff(Context *ctx, const Payload *payload)
+{
+    unsigned char out[ENCODED_DATA_SIZE];
+    int frames = 0;
+    for (int offset = 0; offset < payload->size; offset += MAX_PAYLOAD_SIZE)
+    {
+        ctx->sink += stuffData(payload->data + offset, frameSize(payload, offset), out, FCS_XOR);
+        frames++;
+    }
+    return frames;
+}
+
+int benchCobs(Context *ctx, const Payload *payload)
+{
+    unsigned char out[COBS_MAX_SIZE(MAX_PAYLOAD_SIZE)];
+    int frames = 0;
+    for (int offset = 0; offset < payload->size; offset += MAX_PAYLOAD_SIZE)
+    {
+        ctx->sink += cobsEncode(payload->data + offset, frameSize(payload, offset), out);
+        frames++;
+    }
+    return frames;
+}
+
+int benchEncode(Context *ctx, const Payload *payload)
+{
+    unsigned char out[ENCODED_DATA_SIZE];
+    int frames = 0;
+    for (int offset = 0; offset < payload->size; offset += MAX_PAYLOAD_SIZE)
+    {
+        ctx->sink += encodeInformation(ctx->link, payload->data + offset, frameSize(payload, offset), out);
+        frames++;
+    }
+    return frames;
+}
+
+int benchParse(Context *ctx, const Payload *payload)
+{
+    static const unsigned char header[FRAME_SIZE - 1] = {FLAG, A_TX, C_I0, BCC1(A_TX, C_I0)};
+    FrameParser parser = {START};
+    unsigned char data[FRAME_DATA_SIZE];
+    int frames = 0;
+
+    for (int i = 0; i * MAX_PAYLOAD_SIZE < payload->size; i++)
+    {
+        for (int j = 0; j < FRAME_SIZE - 1; j++)
+        {
+            parseFrameByte(ctx->link, &parser, header[j], data);
+        }
+        for (int j = 0; j < ctx->encodedSize[i]; j++)
+        {
+            parseFrameByte(ctx->link, &parser, ctx->encoded[i][j], data);
+        }
+        if (parseFrameByte(ctx->link, &parser, FLAG, data) == FRAME_INFORMATION)
+        {
+            frames++;
+        }
+        ctx->sink += parser.size;
+    }
+    return frames;
+}
+
+int benchLlread(Context *ctx, const Payload *payload)
+{
+    Link *link = ctx->link;
+    unsigned char packet[MAX_PAYLOAD_SIZE + 1];
+    unsigned char ack[FRAME_SIZE];
+    int frames = 0;
+
+    for (int i = 0; i * MAX_PAYLOAD_SIZE < payload->size; i++)
+    {
+        unsigned char control = link->frameNr << 7;
+        unsigned char header[FRAME_SIZE - 1] = {FLAG, A_TX, control, BCC1(A_TX, control)};
+        unsigned char trailer = FLAG;
+        struct iovec iov[3] = {
+            {header, sizeof(header)},
+            {ctx->encoded[i], ctx->encodedSize[i]},
+            {&trailer, 1}};
+        if (writev(ctx->peer, iov, 3) == -1)
+        {
+            perror("writev");
+            return -1;
+        }
+
+        int size = llreadLink(link, packet);
+        if (size < 0 || read(ctx->peer, ack, FRAME_SIZE) != FRAME_SIZE)
+        {
+            return -1;
+        }
+        ctx->sink += size;
+        frames++;
+    }
+    return frames;
+}
+
+typedef struct
+{
+    const char *name;
+    Kernel run;
+    int encoded; // Needs the payload encoded as I-frames beforehand
+} KernelInfo;
+
+const KernelInfo kernels[] = {
+    {"bcc", benchBcc, FALSE},
+    {"crc16", benchCrc16, FALSE},
+    {"stuff", benchStuff, FALSE},
+    {"cobs", benchCobs, FALSE},
+    {"encode", benchEncode, FALSE},
+    {"parse", benchParse, TRUE},
+    {"llread", benchLlread, TRUE},
+};
+
+////////////////////////////////////////////////
+// Payloads
+////////////////////////////////////////////////
+
+Payload makeRandom(void)
+{
+    Payload payload = {"random", malloc(SYNTHETIC_SIZE), SYNTHETIC_SIZE};
+    uint32_t state = 0x2545F491;
+    for (int i = 0; i < SYNTHETIC_SIZE; i++)
+    {
+        // xorshift32, the same bytes on every run
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        payload.data[i] = state & 0xFF;
+    }
+    return payload;
+}
+
+Payload makeText(void)
+{
+    static const char text[] =
+        "The link layer sends the packets of the application in I-frames, "
+        "waits for their acknowledgement and sends them again after a timeout. "
+        "FLAG and ESC bytes in the data are escaped by byte stuffing.\n";
+    Payload payload = {"text", malloc(SYNTHETIC_SIZE), SYNTHETIC_SIZE};
+    for (int i = 0; i < SYNTHETIC_SIZE; i++)
+    {
+        payload.data[i] = text[i % (sizeof(text) - 1)];
+    }
+    return payload;
+}
+
+// Worst case of byte stuffing: every byte is escaped
+Payload makeFlags(void)
+{
+    Payload payload = {"flags", malloc(SYNTHETIC_SIZE), SYNTHETIC_SIZE};
+    memset(payload.data, FLAG, SYNTHETIC_SIZE);
+    return payload;
+}
+
+int loadFile(const char *filename, Payload *payload)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    const char *name = strrchr(filename, '/');
+    payload->name = name != NULL ? name + 1 : filename;
+    payload->data = malloc(size > 0 ? size : 1);
+    payload->size = fread(payload->data, 1, size, fp);
+    fclose(fp);
+    return 0;
+}
+
+////////////////////////////////////////////////
+// Measurement
+////////////////////////////////////////////////
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Receiver link over a socket pair, with the parameters two current peers agree on
+Link *openBenchLink(int *peer)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        perror("socketpair");
+        return NULL;
+    }
+    Link *link = calloc(1, sizeof(Link));
+    link->port.fd = sv[0];
+    link->curLL.role = LlRx;
+    link->localAddress = A_RX;
+    link->peerAddress = A_TX;
+    link->caps.maxPayload = MAX_PAYLOAD_SIZE;
+    link->caps.window = 1;
+    link->caps.fcs = FCS_CRC16;
+    *peer = sv[1];
+    return link;
+}
+
+// Encode the frames of the payload once, for the receiving kernels
+void encodePayload(Context *ctx, const Payload *payload)
+{
+    int frames = (payload->size + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+    ctx->encoded = realloc(ctx->encoded, (frames + 1) * sizeof(*ctx->encoded));
+    ctx->encodedSize = realloc(ctx->encodedSize, (frames + 1) * sizeof(int));
+    for (int i = 0; i < frames; i++)
+    {
+        int offset = i * MAX_PAYLOAD_SIZE;
+        ctx->encodedSize[i] = stuffData(payload->data + offset, frameSize(payload, offset),
+                                        ctx->encoded[i], ctx->link->caps.fcs);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 0.5;
+    const char *jsonFile = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'j':
+            jsonFile = optarg;
+            break;
+        default:
+            printf("Usage: %s [-t seconds] [-j results_file] [file...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Payload payloads[MAX_PAYLOADS];
+    int count = 0;
+    payloads[count++] = makeRandom();
+    payloads[count++] = makeText();
+    payloads[count++] = makeFlags();
+    for (int i = optind; i < argc && count < MAX_PAYLOADS; i++)
+    {
+        if (loadFile(argv[i], &payloads[count]) == 0 && payloads[count].size > 0)
+        {
+            count++;
+        }
+    }
+
+    FILE *json = NULL;
+    if (jsonFile != NULL && (json = fopen(jsonFile, "w")) == NULL)
+    {
+        perror(jsonFile);
+        return 1;
+    }
+
+    Context ctx = {0};
+    ctx.link = openBenchLink(&ctx.peer);
+    if (ctx.link == NULL)
+    {
+        return 1;
+    }
+
+    printf("%-8s %-16s %10s %10s %13s\n", "kernel", "payload", "MB/s", "cycles/B", "allocs/frame");
+    for (int k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        for (int p = 0; p < count; p++)
+        {
+            const KernelInfo *kernel = &kernels[k];
+            const Payload *payload = &payloads[p];
+            if (kernel->encoded)
+            {
+                encodePayload(&ctx, payload);
+            }
+
+            // one pass to warm up the caches, then as many as fit in the time
+            if (kernel->run(&ctx, payload) == -1)
+            {
+                printf("%s failed\n", kernel->name);
+                return 1;
+            }
+            unsigned long passes = 0, frames = 0;
+            unsigned long startAllocations = allocations;
+            uint64_t startCycles = cycles();
+            double start = now(), elapsed;
+            do
+            {
+                frames += kernel->run(&ctx, payload);
+                passes++;
+                elapsed = now() - start;
+            } while (elapsed < seconds);
+            uint64_t usedCycles = cycles() - startCycles;
+
+            double bytes = (double)passes * payload->size;
+            double rate = bytes / elapsed;
+            double perFrame = (double)(allocations - startAllocations) / frames;
+            printf("%-8s %-16s %10.2f ", kernel->name, payload->name, rate / 1e6);
+#ifdef HAVE_TSC
+            printf("%10.2f ", usedCycles / bytes);
+#else
+            printf("%10s ", "-");
+#endif
+            printf("%13.2f\n", perFrame);
+
+            if (json != NULL)
+            {
+                fprintf(json, "{\"kernel\": \"%s\", \"payload\": \"%s\", \"bytes\": %.0f, \"frames\": %lu, "
+                              "\"seconds\": %.6f, \"bytes_per_second\": %.0f, ",
+                        kernel->name, payload->name, bytes, frames, elapsed, rate);
+#ifdef HAVE_TSC
+                fprintf(json, "\"cycles_per_byte\": %.3f, ", usedCycles / bytes);
+#else
+                fprintf(json, "\"cycles_per_byte\": null, ");
+#endif
+                fprintf(json, "\"allocs_per_frame\": %.3f, \"build\": \"%s\"}\n", perFrame, BENCH_BUILD);
+            }
+        }
+    }
+    if (json != NULL)
+    {
+        fclose(json);
+    }
+    return 0;
+}
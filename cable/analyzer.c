@@ -0,0 +1,756 @@
+// Offline protocol analyzer for virtual cable captures.
+// Decodes the link-layer frames recorded by the cable "capture" command and
+// reports per-frame timing, retransmissions, wasted wire bytes and idle gaps.
+//
+// Usage: analyzer [-q] [-g gap_ms] [-c reference_capture] capture_file
+//   -q        : only print the summary, not every frame
+//   -g gap_ms : minimum silence on both directions reported as an idle gap
+//   -c file   : compare the delivered byte streams with a reference capture
+//               (e.g. a replayed session against the original recording)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "cobs.h"
+#include "crc16.h"
+#include "link_layer.h"
+#include "macros.h"
+
+#define MAX_FRAME 4096 // Maximum number of (stuffed) bytes between two flags
+#define MAX_GAPS 10    // Number of largest idle gaps to report
+
+typedef enum
+{
+    FT_SET,
+    FT_UA,
+    FT_DISC,
+    FT_RR,
+    FT_REJ,
+    FT_RNR,
+    FT_POLL,
+    FT_I,
+    FT_UNKNOWN,
+    FT_BAD,
+    FT_COUNT
+} FrameType;
+
+const char *frameTypeNames[FT_COUNT] = {"SET", "UA", "DISC", "RR", "REJ", "RNR", "POLL", "I", "UNKNOWN", "BAD"};
+const char *dirNames[2] = {"T->R", "R->T"};
+
+// Frame decoder and statistics for one direction of the cable
+typedef struct
+{
+    // Frame being assembled
+    int inFrame;
+    uint64_t start;
+    unsigned char raw[MAX_FRAME];
+    int rawLen;
+    int overflow;
+
+    // Last frame that may be retransmitted (I, SET, DISC)
+    int lastControl;
+    int lastLength;
+    int lastWire;
+    int lastWasted;
+
+    // Statistics
+    unsigned long frames[FT_COUNT];
+    unsigned long offeredBytes;   // Bytes read from the sending endpoint
+    unsigned long wireBytes;      // Bytes delivered to the receiving endpoint
+    unsigned long payloadBytes;   // Payload of accepted, first-copy I frames
+    unsigned long stuffingBytes;  // Escape bytes added by byte stuffing
+    unsigned long cobsBytes;      // Code bytes added by COBS framing
+    unsigned long wastedBytes;    // Errored or retransmitted frames, garbage
+    unsigned long droppedBytes;   // Bytes discarded while the cable was off
+    unsigned long corruptedBytes; // Bytes hit by noise
+    unsigned long retransmissions;
+    unsigned long bcc1Errors;
+    unsigned long bcc2Errors;
+} Direction;
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t length;
+    int lastDir;
+    FrameType lastType;
+} Gap;
+
+Direction dirs[2];
+Gap gaps[MAX_GAPS];
+int nGaps = 0;
+uint64_t totalIdle = 0;
+uint64_t lastFrameEnd = 0;
+int lastFrameDir = -1;
+FrameType lastFrameType = FT_UNKNOWN;
+int quiet = FALSE;
+
+// FCS and framing of the I-frames, agreed in the SET / UA handshake. setFcs
+// and setFeatures are what the last SET advertised, setFcs is -1 once it was
+// answered (e.g. the UA ending a session).
+int setFcs = -1;
+int setFeatures = 0;
+int fcs = FCS_XOR;
+int features = 0;
+
+
+// Classify the control field of a supervision frame
+FrameType supervisionType(unsigned char control)
+{
+    switch (control)
+    {
+    case C_SET:
+        return FT_SET;
+    case C_UA:
+        return FT_UA;
+    case C_DISC:
+        return FT_DISC;
+    case C_RR0:
+    case C_RR1:
+        return FT_RR;
+    case C_REJ0:
+    case C_REJ1:
+        return FT_REJ;
+    case C_RNR0:
+    case C_RNR1:
+        return FT_RNR;
+    case C_POLL:
+        return FT_POLL;
+    default:
+        return FT_UNKNOWN;
+    }
+}
+
+
+// One-byte parameter of a SET / UA, or fallback if it is missing (legacy
+// frames have none)
+int advertisedParam(const unsigned char *params, int size, unsigned char param, int fallback)
+{
+    int i = 0;
+    while (i + 2 <= size && i + 2 + params[i + 1] <= size)
+    {
+        if (params[i] == param && params[i + 1] == 1)
+        {
+            return params[i + 2];
+        }
+        i += 2 + params[i + 1];
+    }
+    return fallback;
+}
+
+// FCS types advertised in the parameters of a SET / UA
+int advertisedFcs(const unsigned char *params, int size)
+{
+    return advertisedParam(params, size, PARAM_FCS, FCS_XOR) | FCS_XOR;
+}
+
+int isInformation(unsigned char control)
+{
+    return IS_C_I(control) || IS_C_IP(control);
+}
+
+
+// Keep the MAX_GAPS largest idle gaps, largest first
+void recordGap(uint64_t start, uint64_t length)
+{
+    totalIdle += length;
+    int pos;
+    if (nGaps < MAX_GAPS)
+    {
+        pos = nGaps++;
+    }
+    else if (gaps[MAX_GAPS - 1].length >= length)
+    {
+        return;
+    }
+    else
+    {
+        pos = MAX_GAPS - 1;
+    }
+    while (pos > 0 && gaps[pos - 1].length < length)
+    {
+        gaps[pos] = gaps[pos - 1];
+        --pos;
+    }
+    gaps[pos] = (Gap) {.start = start, .length = length, .lastDir = lastFrameDir, .lastType = lastFrameType};
+}
+
+
+// Decode the bytes received between two flags
+void finishFrame(int d, uint64_t end)
+{
+    Direction *dir = &dirs[d];
+    unsigned char buf[MAX_FRAME];
+    int len = 0;
+    int escaped = FALSE;
+    int wire = dir->rawLen + 2;
+
+    // the header is never escaped, the information field of COBS I-frames is not byte stuffed
+    int cobsFrame = (features & FEATURE_COBS) && !dir->overflow && dir->rawLen > 3 && isInformation(dir->raw[1]);
+    int cobsError = FALSE;
+    if (cobsFrame)
+    {
+        memcpy(buf, dir->raw, 3);
+        int decoded = cobsDecode(&dir->raw[3], dir->rawLen - 3, &buf[3]);
+        cobsError = decoded == -1;
+        if (!cobsError)
+        {
+            dir->cobsBytes += dir->rawLen - 3 - decoded;
+            len = 3 + decoded;
+        }
+    }
+    for (int i = 0; i < dir->rawLen && !cobsFrame; i++)
+    {
+        if (escaped)
+        {
+            buf[len++] = dir->raw[i] ^ 0x20;
+            escaped = FALSE;
+        }
+        else if (dir->raw[i] == ESC)
+        {
+            escaped = TRUE;
+            dir->stuffingBytes++;
+        }
+        else
+        {
+            buf[len++] = dir->raw[i];
+        }
+    }
+
+    FrameType type = FT_BAD;
+    const char *status = "ok";
+    int seq = -1;
+    int payload = 0;
+    int wasted = FALSE;
+
+    if (dir->overflow || len < 3)
+    {
+        status = dir->overflow ? "too long" : cobsError ? "COBS error" : "runt";
+        wasted = TRUE;
+    }
+    else if (buf[2] != BCC1(buf[0], buf[1]))
+    {
+        status = "BCC1 error";
+        dir->bcc1Errors++;
+        wasted = TRUE;
+    }
+    else if (len == 3)
+    {
+        type = supervisionType(buf[1]);
+        // legacy handshake
+        if (type == FT_SET)
+        {
+            setFcs = FCS_XOR;
+            setFeatures = 0;
+        }
+        else if (type == FT_UA && setFcs != -1)
+        {
+            fcs = FCS_XOR;
+            features = 0;
+            setFcs = -1;
+        }
+        if (type == FT_RR || type == FT_REJ || type == FT_RNR)
+        {
+            seq = buf[1] & 0x01;
+        }
+    }
+    else if (isInformation(buf[1]))
+    {
+        type = FT_I;
+        seq = buf[1] >> 7;
+        int ok;
+        if (fcs == FCS_CRC16)
+        {
+            payload = len - 5;
+            ok = payload >= 0 && crc16(&buf[3], len - 3) == 0;
+        }
+        else
+        {
+            payload = len - 4;
+            unsigned char bcc2 = 0;
+            for (int i = 3; i < len; i++)
+            {
+                bcc2 ^= buf[i];
+            }
+            ok = bcc2 == 0;
+        }
+        if (!ok)
+        {
+            status = "BCC2 error";
+            dir->bcc2Errors++;
+            wasted = TRUE;
+        }
+    }
+    else if (buf[1] == C_SET || buf[1] == C_UA)
+    {
+        // handshake with parameters
+        type = supervisionType(buf[1]);
+        unsigned char bcc2 = 0;
+        for (int i = 3; i < len; i++)
+        {
+            bcc2 ^= buf[i];
+        }
+        if (bcc2 != 0)
+        {
+            status = "BCC2 error";
+            dir->bcc2Errors++;
+            wasted = TRUE;
+        }
+        else if (type == FT_SET)
+        {
+            setFcs = advertisedFcs(&buf[3], len - 4);
+            setFeatures = advertisedParam(&buf[3], len - 4, PARAM_FEATURES, 0);
+        }
+        else if (setFcs != -1)
+        {
+            fcs = (setFcs & advertisedFcs(&buf[3], len - 4) & FCS_CRC16) ? FCS_CRC16 : FCS_XOR;
+            features = setFeatures & advertisedParam(&buf[3], len - 4, PARAM_FEATURES, 0);
+            setFcs = -1;
+        }
+    }
+    else
+    {
+        type = FT_UNKNOWN;
+        wasted = TRUE;
+    }
+
+    // A frame equal to the previous I / SET / DISC frame is a retransmission,
+    // so the previous copy did not achieve anything. A full-duplex I-frame may
+    // be sent again with a newer piggybacked acknowledgement.
+    int retransmission = FALSE;
+    if (type == FT_I || type == FT_SET || type == FT_DISC)
+    {
+        unsigned char control = IS_C_IP(buf[1]) ? buf[1] & ~0x40 : buf[1];
+        if (control == dir->lastControl && payload == dir->lastLength)
+        {
+            retransmission = TRUE;
+            dir->retransmissions++;
+            if (!dir->lastWasted)
+            {
+                dir->wastedBytes += dir->lastWire;
+                if (type == FT_I)
+                {
+                    dir->payloadBytes -= payload;
+                }
+            }
+        }
+        dir->lastControl = control;
+        dir->lastLength = payload;
+        dir->lastWire = wire;
+        dir->lastWasted = wasted;
+        if (type == FT_I && !wasted)
+        {
+            dir->payloadBytes += payload;
+        }
+    }
+
+    dir->frames[type]++;
+    if (wasted)
+    {
+        dir->wastedBytes += wire;
+    }
+
+    if (!quiet)
+    {
+        double idle = lastFrameDir >= 0 && dir->start > lastFrameEnd ? (dir->start - lastFrameEnd) / 1000.0 : 0.0;
+        printf("%12.3f %9.3f %9.3f  %s  %-7s ", dir->start / 1000.0, (end - dir->start) / 1000.0, idle,
+               dirNames[d], frameTypeNames[type]);
+        if (seq >= 0)
+        {
+            printf("%3d ", seq);
+        }
+        else
+        {
+            printf("  - ");
+        }
+        printf("%5d %5d  %s%s\n", payload, wire, status, retransmission ? " (retransmission)" : "");
+    }
+
+    if (end > lastFrameEnd)
+    {
+        lastFrameEnd = end;
+    }
+    lastFrameDir = d;
+    lastFrameType = type;
+}
+
+
+// Feed one delivered byte to the frame decoder of its direction
+void decodeByte(int d, unsigned char byte, uint64_t t)
+{
+    Direction *dir = &dirs[d];
+
+    if (byte == FLAG)
+    {
+        if (dir->inFrame && dir->rawLen > 0)
+        {
+            finishFrame(d, t);
+            dir->inFrame = FALSE;
+            return;
+        }
+        dir->inFrame = TRUE;
+        dir->start = t;
+        dir->rawLen = 0;
+        dir->overflow = FALSE;
+        return;
+    }
+
+    if (!dir->inFrame)
+    {
+        dir->wastedBytes++;
+        return;
+    }
+    if (dir->rawLen < MAX_FRAME)
+    {
+        dir->raw[dir->rawLen++] = byte;
+    }
+    else
+    {
+        dir->overflow = TRUE;
+    }
+}
+
+
+void printDirection(int d, double seconds)
+{
+    Direction *dir = &dirs[d];
+    printf("\n%s\n", dirNames[d]);
+    printf("  Frames       :");
+    for (int t = 0; t < FT_COUNT; t++)
+    {
+        if (dir->frames[t] > 0)
+        {
+            printf(" %s=%lu", frameTypeNames[t], dir->frames[t]);
+        }
+    }
+    printf("\n");
+    printf("  Wire bytes   : %lu delivered, %lu offered, %lu dropped (cable off), %lu corrupted\n",
+           dir->wireBytes, dir->offeredBytes, dir->droppedBytes, dir->corruptedBytes);
+    printf("  Payload bytes: %lu (%.1f%% of delivered)", dir->payloadBytes,
+           dir->wireBytes > 0 ? 100.0 * dir->payloadBytes / dir->wireBytes : 0.0);
+    if (seconds > 0)
+    {
+        printf(", goodput %.0f bit/s", dir->payloadBytes * 8 / seconds);
+    }
+    printf("\n");
+    printf("  Stuffing     : %lu escape bytes, %lu COBS code bytes\n", dir->stuffingBytes, dir->cobsBytes);
+    printf("  Wasted bytes : %lu (errored / retransmitted frames and garbage)\n",
+           dir->wastedBytes + dir->droppedBytes);
+    printf("  Errors       : %lu retransmissions, %lu BCC1 errors, %lu BCC2 errors\n",
+           dir->retransmissions, dir->bcc1Errors, dir->bcc2Errors);
+}
+
+
+// Open a capture file and read its header
+// Returns NULL (after printing why) if the file is not a usable capture
+FILE *openCapture(const char *filename, CaptureHeader *header)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return NULL;
+    }
+    if (fread(header, sizeof(*header), 1, fp) != 1 || memcmp(header->magic, CAPTURE_MAGIC, 4) != 0 ||
+        header->version != CAPTURE_VERSION || header->recordSize != sizeof(CaptureRecord))
+    {
+        printf("%s is not a version %d cable capture\n", filename, CAPTURE_VERSION);
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+
+// Byte stream delivered in one direction of a capture
+typedef struct
+{
+    unsigned char *bytes;
+    uint64_t *usec;
+    long count;
+} Stream;
+
+
+// Load the delivered byte streams of both directions of a capture
+// Returns 0 on success, -1 on error
+int loadStreams(const char *filename, Stream streams[2])
+{
+    CaptureHeader header;
+    FILE *fp = openCapture(filename, &header);
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    long capacity[2] = {0, 0};
+    memset(streams, 0, 2 * sizeof(Stream));
+    CaptureRecord rec;
+    uint64_t epoch = 0;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        if (rec.dir == CAP_EVENT && rec.byte == CAP_EV_EPOCH)
+        {
+            epoch = (uint64_t) rec.usec << 32;
+        }
+        if (rec.dir > CAP_RX2TX || !(rec.flags & CAP_F_OUT))
+        {
+            continue;
+        }
+        Stream *st = &streams[rec.dir];
+        if (st->count == capacity[rec.dir])
+        {
+            capacity[rec.dir] = capacity[rec.dir] ? 2 * capacity[rec.dir] : 4096;
+            // A failed realloc keeps the old block, freed below with the rest
+            unsigned char *bytes = realloc(st->bytes, capacity[rec.dir]);
+            if (bytes != NULL)
+            {
+                st->bytes = bytes;
+            }
+            uint64_t *usec = realloc(st->usec, capacity[rec.dir] * sizeof(uint64_t));
+            if (usec != NULL)
+            {
+                st->usec = usec;
+            }
+            if (bytes == NULL || usec == NULL)
+            {
+                printf("Out of memory loading %s\n", filename);
+                for (int d = CAP_TX2RX; d <= CAP_RX2TX; d++)
+                {
+                    free(streams[d].bytes);
+                    free(streams[d].usec);
+                }
+                fclose(fp);
+                return -1;
+            }
+        }
+        st->bytes[st->count] = rec.byte;
+        st->usec[st->count] = epoch | rec.usec;
+        st->count++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+// Compare the delivered byte streams of two captures, direction by direction:
+// where they first diverge and how long each took to carry its bytes
+int compareCaptures(const char *filename, const char *reference)
+{
+    Stream a[2], b[2];
+    if (loadStreams(filename, a) < 0 || loadStreams(reference, b) < 0)
+    {
+        return 1;
+    }
+
+    printf("Comparing %s with reference %s\n", filename, reference);
+    for (int d = CAP_TX2RX; d <= CAP_RX2TX; d++)
+    {
+        long common = a[d].count < b[d].count ? a[d].count : b[d].count;
+        long same = 0;
+        while (same < common && a[d].bytes[same] == b[d].bytes[same])
+        {
+            same++;
+        }
+
+        printf("\n%s\n", dirNames[d]);
+        printf("  Bytes    : %ld (reference %ld)\n", a[d].count, b[d].count);
+        if (same == a[d].count && same == b[d].count)
+        {
+            printf("  Content  : identical\n");
+        }
+        else if (same == common)
+        {
+            printf("  Content  : one stream is a prefix of the other (%ld common bytes)\n", same);
+        }
+        else
+        {
+            printf("  Content  : first difference at byte %ld (%02X vs %02X) at %.3f ms (reference %.3f ms)\n",
+                   same, a[d].bytes[same], b[d].bytes[same], (a[d].usec[same] - a[d].usec[0]) / 1000.0,
+                   (b[d].usec[same] - b[d].usec[0]) / 1000.0);
+        }
+        if (a[d].count > 0 && b[d].count > 0)
+        {
+            double durA = (a[d].usec[a[d].count - 1] - a[d].usec[0]) / 1000.0;
+            double durB = (b[d].usec[b[d].count - 1] - b[d].usec[0]) / 1000.0;
+            printf("  Duration : %.3f ms (reference %.3f ms", durA, durB);
+            if (durB > 0)
+            {
+                printf(", %.1f%%", 100.0 * durA / durB);
+            }
+            printf(")\n");
+        }
+        free(a[d].bytes);
+        free(a[d].usec);
+        free(b[d].bytes);
+        free(b[d].usec);
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    double gapMs = -1.0;
+    const char *reference = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "qg:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            quiet = TRUE;
+            break;
+        case 'g':
+            gapMs = atof(optarg);
+            break;
+        case 'c':
+            reference = optarg;
+            break;
+        default:
+            printf("Usage: %s [-q] [-g gap_ms] [-c reference_capture] capture_file\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc)
+    {
+        printf("Usage: %s [-q] [-g gap_ms] [-c reference_capture] capture_file\n", argv[0]);
+        exit(1);
+    }
+
+    if (reference != NULL)
+    {
+        return compareCaptures(argv[optind], reference);
+    }
+
+    dirs[CAP_TX2RX].lastControl = -1;
+    dirs[CAP_RX2TX].lastControl = -1;
+
+    CaptureHeader header;
+    FILE *fp = openCapture(argv[optind], &header);
+    if (fp == NULL)
+    {
+        exit(1);
+    }
+
+    // By default, report silences longer than 20 byte times of the slowest
+    // direction (at least 5 ms)
+    uint32_t slowest = header.baudRate[CAP_TX2RX] < header.baudRate[CAP_RX2TX] ? header.baudRate[CAP_TX2RX]
+                                                                                : header.baudRate[CAP_RX2TX];
+    double byteUsec = slowest > 0 ? 1.0e7 / slowest : 1000.0;
+    uint64_t gapThreshold = gapMs >= 0 ? (uint64_t) (gapMs * 1000) : (uint64_t) (20 * byteUsec);
+    if (gapMs < 0 && gapThreshold < 5000)
+    {
+        gapThreshold = 5000;
+    }
+
+    printf("Capture %s\n", argv[optind]);
+    for (int d = CAP_TX2RX; d <= CAP_RX2TX; d++)
+    {
+        printf("  %s: baud rate %u, propagation delay %u usec\n", dirNames[d], header.baudRate[d], header.propDelay[d]);
+    }
+    if (!quiet)
+    {
+        printf("\n    time(ms)  dur(ms)  idle(ms)  dir   type    seq   len  wire  status\n");
+    }
+
+    CaptureRecord rec;
+    uint64_t epoch = 0;
+    uint64_t t = 0;
+    uint64_t first = 0;
+    uint64_t lastByte = 0;
+    int seenByte = FALSE;
+    unsigned long overruns = 0;
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        if (rec.dir == CAP_EVENT)
+        {
+            switch (rec.byte)
+            {
+            case CAP_EV_EPOCH:
+                epoch = (uint64_t) rec.usec << 32;
+                break;
+            case CAP_EV_CABLE_OFF:
+            case CAP_EV_CABLE_ON:
+                if (!quiet)
+                {
+                    const char *which = rec.flags == (1 << CAP_TX2RX) ? dirNames[CAP_TX2RX]
+                                        : rec.flags == (1 << CAP_RX2TX) ? dirNames[CAP_RX2TX]
+                                                                        : "CABLE";
+                    printf("%12.3f  --- %s %s ---\n", (epoch | rec.usec) / 1000.0, which,
+                           rec.byte == CAP_EV_CABLE_OFF ? "OFF" : "ON");
+                }
+                break;
+            case CAP_EV_OVERRUN:
+                overruns++;
+                break;
+            default:
+                break;
+            }
+            continue;
+        }
+        if (rec.dir > CAP_RX2TX)
+        {
+            continue;
+        }
+
+        t = epoch | rec.usec;
+        if (!seenByte)
+        {
+            first = t;
+            seenByte = TRUE;
+        }
+        else if (t - lastByte > gapThreshold)
+        {
+            recordGap(lastByte, t - lastByte);
+        }
+        lastByte = t;
+
+        Direction *dir = &dirs[rec.dir];
+        if (rec.flags & CAP_F_IN)
+        {
+            dir->offeredBytes++;
+            if (rec.flags & CAP_F_DROPPED)
+            {
+                dir->droppedBytes++;
+            }
+        }
+        if (rec.flags & CAP_F_OUT)
+        {
+            dir->wireBytes++;
+            if (rec.flags & CAP_F_CORRUPTED)
+            {
+                dir->corruptedBytes++;
+            }
+            decodeByte(rec.dir, rec.byte, t);
+        }
+    }
+    fclose(fp);
+
+    double seconds = seenByte ? (lastByte - first) / 1.0e6 : 0.0;
+    printf("\nDuration: %.3f s\n", seconds);
+    printDirection(CAP_TX2RX, seconds);
+    printDirection(CAP_RX2TX, seconds);
+
+    printf("\nIdle: %.3f s (%.1f%% of the capture) in gaps over %.1f ms\n", totalIdle / 1.0e6,
+           seconds > 0 ? 100.0 * totalIdle / 1.0e6 / seconds : 0.0, gapThreshold / 1000.0);
+    for (int i = 0; i < nGaps; i++)
+    {
+        printf("  %10.3f ms at %10.3f ms", gaps[i].length / 1000.0, gaps[i].start / 1000.0);
+        if (gaps[i].lastDir >= 0)
+        {
+            printf(", after %s %s", dirNames[gaps[i].lastDir], frameTypeNames[gaps[i].lastType]);
+        }
+        printf("\n");
+    }
+
+    if (overruns > 0)
+    {
+        printf("\nWARNING: capture writer overran %lu times, some bytes are missing\n", overruns);
+    }
+    return 0;
+}
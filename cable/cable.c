@@ -1,13 +1,21 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates pairs of virtual Tx / Rx serial ports using "socat".
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
+//
+// Usage: cable [number_of_pairs]
+//   Pair 0 uses /dev/ttyS10 (Tx) and /dev/ttyS11 (Rx), pair 1 uses /dev/ttyS12
+//   and /dev/ttyS13, and so on. Every pair has its own parameters, delay lines,
+//   statistics, log and capture.
 
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,8 +25,10 @@
 #include <time.h>
 #include <unistd.h>
 
-#define TXDEV "/dev/ttyS10"
-#define RXDEV "/dev/ttyS11"
+#include "capture.h"
+
+#define FIRST_TTY 10  // Pair n uses /dev/ttyS(FIRST_TTY + 2n) and /dev/ttyS(FIRST_TTY + 2n + 1)
+#define MAX_PAIRS 16
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
 #define BAUDRATE B9600         // For struct termios
@@ -28,32 +38,81 @@
 #define TRUE 1
 
 #define BUF_SIZE 2048
-
-// Current running parameters
-struct Parameters {
-    int cableOn;
-    double byteER;   // Byte error rate
+#define DEV_SIZE 32
+#define CAPTURE_RING_SIZE 65536 // Capture records in flight, power of two
+
+// Parameters, propagation delay line and statistics of one direction of a
+// cable pair. Each direction is paced by its own baud rate clock.
+struct Direction {
+    char label[DEV_SIZE]; // Name used in messages
+    int capDir;         // CAP_TX2RX or CAP_RX2TX
+    int on;             // FALSE if this direction is disconnected
+    double byteER;      // Byte error rate
+    double ber;         // Bit error rate, as requested
     struct timespec byteDelay;
+    unsigned long baudRate;
     unsigned long propDelay;   // Desired propagation delay in usec
     int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
+    char *buf;
+    char *valid;  // TRUE if corresponding entry holds a byte
+    long idx;     // Input index for the buffer
+    struct timespec nextTime;  // When the next byte slot starts
+    unsigned int rngState;     // Noise generator, seeded per direction for reproducible runs
+
+    // Statistics
+    unsigned long bytesIn;     // Bytes read from the sending endpoint
+    unsigned long bytesOut;    // Bytes delivered to the receiving endpoint
+    unsigned long dropped;     // Bytes read while this direction was off
+    unsigned long corrupted;   // Bytes delivered with noise
+};
+
+// Binary capture state. The cable loop only appends records to a
+// single-producer / single-consumer ring; a writer thread drains the ring to
+// disk so that file I/O never runs inside the timing-critical loop.
+struct Capture {
+    FILE *file;
+    pthread_t writer;
+    atomic_int running;
+    CaptureRecord *ring;
+    atomic_ulong head;    // Next slot filled by the cable loop
+    atomic_ulong tail;    // Next slot drained by the writer thread
+    unsigned long lost;   // Records dropped because the ring was full
+    int overrun;          // TRUE if an overrun event is still to be recorded
+    uint32_t epoch;       // High 32 bits of the last recorded timestamp
+    struct timespec start;
+};
+
+// Recorded tx2rx stream fed to the receiver instead of the transmitter output
+struct Replay {
+    unsigned char *bytes;
+    uint64_t *usec;        // Recorded delivery time of each byte, from the first one
+    long count;
+    long next;             // Next byte to deliver
+    double speed;          // Time compression factor, 0 = as fast as the baud rate allows
+    struct timespec start;
+};
+
+// A virtual cable: two serial ports connected through two directions
+struct Pair {
+    int id;
+    char txDev[DEV_SIZE];   // Port opened by the transmitter
+    char rxDev[DEV_SIZE];   // Port opened by the receiver
+    char txEmu[DEV_SIZE];   // Other end of the transmitter port, used by the cable
+    char rxEmu[DEV_SIZE];   // Other end of the receiver port, used by the cable
+    int fdTx;
+    int fdRx;
+    struct termios oldtioTx;
+    struct termios oldtioRx;
+    struct Direction tx2rx;
+    struct Direction rx2tx;
     FILE *logfile;
+    int cableIdle;
+    struct Capture cap;
+    struct Replay replay;
 };
 
-struct Parameters par = {
-    .cableOn = TRUE,
-    .byteER = 0.0,
-    .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
-    .logfile = NULL};
+struct Pair pairs[MAX_PAIRS];
+int nPairs = 1;
 
 // Returns: serial port file descriptor (fd).
 int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
@@ -90,45 +149,57 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
+// Initialize the ring buffer that implements the propagation delay of a
+// direction
 // Returns 0 on success, -1 on failure
-int init_ring_buffers(void)
+int init_ring_buffer(struct Direction *dir)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
+    long nsecPropDelay = 1000 * dir->propDelay;
+    long bytesInFlight = nsecPropDelay / dir->byteDelay.tv_nsec;
     // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    if (nsecPropDelay % dir->byteDelay.tv_nsec > dir->byteDelay.tv_nsec / 2)
     {
         ++bytesInFlight;
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+    long actualPropDelay = bytesInFlight * dir->byteDelay.tv_nsec / 1000; // usec
+    dir->bufSize = bytesInFlight + 1;
+    dir->buf = realloc(dir->buf, dir->bufSize);
+    dir->valid = realloc(dir->valid, dir->bufSize);
+    if (dir->buf == NULL || dir->valid == NULL)
     {
         return -1;
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
+    bzero(dir->valid, dir->bufSize);
+    dir->idx = 0;
+    printf("%s PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", dir->label, actualPropDelay, dir->propDelay);
     return 0;
 }
 
 
-// Set the byte delay corresponding to the selected baud rate
-void set_baud_rate(unsigned long baud)
+// Set the byte delay of a direction corresponding to the selected baud rate
+void set_baud_rate(struct Direction *dir, unsigned long baud)
 {
     // 10 bit times per byte; delay in nanoseconds
     double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
-    printf("BAUD RATE: %lu\n", baud);
-    init_ring_buffers();
+    dir->byteDelay.tv_sec = 0;
+    dir->byteDelay.tv_nsec = (long) delay;
+    dir->baudRate = baud;
+    printf("%s BAUD RATE: %lu\n", dir->label, baud);
+    init_ring_buffer(dir);
+}
+
+
+// Set the bit error rate of a direction
+void set_ber(struct Direction *dir, double ber)
+{
+    // Compute pow(1 - ber, 8) without libm
+    double acc = 1 - ber;
+    acc *= acc;   // Squared
+    acc *= acc;   // To the fourth
+    acc *= acc;   // To the eightth
+    dir->byteER = 1.0 - acc;
+    dir->ber = ber;
+    printf("%s BER SET TO %lf\n", dir->label, ber);
 }
 
 
@@ -197,23 +268,23 @@ int timespec_is_negative(const struct timespec *t)
 }
 
 
-void endlog(void)
+void endlog(struct Pair *pair)
 {
-    if (par.logfile != NULL)
+    if (pair->logfile != NULL)
     {
-        fclose(par.logfile);
-        par.logfile = NULL;
+        fclose(pair->logfile);
+        pair->logfile = NULL;
     }
 }
 
 
-void startlog(const char *filename)
+void startlog(struct Pair *pair, const char *filename)
 {
-    endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
+    endlog(pair);
+    pair->logfile = fopen(filename, "w");
+    if (pair->logfile != NULL)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
+        fprintf(pair->logfile, "Tx->Rx | Rx->Tx\n");
         printf("LOGGING TO FILE %s\n", filename);
     }
     else
@@ -223,15 +294,270 @@ void startlog(const char *filename)
 }
 
 
+// Append a record to the capture ring. Never blocks: if the writer thread has
+// fallen behind, the record is dropped and an overrun event is recorded later.
+void capture_append(struct Capture *cap, uint8_t dir, uint8_t flags, uint8_t byte, uint32_t usec)
+{
+    unsigned long head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&cap->tail, memory_order_acquire);
+    if (head - tail >= CAPTURE_RING_SIZE - (cap->overrun ? 1 : 0))
+    {
+        ++cap->lost;
+        cap->overrun = TRUE;
+        return;
+    }
+    if (cap->overrun)
+    {
+        CaptureRecord *ev = &cap->ring[head++ % CAPTURE_RING_SIZE];
+        *ev = (CaptureRecord) { .usec = usec, .dir = CAP_EVENT, .byte = CAP_EV_OVERRUN };
+        cap->overrun = FALSE;
+    }
+    CaptureRecord *rec = &cap->ring[head++ % CAPTURE_RING_SIZE];
+    *rec = (CaptureRecord) { .usec = usec, .dir = dir, .flags = flags, .byte = byte };
+    atomic_store_explicit(&cap->head, head, memory_order_release);
+}
+
+
+// Record a byte or event observed at time "now"
+void capture_push(struct Capture *cap, uint8_t dir, uint8_t flags, uint8_t byte, const struct timespec *now)
+{
+    struct timespec elapsed = timespec_diff(now, &cap->start);
+    uint64_t usec = (uint64_t) elapsed.tv_sec * 1000000 + elapsed.tv_nsec / 1000;
+    if ((uint32_t) (usec >> 32) != cap->epoch)
+    {
+        cap->epoch = (uint32_t) (usec >> 32);
+        capture_append(cap, CAP_EVENT, 0, CAP_EV_EPOCH, cap->epoch);
+    }
+    capture_append(cap, dir, flags, byte, (uint32_t) usec);
+}
+
+
+// Writer thread: drain the capture ring to the capture file in large chunks
+void *capture_writer(void *arg)
+{
+    struct Capture *cap = arg;
+    struct timespec idle = { .tv_sec = 0, .tv_nsec = 10000000 }; // 10 ms
+
+    while (TRUE)
+    {
+        int running = atomic_load(&cap->running);
+        unsigned long tail = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&cap->head, memory_order_acquire);
+        if (head == tail)
+        {
+            if (!running)
+            {
+                break;
+            }
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        unsigned long first = tail % CAPTURE_RING_SIZE;
+        unsigned long count = head - tail;
+        if (first + count > CAPTURE_RING_SIZE)
+        {
+            count = CAPTURE_RING_SIZE - first;
+        }
+        fwrite(cap->ring + first, sizeof(CaptureRecord), count, cap->file);
+        atomic_store_explicit(&cap->tail, tail + count, memory_order_release);
+    }
+    return NULL;
+}
+
+
+void endcapture(struct Pair *pair)
+{
+    struct Capture *cap = &pair->cap;
+    if (cap->file != NULL)
+    {
+        atomic_store(&cap->running, FALSE);
+        pthread_join(cap->writer, NULL);
+        fclose(cap->file);
+        cap->file = NULL;
+        if (cap->lost > 0)
+        {
+            printf("CAPTURE LOST %lu RECORDS (WRITER TOO SLOW)\n", cap->lost);
+        }
+    }
+}
+
+
+void startcapture(struct Pair *pair, const char *filename)
+{
+    struct Capture *cap = &pair->cap;
+    endcapture(pair);
+    if (cap->ring == NULL)
+    {
+        cap->ring = malloc(CAPTURE_RING_SIZE * sizeof(CaptureRecord));
+        if (cap->ring == NULL)
+        {
+            printf("ERROR ALLOCATING CAPTURE BUFFER, NOT CAPTURING\n");
+            return;
+        }
+    }
+    cap->file = fopen(filename, "wb");
+    if (cap->file == NULL)
+    {
+        printf("ERROR OPENING FILE %s, NOT CAPTURING\n", filename);
+        return;
+    }
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    CaptureHeader header = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .recordSize = sizeof(CaptureRecord),
+        .baudRate = {pair->tx2rx.baudRate, pair->rx2tx.baudRate},
+        .propDelay = {pair->tx2rx.propDelay, pair->rx2tx.propDelay},
+        .startSec = wall.tv_sec,
+        .startNsec = wall.tv_nsec};
+    fwrite(&header, sizeof(header), 1, cap->file);
+
+    clock_gettime(CLOCK_MONOTONIC, &cap->start);
+    atomic_store(&cap->head, 0);
+    atomic_store(&cap->tail, 0);
+    cap->lost = 0;
+    cap->overrun = FALSE;
+    cap->epoch = 0;
+    atomic_store(&cap->running, TRUE);
+
+    // The cable loop runs with RT priority; the writer must not compete with it
+    pthread_attr_t attr;
+    struct sched_param sp = { .sched_priority = 0 };
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &sp);
+    int err = pthread_create(&cap->writer, &attr, capture_writer, cap);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+        fclose(cap->file);
+        cap->file = NULL;
+        printf("ERROR STARTING CAPTURE WRITER, NOT CAPTURING\n");
+        return;
+    }
+    printf("CAPTURING TO FILE %s\n", filename);
+}
+
+
+void endreplay(struct Pair *pair)
+{
+    struct Replay *replay = &pair->replay;
+    free(replay->bytes);
+    free(replay->usec);
+    replay->bytes = NULL;
+    replay->usec = NULL;
+}
+
+
+// Load the bytes delivered to the receiver (tx2rx, after noise) from a capture
+// and start feeding them to the receiver of the pair, with their original
+// timing divided by "speed" (0 = back to back at the current baud rate).
+// While replaying, the transmitter output is discarded.
+void startreplay(struct Pair *pair, const char *filename, double speed)
+{
+    struct Replay *replay = &pair->replay;
+    endreplay(pair);
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        printf("ERROR OPENING FILE %s, NOT REPLAYING\n", filename);
+        return;
+    }
+    CaptureHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CAPTURE_MAGIC, 4) != 0 ||
+        header.version != CAPTURE_VERSION || header.recordSize != sizeof(CaptureRecord))
+    {
+        printf("%s IS NOT A VERSION %d CAPTURE, NOT REPLAYING\n", filename, CAPTURE_VERSION);
+        fclose(fp);
+        return;
+    }
+
+    // The whole stream is loaded up front to keep file I/O out of the cable loop
+    long capacity = 4096;
+    replay->bytes = malloc(capacity);
+    replay->usec = malloc(capacity * sizeof(uint64_t));
+    replay->count = 0;
+    CaptureRecord rec;
+    uint64_t epoch = 0;
+    uint64_t first = 0;
+    int allocated = replay->bytes != NULL && replay->usec != NULL;
+    while (allocated && fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        if (rec.dir == CAP_EVENT && rec.byte == CAP_EV_EPOCH)
+        {
+            epoch = (uint64_t) rec.usec << 32;
+        }
+        if (rec.dir != CAP_TX2RX || !(rec.flags & CAP_F_OUT))
+        {
+            continue;
+        }
+        if (replay->count == capacity)
+        {
+            capacity *= 2;
+            // A failed realloc keeps the old block, which endreplay frees
+            unsigned char *bytes = realloc(replay->bytes, capacity);
+            if (bytes != NULL)
+            {
+                replay->bytes = bytes;
+            }
+            uint64_t *usec = realloc(replay->usec, capacity * sizeof(uint64_t));
+            if (usec != NULL)
+            {
+                replay->usec = usec;
+            }
+            allocated = bytes != NULL && usec != NULL;
+            if (!allocated)
+            {
+                break;
+            }
+        }
+        if (replay->count == 0)
+        {
+            first = epoch | rec.usec;
+        }
+        replay->bytes[replay->count] = rec.byte;
+        replay->usec[replay->count] = (epoch | rec.usec) - first;
+        replay->count++;
+    }
+    fclose(fp);
+
+    if (!allocated)
+    {
+        printf("ERROR ALLOCATING REPLAY BUFFER, NOT REPLAYING\n");
+        endreplay(pair);
+        return;
+    }
+    if (replay->count == 0)
+    {
+        printf("NO TX->RX BYTES IN %s, NOT REPLAYING\n", filename);
+        endreplay(pair);
+        return;
+    }
+
+    replay->next = 0;
+    replay->speed = speed;
+    clock_gettime(CLOCK_MONOTONIC, &replay->start);
+    printf("REPLAYING %ld BYTES FROM %s (SPEED %s%.2lf)\n", replay->count, filename,
+           speed > 0 ? "x" : "MAX, ", speed);
+}
+
+
 // Show help
 void help()
 {
-    printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
-           "\n"
+    printf("\n\n");
+    for (int i = 0; i < nPairs; i++)
+    {
+        printf("Pair %d: transmitter must open %s, receiver must open %s\n", i, pairs[i].txDev, pairs[i].rxDev);
+    }
+    printf("\n"
            "The cable program is sensible to the following interactive commands:\n"
            "--- help         : show this help\n"
+           "--- status       : show the current parameters and statistics\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
            "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
@@ -242,79 +568,188 @@ void help()
            "                   delay (10 / baud_rate)\n"
            "--- log <file>   : log transmitted data to file\n"
            "--- endlog       : stop logging transmitted data\n"
+           "--- capture <file>: capture timestamped traffic to a binary file\n"
+           "                   (decode it with the analyzer program)\n"
+           "--- endcapture   : stop capturing traffic\n"
+           "--- replay <file> [speed]: feed the tx2rx bytes of a capture to the receiver\n"
+           "                   instead of the transmitter output, with the recorded\n"
+           "                   timing divided by speed (default=1, 0 = back to back)\n"
+           "--- endreplay    : stop replaying\n"
+           "--- seed <n>     : reseed the noise generator, for reproducible errors\n"
            "--- quit         : terminate the program\n"
            "\n"
+           "The on, off, ber, baud, prop and seed commands apply to both directions, unless\n"
+           "prefixed with tx2rx or rx2tx to configure a single direction, e.g.:\n"
+           "--- rx2tx ber 0.001 : noisy return path only\n"
+           "--- tx2rx baud 115200 : fast forward path only\n"
+           "\n"
+           "Commands may be prefixed with a pair number. Without it, on, off, ber, baud,\n"
+           "prop, seed and status apply to every pair, and the other commands to pair 0:\n"
+           "--- 1 rx2tx off  : disconnect the return path of pair 1 only\n"
+           "\n"
            "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
            "           ongoing will result in losses.\n"
            "\n");
 }
 
-int main(int argc, char *argv[])
-{
-    printf("\n");
 
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorTx,mode=777,raw,echo=0 &");
-    sleep(1);
-    printf("\n");
+// Show the parameters and statistics of each direction of a pair
+void status(struct Pair *pair)
+{
+    struct Direction *dirs[2] = {&pair->tx2rx, &pair->rx2tx};
+    for (int i = 0; i < 2; i++)
+    {
+        printf("%s: %s, baud %lu, BER %lf, propagation delay %lu usec\n"
+               "   %lu bytes in, %lu bytes out, %lu dropped, %lu corrupted\n",
+               dirs[i]->label, dirs[i]->on ? "ON" : "OFF", dirs[i]->baudRate, dirs[i]->ber, dirs[i]->propDelay,
+               dirs[i]->bytesIn, dirs[i]->bytesOut, dirs[i]->dropped, dirs[i]->corrupted);
+    }
+}
 
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorRx,mode=777,raw,echo=0 &");
-    sleep(1);
 
-    help();
+// Move one byte slot of a direction: read a byte from the sending endpoint
+// into the delay line and deliver the byte leaving the delay line.
+// "in" and "out" receive the logged representation of both bytes.
+void step_direction(struct Pair *pair, struct Direction *dir, int fdIn, int fdOut, const struct timespec *now,
+                    char *in, char *out)
+{
+    int bytesIn = read(fdIn, dir->buf + dir->idx, 1);
+    dir->valid[dir->idx] = bytesIn > 0;
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+    if (bytesIn > 0)
+    {
+        dir->bytesIn++;
+        if (!dir->on)
+        {
+            dir->dropped++;
+        }
+        if (pair->cap.file != NULL)  // Currently capturing
+        {
+            capture_push(&pair->cap, dir->capDir, CAP_F_IN | (dir->on ? 0 : CAP_F_DROPPED), dir->buf[dir->idx], now);
+        }
+    }
 
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
+    if (!dir->on)
+    {
+        // Ignore what was read
+        dir->valid[dir->idx] = 0;
+    }
 
-    if (fdTx < 0)
+    if (pair->logfile != NULL)  // Currently logging
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        if (dir->valid[dir->idx])
+        {
+            sprintf(in, "%02hhX", dir->buf[dir->idx]);
+        }
+        else
+        {
+            memcpy(in, "  ", 3);
+        }
     }
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+    // Advance index to next position
+    dir->idx = (dir->idx + 1) % dir->bufSize;
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+    if (dir->on && dir->valid[dir->idx])
+    {
+        uint8_t corrupted = 0;
+        // Add error, if applicable
+        if (dir->byteER != 0.0 && (double) rand_r(&dir->rngState) / (double) RAND_MAX < dir->byteER)
+        {
+            // At most one wrong bit per byte, good enough if ber < 0.02
+            dir->buf[dir->idx] ^= (char) 1 << rand_r(&dir->rngState) % 8;
+            corrupted = CAP_F_CORRUPTED;
+            dir->corrupted++;
+        }
+        write(fdOut, dir->buf + dir->idx, 1);
+        dir->bytesOut++;
+        if (pair->cap.file != NULL)
+        {
+            capture_push(&pair->cap, dir->capDir, CAP_F_OUT | corrupted, dir->buf[dir->idx], now);
+        }
+    }
 
-    if (fdRx < 0)
+    if (pair->logfile != NULL)  // Currently logging
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        if (dir->on && dir->valid[dir->idx])
+        {
+            sprintf(out, "%02hhX", dir->buf[dir->idx]);
+        }
+        else
+        {
+            memcpy(out, "  ", 3);
+        }
     }
+}
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
-    char rxStdin[BUF_SIZE] = {0};
+// Move one byte slot of the tx2rx direction while replaying: discard the
+// transmitter output and deliver the next recorded byte once it is due
+void step_replay(struct Pair *pair, const struct timespec *now, char *in, char *out)
+{
+    struct Replay *replay = &pair->replay;
+    struct Direction *dir = &pair->tx2rx;
+    unsigned char byte;
 
-    int STOP = FALSE;
+    if (read(pair->fdTx, &byte, 1) > 0)
+    {
+        dir->bytesIn++;
+        dir->dropped++;
+        if (pair->cap.file != NULL)
+        {
+            capture_push(&pair->cap, CAP_TX2RX, CAP_F_IN | CAP_F_DROPPED, byte, now);
+        }
+    }
 
-    set_baud_rate(DEFAULT_BAUDRATE);
+    if (replay->speed > 0)
+    {
+        struct timespec elapsed = timespec_diff(now, &replay->start);
+        double usec = (elapsed.tv_sec * 1.0e6 + elapsed.tv_nsec / 1.0e3) * replay->speed;
+        if (usec < replay->usec[replay->next])
+        {
+            return;
+        }
+    }
 
-    set_rt_priority();
+    byte = replay->bytes[replay->next++];
+    write(pair->fdRx, &byte, 1);
+    dir->bytesOut++;
+    if (pair->cap.file != NULL)
+    {
+        capture_push(&pair->cap, CAP_TX2RX, CAP_F_OUT, byte, now);
+    }
+    if (pair->logfile != NULL)
+    {
+        sprintf(out, "%02hhX", byte);
+    }
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
+    if (replay->next == replay->count)
+    {
+        struct timespec elapsed = timespec_diff(now, &replay->start);
+        printf("REPLAY FINISHED: %ld BYTES IN %.3lf s\n", replay->count, elapsed.tv_sec + elapsed.tv_nsec / 1.0e9);
+        endreplay(pair);
+    }
+}
 
-    printf("\nCable ready\n\n");
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
+// Move the directions of a pair whose byte slot has started
+void step_pair(struct Pair *pair, const struct timespec *now)
+{
+    // For logging
+    char tx2rxTx[3] = "  ", tx2rxRx[3] = "  ", rx2txTx[3] = "  ", rx2txRx[3] = "  ";
+    static int unreliableRate = FALSE;
 
-    while (STOP == FALSE)
+    struct Direction *dirs[2] = {&pair->tx2rx, &pair->rx2tx};
+    for (int i = 0; i < 2; i++)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
+        struct Direction *dir = dirs[i];
+        if (timespec_comp(now, &dir->nextTime) < 0)
+        {
+            continue;
+        }
+
+        // Check how much we are running late (if any)
+        struct timespec timeDiff = timespec_diff(now, &dir->nextTime);
         if (timeDiff.tv_sec >= 1)
         {
             if (unreliableRate == FALSE)
@@ -324,234 +759,461 @@ int main(int argc, char *argv[])
                 unreliableRate = TRUE;
             }
         }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
+        dir->nextTime = timespec_sum(&dir->nextTime, &dir->byteDelay);
+
+        if (dir == &pair->tx2rx && pair->replay.bytes != NULL)
+        {
+            step_replay(pair, now, tx2rxTx, tx2rxRx);
+        }
+        else if (dir == &pair->tx2rx)
+        {
+            step_direction(pair, dir, pair->fdTx, pair->fdRx, now, tx2rxTx, tx2rxRx);
+        }
+        else
+        {
+            step_direction(pair, dir, pair->fdRx, pair->fdTx, now, rx2txTx, rx2txRx);
+        }
+    }
+
+    if (pair->logfile != NULL)  // Currently logging
+    {
+        if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
         {
-            skipWait = TRUE;
+            if (pair->cableIdle == FALSE)
+            {
+                fputs("---------------\n", pair->logfile);
+                pair->cableIdle = TRUE;
+            }
         }
         else
         {
-            skipWait = FALSE;
+            fprintf(pair->logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
+            pair->cableIdle = FALSE;
+        }
+    }
+}
+
+
+// Turn the selected directions of a pair on or off
+void set_on(struct Pair *pair, struct Direction **dirs, int nDirs, int on, const struct timespec *now)
+{
+    uint8_t changed = 0;
+    for (int i = 0; i < nDirs; i++)
+    {
+        if (dirs[i]->on != on)
+        {
+            changed |= 1 << dirs[i]->capDir;
         }
+        dirs[i]->on = on;
+    }
 
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
+    if (changed && !on && pair->logfile != NULL)
+    {
+        fprintf(pair->logfile, "%s OFF\n", nDirs == 2 ? "CABLE" : dirs[0]->capDir == CAP_TX2RX ? "TX->RX" : "RX->TX");
+    }
+    if (changed && pair->cap.file != NULL)
+    {
+        capture_push(&pair->cap, CAP_EVENT, changed, on ? CAP_EV_CABLE_ON : CAP_EV_CABLE_OFF, now);
+    }
+}
+
+
+// Create the virtual serial ports of a pair and open the cable side of them
+// Returns 0 on success, -1 on failure
+int open_pair(struct Pair *pair, int id)
+{
+    char command[BUF_SIZE];
+    struct termios newtio;
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
+    pair->id = id;
+    snprintf(pair->txDev, DEV_SIZE, "/dev/ttyS%d", FIRST_TTY + 2 * id);
+    snprintf(pair->rxDev, DEV_SIZE, "/dev/ttyS%d", FIRST_TTY + 2 * id + 1);
+    if (id == 0)
+    {
+        strcpy(pair->txEmu, "/dev/emulatorTx");
+        strcpy(pair->rxEmu, "/dev/emulatorRx");
+    }
+    else
+    {
+        snprintf(pair->txEmu, DEV_SIZE, "/dev/emulatorTx%d", id);
+        snprintf(pair->rxEmu, DEV_SIZE, "/dev/emulatorRx%d", id);
+    }
 
-        if (!par.cableOn)
+    struct Direction *dirs[2] = {&pair->tx2rx, &pair->rx2tx};
+    const char *names[2] = {"TX->RX", "RX->TX"};
+    for (int i = 0; i < 2; i++)
+    {
+        memset(dirs[i], 0, sizeof(*dirs[i]));
+        if (nPairs > 1)
         {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
+            snprintf(dirs[i]->label, DEV_SIZE, "PAIR %d %s", id, names[i]);
         }
+        else
+        {
+            strcpy(dirs[i]->label, names[i]);
+        }
+        dirs[i]->capDir = i == 0 ? CAP_TX2RX : CAP_RX2TX;
+        dirs[i]->on = TRUE;
+        dirs[i]->rngState = 1 + dirs[i]->capDir;
+    }
+    pair->logfile = NULL;
+    pair->cableIdle = FALSE;
+    memset(&pair->cap, 0, sizeof(pair->cap));
+    memset(&pair->replay, 0, sizeof(pair->replay));
+
+    snprintf(command, BUF_SIZE, "socat -dd PTY,link=%s,mode=777,raw,echo=0 PTY,link=%s,mode=777,raw,echo=0 &",
+             pair->txDev, pair->txEmu);
+    system(command);
+    sleep(1);
+    printf("\n");
+
+    snprintf(command, BUF_SIZE, "socat -dd PTY,link=%s,mode=777,raw,echo=0 PTY,link=%s,mode=777,raw,echo=0 &",
+             pair->rxDev, pair->rxEmu);
+    system(command);
+    sleep(1);
+
+    pair->fdTx = openSerialPort(pair->txEmu, &pair->oldtioTx, &newtio);
+    if (pair->fdTx < 0)
+    {
+        perror("Opening Tx emulator serial port");
+        return -1;
+    }
+
+    pair->fdRx = openSerialPort(pair->rxEmu, &pair->oldtioRx, &newtio);
+    if (pair->fdRx < 0)
+    {
+        perror("Opening Rx emulator serial port");
+        return -1;
+    }
+
+    set_baud_rate(&pair->tx2rx, DEFAULT_BAUDRATE);
+    set_baud_rate(&pair->rx2tx, DEFAULT_BAUDRATE);
+    return 0;
+}
 
-        if (par.logfile != NULL)  // Currently logging
+
+// Stop logging and capturing, and restore the cable side ports of a pair
+void close_pair(struct Pair *pair)
+{
+    endreplay(pair);
+    endcapture(pair);
+    endlog(pair);
+
+    // Restore the old port settings
+    if (tcsetattr(pair->fdRx, TCSANOW, &pair->oldtioRx) == -1)
+    {
+        perror("tcsetattr");
+    }
+
+    if (tcsetattr(pair->fdTx, TCSANOW, &pair->oldtioTx) == -1)
+    {
+        perror("tcsetattr");
+    }
+
+    close(pair->fdTx);
+    close(pair->fdRx);
+}
+
+
+// Execute a command on the selected directions of a pair
+// Returns TRUE if the program should terminate
+int run_command(struct Pair *pair, struct Direction **dirs, int nDirs, const char *cmd, const struct timespec *now)
+{
+    if (strcmp(cmd, "off") == 0)
+    {
+        printf("%s OFF\n", nDirs == 2 ? "CONNECTION" : dirs[0]->label);
+        set_on(pair, dirs, nDirs, FALSE, now);
+    }
+    else if (strcmp(cmd, "on") == 0)
+    {
+        printf("%s ON\n", nDirs == 2 ? "CONNECTION" : dirs[0]->label);
+        set_on(pair, dirs, nDirs, TRUE, now);
+    }
+    else if (strncmp(cmd, "ber ", 4) == 0)
+    {
+        double ber = -1.0;
+        sscanf(cmd + 4, "%lf", &ber);
+        if (ber >= 0.0 && ber < 1.0)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            for (int i = 0; i < nDirs; i++)
             {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
+                set_ber(dirs[i], ber);
             }
-            else
+            if (ber > 0.01)
             {
-                memcpy(tx2rxTx, "  ", 3);
+                printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
             }
-            if (par.rx2txValid[par.rx2txIdx])
+        }
+        else
+        {
+            printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)\n", ber);
+        }
+    }
+    else if (strncmp(cmd, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        sscanf(cmd + 5, "%lu", &baud);
+        switch (baud) {
+            case 1200:
+            case 1800:
+            case 2400:
+            case 4800:
+            case 9600:
+            case 19200:
+            case 38400:
+            case 57600:
+            case 115200:
+                for (int i = 0; i < nDirs; i++)
+                {
+                    set_baud_rate(dirs[i], baud);
+                }
+                break;
+            default:
+                printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
+        }
+    }
+    else if (strncmp(cmd, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        if (sscanf(cmd + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
+        {
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+        }
+        else
+        {
+            for (int i = 0; i < nDirs; i++)
             {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                dirs[i]->propDelay = propDelay;
+                init_ring_buffer(dirs[i]);
             }
-            else
+        }
+    }
+    else if (strncmp(cmd, "seed ", 5) == 0)
+    {
+        unsigned int seed;
+        if (sscanf(cmd + 5, "%u", &seed) < 1)
+        {
+            printf("BAD SEED\n");
+        }
+        else
+        {
+            for (int i = 0; i < nDirs; i++)
             {
-                memcpy(rx2txTx, "  ", 3);
+                dirs[i]->rngState = seed + dirs[i]->capDir;
+                printf("%s NOISE SEED SET TO %u\n", dirs[i]->label, seed);
             }
         }
+    }
+    else if (nDirs == 1)
+    {
+        printf("BAD COMMAND: only on, off, ber, baud, prop and seed apply to a single direction\n");
+    }
+    else if (strcmp(cmd, "status") == 0)
+    {
+        status(pair);
+    }
+    else if (strncmp(cmd, "log ", 4) == 0)
+    {
+        startlog(pair, cmd + 4);
+    }
+    else if (strcmp(cmd, "endlog") == 0)
+    {
+        endlog(pair);
+        printf("NOT LOGGING\n");
+    }
+    else if (strncmp(cmd, "capture ", 8) == 0)
+    {
+        startcapture(pair, cmd + 8);
+    }
+    else if (strcmp(cmd, "endcapture") == 0)
+    {
+        endcapture(pair);
+        printf("NOT CAPTURING\n");
+    }
+    else if (strncmp(cmd, "replay ", 7) == 0)
+    {
+        char filename[BUF_SIZE];
+        double speed = 1.0;
+        if (sscanf(cmd + 7, "%s %lf", filename, &speed) < 1 || speed < 0)
+        {
+            printf("BAD REPLAY FILE OR SPEED\n");
+        }
+        else
+        {
+            startreplay(pair, filename, speed);
+        }
+    }
+    else if (strcmp(cmd, "endreplay") == 0)
+    {
+        endreplay(pair);
+        printf("NOT REPLAYING\n");
+    }
+    else if (strcmp(cmd, "quit") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strcmp(cmd, "help") == 0) {
+        help();
+    }
+    else {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+    return FALSE;
+}
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
 
-        if (par.cableOn)
+// Parse the optional pair number and direction of a command and run it
+// Returns TRUE if the program should terminate
+int parse_command(char *cmd, const struct timespec *now)
+{
+    int first = 0;
+    int last = nPairs - 1;
+
+    // Optional pair number
+    if (*cmd >= '0' && *cmd <= '9')
+    {
+        char *end;
+        long id = strtol(cmd, &end, 10);
+        if (id >= nPairs || *end != ' ')
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
+            printf("BAD PAIR NUMBER (MUST BE 0 TO %d)\n", nPairs - 1);
+            return FALSE;
+        }
+        first = last = id;
+        cmd = end + 1;
+    }
 
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
-            }
+    // Optional direction
+    int dir = -1;
+    if (strncmp(cmd, "tx2rx ", 6) == 0)
+    {
+        dir = CAP_TX2RX;
+        cmd += 6;
+    }
+    else if (strncmp(cmd, "rx2tx ", 6) == 0)
+    {
+        dir = CAP_RX2TX;
+        cmd += 6;
+    }
+
+    // Only commands that configure the cable apply to every pair
+    if (first != last && strcmp(cmd, "on") != 0 && strcmp(cmd, "off") != 0 && strncmp(cmd, "ber ", 4) != 0 &&
+        strncmp(cmd, "baud ", 5) != 0 && strncmp(cmd, "prop ", 5) != 0 && strncmp(cmd, "seed ", 5) != 0 &&
+        strcmp(cmd, "status") != 0)
+    {
+        last = first;
+    }
+
+    int stop = FALSE;
+    for (int i = first; i <= last; i++)
+    {
+        struct Direction *dirs[2] = {&pairs[i].tx2rx, &pairs[i].rx2tx};
+        if (dir == CAP_RX2TX)
+        {
+            dirs[0] = &pairs[i].rx2tx;
         }
+        stop |= run_command(&pairs[i], dirs, dir < 0 ? 2 : 1, cmd, now);
+    }
+    return stop;
+}
+
 
-        if (par.logfile != NULL)  // Currently logging
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+    {
+        nPairs = atoi(argv[1]);
+        if (nPairs < 1 || nPairs > MAX_PAIRS)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxRx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txRx, "  ", 3);
-            }
+            printf("Usage: %s [number_of_pairs] (1 to %d)\n", argv[0], MAX_PAIRS);
+            exit(1);
+        }
+    }
 
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
-            {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
-            }
-            else
-            {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
-            }
+    printf("\n");
+
+    for (int i = 0; i < nPairs; i++)
+    {
+        if (open_pair(&pairs[i], i) < 0)
+        {
+            exit(-1);
+        }
+    }
+
+    help();
+
+    // Configure stdin to receive commands to this program
+    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+
+    char rxStdin[BUF_SIZE] = {0};
+
+    int STOP = FALSE;
+
+    set_rt_priority();
+
+    printf("\nCable ready\n\n");
+
+    // To compensate for deviations in byte transmission time. Each direction
+    // of each pair has its own schedule, so that all can run at different
+    // baud rates.
+    struct timespec currentTime, nextWait;
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+    for (int i = 0; i < nPairs; i++)
+    {
+        pairs[i].tx2rx.nextTime = currentTime;
+        pairs[i].rx2tx.nextTime = currentTime;
+    }
+
+    while (STOP == FALSE)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &currentTime);
+
+        for (int i = 0; i < nPairs; i++)
+        {
+            step_pair(&pairs[i], &currentTime);
         }
 
         // Read commands from STDIN to control the cable mode
         int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
         if (fromStdin > 0)
         {
+            // Several commands may arrive at once, one per line
             rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
-            {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
-            }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
-            {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eightth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
-                {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
-                    {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
-                    }
-                }
-                else
-                {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
+            char *line = strtok(rxStdin, "\n");
+            while (line != NULL && STOP == FALSE)
             {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
+                STOP = parse_command(line, &currentTime);
+                line = strtok(NULL, "\n");
             }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
-            {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
-                {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
-                {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
-                }
-            }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
-            {
-                startlog(rxStdin + 4);
-            }
-            else if (strcmp(rxStdin, "endlog") == 0)
+        }
+
+        // Wait for the next byte slot of any direction
+        struct timespec *nextTime = &pairs[0].tx2rx.nextTime;
+        for (int i = 0; i < nPairs; i++)
+        {
+            if (timespec_comp(&pairs[i].tx2rx.nextTime, nextTime) < 0)
             {
-                endlog();
-                printf("NOT LOGGING\n");
+                nextTime = &pairs[i].tx2rx.nextTime;
             }
-            else if (strcmp(rxStdin, "quit") == 0)
+            if (timespec_comp(&pairs[i].rx2tx.nextTime, nextTime) < 0)
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
+                nextTime = &pairs[i].rx2tx.nextTime;
             }
         }
-
-        if (skipWait == FALSE) {
+        clock_gettime(CLOCK_MONOTONIC, &currentTime);
+        nextWait = timespec_diff(nextTime, &currentTime);
+        if (!timespec_is_negative(&nextWait)) {
             nanosleep(&nextWait, NULL);
         }
     }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    for (int i = 0; i < nPairs; i++)
     {
-        perror("tcsetattr");
-        exit(-1);
-    }
-
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
+        close_pair(&pairs[i]);
     }
 
-    close(fdTx);
-    close(fdRx);
-
     system("killall socat");
 
     return 0;
@@ -0,0 +1,54 @@
+// Binary capture format written by the virtual cable ("capture" command) and
+// read by the offline protocol analyzer.
+//
+// A capture file is a CaptureHeader followed by a stream of fixed-size
+// CaptureRecords. All fields are stored in host byte order (little endian on
+// the machines the cable runs on).
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "RCAP"
+#define CAPTURE_VERSION 2
+
+// Record directions
+#define CAP_TX2RX 0 // Byte travelling from the transmitter to the receiver
+#define CAP_RX2TX 1 // Byte travelling from the receiver to the transmitter
+#define CAP_EVENT 2 // Cable event, "byte" holds the event code
+
+// Record flags (byte records)
+#define CAP_F_IN 0x01        // Byte read from the sending endpoint
+#define CAP_F_OUT 0x02       // Byte written to the receiving endpoint
+#define CAP_F_CORRUPTED 0x04 // Noise was applied to the byte before writing
+#define CAP_F_DROPPED 0x08   // Byte read while the cable was off (discarded)
+
+// Event codes (CAP_EVENT records). Cable on / off events carry the mask of
+// the affected directions (1 << CAP_TX2RX, 1 << CAP_RX2TX) in "flags".
+#define CAP_EV_EPOCH 0     // "usec" holds the new high 32 bits of the timestamp
+#define CAP_EV_CABLE_OFF 1 // Cable direction(s) disconnected
+#define CAP_EV_CABLE_ON 2  // Cable direction(s) reconnected
+#define CAP_EV_OVERRUN 3   // Records were lost because the writer fell behind
+
+typedef struct
+{
+    char magic[4];         // CAPTURE_MAGIC
+    uint16_t version;      // CAPTURE_VERSION
+    uint16_t recordSize;   // sizeof(CaptureRecord)
+    uint32_t baudRate[2];  // Baud rate of each direction when the capture started
+    uint32_t propDelay[2]; // Propagation delay in usec of each direction
+    int64_t startSec;      // Wall clock time of the capture start
+    int64_t startNsec;
+} CaptureHeader;
+
+typedef struct
+{
+    uint32_t usec;    // Low 32 bits of the time since capture start, in usec
+    uint8_t dir;      // CAP_TX2RX, CAP_RX2TX or CAP_EVENT
+    uint8_t flags;    // CAP_F_* flags
+    uint8_t byte;     // Byte on the wire, or event code
+    uint8_t reserved;
+} CaptureRecord;
+
+#endif // _CAPTURE_H_
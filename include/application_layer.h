@@ -1,9 +1,15 @@
 // Application layer protocol header.
-// NOTE: This file must not be changed.
 
 #ifndef _APPLICATION_LAYER_H_
 #define _APPLICATION_LAYER_H_
 
+// Options given after the filename on the command line
+#define APP_DUPLEX 0x01  // Both ends send the file named on their side and receive the peer's
+#define APP_COBS 0x02    // Send the I-frames with COBS framing instead of byte stuffing
+#define APP_TRACE 0x04   // Record the link layer events in tx.trace / rx.trace
+#define APP_METRICS 0x08 // Publish live metrics in /linklayer-tx / /linklayer-rx (see llmetrics)
+#define APP_KEEPALIVE 0x10 // Exchange heartbeats, so a lost link is reported within a second
+
 // Application layer main function.
 // Arguments:
 //   serialPort: Serial port name (e.g., /dev/ttyS0).
@@ -12,7 +18,8 @@
 //   nTries: Maximum number of frame retries.
 //   timeout: Frame timeout.
 //   filename: Name of the file to send / receive.
+//   options: APP_* flags.
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename);
+                      int nTries, int timeout, const char *filename, int options);
 
 #endif // _APPLICATION_LAYER_H_
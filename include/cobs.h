@@ -0,0 +1,24 @@
+// Consistent Overhead Byte Stuffing with FLAG as the delimiter.
+// The data is cut into blocks of at most COBS_MAX_RUN bytes without a FLAG,
+// each one preceded by a code byte telling its length, so a FLAG can only
+// appear between frames. It costs one byte per COBS_MAX_RUN data bytes, plus
+// one, whatever the data is.
+
+#ifndef _COBS_H_
+#define _COBS_H_
+
+#define COBS_MAX_RUN 254
+
+// Largest encoded size of size bytes
+#define COBS_MAX_SIZE(size) ((size) + (size) / COBS_MAX_RUN + 1)
+
+// Encode size bytes into out, which must hold COBS_MAX_SIZE(size) bytes.
+// If out is NULL, only computes the encoded size.
+// Returns the encoded size.
+int cobsEncode(const unsigned char *in, int size, unsigned char *out);
+
+// Decode size bytes into out, which must hold size bytes.
+// Returns the decoded size or -1 if the input is not a valid encoding.
+int cobsDecode(const unsigned char *in, int size, unsigned char *out);
+
+#endif // _COBS_H_
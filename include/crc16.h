@@ -0,0 +1,18 @@
+// CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF), used as the
+// frame check sequence of I-frames when both ends support it.
+
+#ifndef _CRC16_H_
+#define _CRC16_H_
+
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+
+// Add one byte to the CRC. Running the CRC over the data followed by its
+// CRC (most significant byte first) gives 0.
+uint16_t crc16Update(uint16_t crc, unsigned char byte);
+
+// CRC of size bytes.
+uint16_t crc16(const unsigned char *data, int size);
+
+#endif // _CRC16_H_
@@ -0,0 +1,61 @@
+// Asynchronous file reads and writes.
+// Requests run in the background, so a slow disk does not hold up the
+// packets going to and coming from the link. They go to io_uring when the
+// kernel has it, with the buffers registered once when the queue is created,
+// and otherwise to a small pool of threads doing pread / pwrite.
+// Requests are collected in the order they were made. Build with
+// -DFILE_IO_NO_URING to always use the threads.
+// The FILE_IO_DEPTH buffers belong to the queue, one per request. The sender
+// builds each data packet in the buffer its data was read into, so reading
+// copies nothing; the receiver copies the data of each packet into one to
+// write it. They are not the link layer's: llsubmit copies every packet it is
+// given into its own buffers.
+
+#ifndef _FILE_IO_H_
+#define _FILE_IO_H_
+
+#include "link_layer.h"
+
+#include <stdint.h>
+
+#define FILE_IO_DEPTH 4                             // Requests in flight
+#define FILE_IO_BUFFER_SIZE (MAX_PAYLOAD_SIZE + 32) // A packet, with room for its header
+#define FILE_IO_WORKERS 2                           // Threads of the fallback
+
+typedef enum
+{
+    FILE_IO_URING,
+    FILE_IO_POOL,
+} FileIoBackend;
+
+typedef struct FileIo FileIo;
+
+// Create a queue of FILE_IO_DEPTH requests. Returns NULL on error.
+FileIo *fileIoCreate(void);
+
+// Wait for the requests in flight and free the queue.
+void fileIoDestroy(FileIo *io);
+
+FileIoBackend fileIoBackend(FileIo *io);
+
+// Requests made and not collected yet.
+int fileIoPending(FileIo *io);
+
+// Buffer of the next request, the data of a read or write must be in it.
+// Only valid while fileIoPending is below FILE_IO_DEPTH.
+unsigned char *fileIoBuffer(FileIo *io);
+
+// Start reading size bytes of fd at offset into data.
+// Returns 0 on success or -1 if the queue is full.
+int fileIoRead(FileIo *io, int fd, unsigned char *data, int size, uint64_t offset);
+
+// Start writing size bytes of data to fd at offset.
+// Returns 0 on success or -1 if the queue is full.
+int fileIoWrite(FileIo *io, int fd, unsigned char *data, int size, uint64_t offset);
+
+// Wait for the oldest request, *data is set to its data.
+// Returns the bytes it read or wrote, or -1 on error (errno is set), a
+// write is an error unless all of it was written.
+int fileIoCollect(FileIo *io, unsigned char **data);
+
+#endif // _FILE_IO_H_
@@ -1,9 +1,10 @@
 // Link layer header.
-// NOTE: This file must not be changed.
 
 #ifndef _LINK_LAYER_H_
 #define _LINK_LAYER_H_
 
+#include <stdint.h>
+
 typedef enum
 {
     LlTx,
@@ -17,8 +18,51 @@ typedef struct
     int baudRate;
     int nRetransmissions;
     int timeout;
+    int duplex; // Both ends send I-frames, acknowledgements are piggybacked
+    int cobs;   // Frame the I-frames with COBS instead of byte stuffing
+    const char *traceFile; // Event trace written by llclose and on SIGUSR1, NULL for none
+    const char *metricsName; // Shared memory segment of the live metrics (e.g. "/linklayer-tx"), NULL for none
+    int keepalive; // Milliseconds between heartbeats that tell a silent peer is gone, 0 for none
 } LinkLayer;
 
+typedef struct
+{
+    int frames;
+    int retransmissions;
+    int timeouts;
+    int duplicates;
+    int reconnects;
+    int notReady; // RNR frames received (transmitter) or sent (receiver)
+    int rto; // Current retransmission timeout (seconds)
+    // Information fields sent (FCS included), and the bytes they took on the
+    // wire with byte stuffing and with COBS, whichever framing was used
+    uint64_t infoBytes;
+    uint64_t stuffedBytes;
+    uint64_t cobsBytes;
+    int linkDowns; // Times the peer went silent for the keepalive window
+    int down;      // TRUE while it is
+} LinkLayerStats;
+
+// Frame check sequences of I-frames
+#define FCS_XOR 0x01   // BCC2, XOR of the data bytes
+#define FCS_CRC16 0x02 // CRC-16/CCITT-FALSE
+
+// Optional features
+#define FEATURE_DUPLEX 0x01 // Both ends send I-frames
+#define FEATURE_COBS 0x02   // I-frames use COBS framing, receivers always accept it
+#define FEATURE_RNR 0x04    // Receivers pause the transmitter with RNR when they run out of room
+#define FEATURE_FAST_CLOSE 0x08 // The last I-frame asks to disconnect, see llwriteClose
+#define FEATURE_KEEPALIVE 0x10  // Heartbeats at the interval asked for, see LinkLayer.keepalive
+
+typedef struct
+{
+    int maxPayload; // Largest payload both ends accept
+    int window;     // Frames that may be waiting for an acknowledgement
+    int fcs;        // FCS_* used by I-frames
+    int features;   // FEATURE_* in use
+    int legacy;     // TRUE if the peer only knows the original frames and packets
+} LinkLayerCaps;
+
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
 #define MAX_PAYLOAD_SIZE 1000
@@ -27,21 +71,123 @@ typedef struct
 #define FALSE 0
 #define TRUE 1
 
+// Asynchronous API
+#define LL_MAX_PENDING 4       // Sends submitted and not completed yet
+#define LL_MAX_COMPLETIONS 8   // Completions not collected yet
+
+typedef enum
+{
+    LL_SENT,      // The peer acknowledged the packet
+    LL_RECEIVED,  // A packet was received
+    LL_CANCELLED, // The send was cancelled with llcancel
+    LL_FAILED,    // The peer is gone, the packet may not have been delivered (id 0:
+                  // the keepalive gave up on the transmitter, nothing more will be received)
+} LlCompletionType;
+
+typedef struct
+{
+    LlCompletionType type;
+    int id;   // Of the send, 0 for a received packet
+    int size; // Bytes sent or received, -1 if the transmitter started a new session (as llread)
+    unsigned char packet[MAX_PAYLOAD_SIZE + 1]; // Received packet
+} LlCompletion;
+
 // Open a connection using the "port" parameters defined in struct linkLayer.
 // Return "1" on success or "-1" on error.
 int llopen(LinkLayer connectionParameters);
 
-// Send data in buf with size bufSize.
+// Send data in buf with size bufSize (at most the agreed maxPayload).
 // Return number of chars written, or "-1" on error.
+// After nRetransmissions, probes the receiver until the connection comes back
+// and continues the same session; "-1" means it did not come back in time.
 int llwrite(const unsigned char *buf, int bufSize);
 
+// Send the last packet like llwrite, and ask the receiver to disconnect along
+// with it: its DISC acknowledges the packet and is answered with UA right
+// away, so llclose has nothing left to exchange. Without FEATURE_FAST_CLOSE
+// (or in full-duplex mode) this is llwrite, and llclose disconnects.
+int llwriteClose(const unsigned char *buf, int bufSize);
+
 // Receive data in packet.
-// Return number of chars read, or "-1" on error.
+// Return number of chars read, or "-1" on error. "-1" is also returned if the
+// transmitter started a new session, the transfer must then start over.
+// With a keepalive, "-1" also means the transmitter stayed silent for longer
+// than llwrite probes a lost receiver: the link is down for good (see
+// LinkLayerStats.down).
+// In full-duplex mode, llwrite also receives the peer's I-frames while it
+// waits for its acknowledgement, so call llread while llpending() is TRUE
+// before the next llwrite.
 int llread(unsigned char *packet);
 
+// Get the parameters agreed with the peer in llopen. The full-duplex mode is
+// only used if both ends asked for it, COBS framing if the transmitter did.
+void llcaps(LinkLayerCaps *caps);
+
+// Full-duplex mode only: return TRUE if a packet was received while sending
+// and is waiting to be returned by llread.
+int llpending(void);
+
+// Get the statistics of the current connection, e.g. to show progress.
+// While the link thread runs (llstart), they are as of its last completion.
+void llstats(LinkLayerStats *stats);
+
+// Asynchronous API: after llopen, move the link to a thread of its own, so
+// the application can go on with its work while packets are sent and
+// received.
+// Return a file descriptor that is readable while completions are ready, or
+// "-1" on error.
+int llstart(void);
+
+// Submit a packet to send (copied). Return its id, or "-1" if there are
+// already LL_MAX_PENDING sends or the link was stopped.
+int llsubmit(const unsigned char *buf, int bufSize);
+
+// Submit the last packet, sent as by llwriteClose. Return as llsubmit.
+int llsubmitClose(const unsigned char *buf, int bufSize);
+
+// Cancel a send. One still waiting in the queue is simply dropped. Cancelling
+// the one in flight gives up on the connection, as if the peer was gone: it
+// may or may not have been delivered, and the sends after it fail.
+// Return "0" if it completes as LL_CANCELLED, or "-1" if it already completed.
+int llcancel(int id);
+
+// Get the next completion without waiting.
+// Return TRUE if there was one, FALSE otherwise.
+int llcomplete(LlCompletion *completion);
+
+// Wait for the submitted sends to complete and stop the link thread. The
+// completions not collected are discarded, and the blocking functions can
+// be used again (e.g. llclose).
+// Return "0" on success or "-1" if the link was not started.
+int llstop(void);
+
 // Close previously opened connection.
 // if showStatistics == TRUE, link layer should print statistics in the console on close.
 // Return "1" on success or "-1" on error.
 int llclose(int showStatistics);
 
+// Connection handles: the functions above work on a single connection shared
+// by the whole process. These work on the connection returned by llopenLink,
+// so a process can run many links at once, from one thread or several (each
+// connection used by one thread at a time). Each one behaves as the function
+// of the same name without "Link".
+typedef struct Link Link;
+
+// Return the connection, or NULL on error.
+Link *llopenLink(LinkLayer connectionParameters);
+int llwriteLink(Link *link, const unsigned char *buf, int bufSize);
+int llwriteCloseLink(Link *link, const unsigned char *buf, int bufSize);
+int llreadLink(Link *link, unsigned char *packet);
+void llcapsLink(Link *link, LinkLayerCaps *caps);
+int llpendingLink(Link *link);
+void llstatsLink(Link *link, LinkLayerStats *stats);
+int llstartLink(Link *link);
+int llsubmitLink(Link *link, const unsigned char *buf, int bufSize);
+int llsubmitCloseLink(Link *link, const unsigned char *buf, int bufSize);
+int llcancelLink(Link *link, int id);
+int llcompleteLink(Link *link, LlCompletion *completion);
+int llstopLink(Link *link);
+// The connection is freed, even on error.
+int llcloseLink(Link *link, int showStatistics);
+
 #endif // _LINK_LAYER_H_
@@ -21,12 +21,41 @@
 #define C_REJ0 0x54
 #define C_REJ1 0x55
 
+// Receiver not ready: like RR, but the transmitter must hold its next I-frame
+// until an RR says the receiver has room again
+#define C_RNR0 0x04
+#define C_RNR1 0x05
+
+// Sent by a transmitter held by RNR, or as a heartbeat (FEATURE_KEEPALIVE),
+// answered with RR or RNR
+#define C_POLL 0x0F
+
 #define C_DISC 0x0B
 
 // Information frames
 #define C_I0 0
 #define C_I1 0x80
 
+// Set in the control of the last I-frame to ask the receiver to disconnect:
+// it acknowledges the frame with its DISC, answered with UA (fast close)
+#define C_I_CLOSE 0x08
+#define IS_C_I(c) (((c) & ~(C_I1 | C_I_CLOSE)) == C_I0)
+
+// Full-duplex information frames: N(S) in bit 7 and the piggybacked
+// acknowledgement N(R) (next sequence number expected from the peer) in bit 6
+#define C_IP(ns, nr) (0x10 | ((ns) << 7) | ((nr) << 6))
+#define IS_C_IP(c) (((c) & 0x3F) == 0x10)
+#define C_IP_NS(c) ((c) >> 7)
+#define C_IP_NR(c) (((c) >> 6) & 0x1)
+
+// SET / UA parameters (type, length, value) in the information field
+#define PARAM_SESSION 0x01  // 4-byte session identifier
+#define PARAM_NEXT_SEQ 0x02 // N(S) the sender expects to receive next
+#define PARAM_MAX_PAYLOAD 0x03 // 2-byte largest payload the sender accepts
+#define PARAM_WINDOW 0x04   // Frames the sender can have outstanding
+#define PARAM_FCS 0x05      // FCS_* types the sender supports
+#define PARAM_FEATURES 0x06 // FEATURE_* the sender asks for
+#define PARAM_KEEPALIVE 0x07 // 2-byte heartbeat interval (msec) the sender asks for
 
 // MISC
 
@@ -0,0 +1,69 @@
+// Live metrics of a connection, published by the link layer in a POSIX
+// shared memory segment (LinkLayer.metricsName) and read by llmetrics.
+//
+// The link stores every field with a relaxed atomic store as events happen,
+// readers load them the same way at any rate. Fields are not updated
+// together, so a read may mix values from two consecutive events. All fields
+// are in host byte order.
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+#define METRICS_MAGIC "LMET"
+#define METRICS_VERSION 2
+
+// Connection state
+#define METRICS_CONNECTING 1 // llopen
+#define METRICS_CONNECTED 2
+#define METRICS_CLOSING 3    // llclose
+#define METRICS_CLOSED 4     // The segment is gone, readers still mapping it see the final values
+
+typedef struct
+{
+    char magic[4];             // METRICS_MAGIC
+    uint16_t version;          // METRICS_VERSION
+    uint16_t size;             // sizeof(LinkMetrics)
+    int32_t pid;
+    uint8_t role;              // LlTx or LlRx
+    uint8_t state;             // METRICS_*
+    uint16_t features;         // FEATURE_* agreed in llopen
+    uint32_t baudRate;
+    uint32_t reserved;
+    uint64_t events;           // Updates so far, it stops moving when the link is stuck
+
+    // Counters
+    uint64_t framesSent;       // Any frame written to the port
+    uint64_t bytesSent;        // Their size on the wire
+    uint64_t framesReceived;   // Valid frames
+    uint64_t infoReceived;     // Information bytes of the valid frames
+    uint64_t headerErrors;     // Wrong BCC1
+    uint64_t fcsErrors;        // Wrong BCC2 / CRC or cut COBS block
+    uint64_t packetsSent;      // Acknowledged llwrites
+    uint64_t packetsDelivered; // Packets returned by llread
+    uint64_t bytesDelivered;
+    uint64_t iFrames;          // As in LinkLayerStats
+    uint64_t retransmissions;
+    uint64_t timeouts;
+    uint64_t duplicates;
+    uint64_t reconnects;
+    uint64_t notReady;
+    uint64_t infoBytes;        // Information fields sent (FCS included), and their
+    uint64_t stuffedBytes;     // size with byte stuffing and with COBS
+    uint64_t cobsBytes;
+    uint64_t linkDowns;        // Times the keepalive found the peer silent
+
+    // Gauges
+    int32_t rtoMsec;           // Retransmission timeout
+    int32_t window;            // Frames that may wait for an acknowledgement
+    int32_t unacked;           // Frames waiting for one
+    int32_t sendQueue;         // Asynchronous API: sends submitted and not completed
+    int32_t completionQueue;   // Completions not collected
+    int32_t receiveWindow;     // Packets the receiver can still take
+    int32_t localBusy;         // We sent RNR
+    int32_t peerBusy;          // The peer sent RNR
+    int32_t linkDown;          // The peer is silent (keepalive)
+} LinkMetrics;
+
+#endif // _METRICS_H_
@@ -0,0 +1,60 @@
+// Logical channels multiplexed over one link-layer session.
+// Each channel is a source of application packets. The channel with the
+// highest priority that has a packet ready goes first, and channels of the
+// same priority take turns, sending up to their weight in packets per turn
+// (weighted round-robin). Channel 0 packets are sent as they are, the others
+// are tagged with MUX_PACKET and their channel number.
+
+#ifndef _MUX_H_
+#define _MUX_H_
+
+#include "link_layer.h"
+
+#define MUX_MAX_CHANNELS 8
+#define MUX_PACKET 0x04     // [MUX_PACKET][channel][packet of the channel]
+#define MUX_HEADER_SIZE 2
+#define MUX_ERROR -2        // A source failed, see MuxSource
+
+// Get the next packet of a channel, *packet is set to its start.
+// Returns its size, 0 if the channel has none ready yet, -1 once it has
+// nothing more to send or MUX_ERROR if it cannot go on.
+typedef int (*MuxSource)(void *source, unsigned char **packet);
+
+typedef struct
+{
+    MuxSource next;
+    void *source;
+    int priority;           // Higher priority channels go first
+    int weight;             // Packets per turn among channels of the same priority
+    int credit;             // Packets left in the current turn
+    int finished;
+    unsigned char *packet;  // Packet taken from the source, waiting for its turn
+    int size;               // Its size, 0 if there is none
+} MuxChannel;
+
+typedef struct
+{
+    MuxChannel channels[MUX_MAX_CHANNELS];
+    int count;
+    int current;            // Channel whose turn it is
+    unsigned char buf[MAX_PAYLOAD_SIZE];
+} Mux;
+
+void muxInit(Mux *mux);
+
+// Add a channel. Returns its number or -1 if there are too many.
+int muxAdd(Mux *mux, int priority, int weight, MuxSource next, void *source);
+
+// Largest packet a channel may give to fit in payload bytes once tagged.
+int muxPayload(int channel, int payload);
+
+// Get the next packet to send, tagged with its channel, *packet is set to its
+// start. Returns its size, 0 if no channel has a packet ready or -1 if a
+// channel failed.
+int muxNext(Mux *mux, unsigned char **packet);
+
+// Get the channel of a received packet and remove its tag.
+// Returns the channel or -1 if the packet is too short.
+int muxChannel(unsigned char **packet, int *size);
+
+#endif // _MUX_H_
@@ -0,0 +1,37 @@
+// Transfer progress renderer.
+// On a terminal, redraws a single status line in place at most
+// PROGRESS_RATE times per second. Otherwise, logs a plain line every
+// PROGRESS_LOG_INTERVAL seconds.
+
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+#include "link_layer.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define PROGRESS_RATE 10         // Maximum redraws per second on a terminal
+#define PROGRESS_LOG_INTERVAL 5  // Seconds between log lines when not a terminal
+
+typedef struct
+{
+    const char *filename;
+    LinkLayerRole role;
+    uint64_t total;
+    int isTty;
+    struct timespec start;
+    struct timespec lastDraw;
+} Progress;
+
+// Start tracking a transfer of total bytes (0 if not known yet).
+void progressStart(Progress *progress, const char *filename, LinkLayerRole role, uint64_t total);
+
+// Report that done bytes were transferred. Only redraws if enough time has
+// passed since the last redraw.
+void progressUpdate(Progress *progress, uint64_t done);
+
+// Draw the final state of the transfer.
+void progressFinish(Progress *progress, uint64_t done);
+
+#endif // _PROGRESS_H_
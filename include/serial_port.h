@@ -1,9 +1,19 @@
 // Serial port header.
-// NOTE: This file must not be changed.
 
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
+#include <sys/uio.h>
+#include <termios.h>
+
+// An open serial port. The functions below without a SerialPort argument use
+// one shared by the whole process.
+typedef struct
+{
+    int fd;                 // File descriptor for open serial port
+    struct termios oldtio;  // Serial port settings to restore on closing
+} SerialPort;
+
 // Open and configure the serial port.
 // Returns -1 on error.
 int openSerialPort(const char *serialPort, int baudRate);
@@ -22,4 +32,16 @@ int readByteSerialPort(unsigned char *byte);
 // Returns -1 on error, otherwise the number of bytes written.
 int writeBytesSerialPort(const unsigned char *bytes, int numBytes);
 
+// Write up to the numBuffers buffers of iov, in order, to the serial port
+// (must check how many bytes were actually written in the return value).
+// Returns -1 on error, otherwise the number of bytes written.
+int writeVectorSerialPort(const struct iovec *iov, int numBuffers);
+
+// Same as above, on the given port.
+int openSerialPortOf(SerialPort *port, const char *serialPort, int baudRate);
+int closeSerialPortOf(SerialPort *port);
+int readByteSerialPortOf(SerialPort *port, unsigned char *byte);
+int writeBytesSerialPortOf(SerialPort *port, const unsigned char *bytes, int numBytes);
+int writeVectorSerialPortOf(SerialPort *port, const struct iovec *iov, int numBuffers);
+
 #endif // _SERIAL_PORT_H_
@@ -0,0 +1,55 @@
+// Binary event trace format written by the link layer (LinkLayer.traceFile)
+// and converted to Chrome trace JSON by trace2json.
+//
+// A trace file is a TraceHeader followed by the TraceEvents left in the ring
+// of the connection, oldest first. All fields are stored in host byte order.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "LTRC"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 16384 // Events kept, older ones are overwritten
+
+// Event codes
+#define TRACE_OPEN 1         // llopen started
+#define TRACE_CONNECTED 2    // llopen done, "arg" holds the agreed FEATURE_* flags
+#define TRACE_CLOSE 3        // llclose started
+#define TRACE_CLOSED 4       // llclose done, "arg" is 0 or 1 if the peer did not answer
+#define TRACE_QUEUED 5       // llwrite was given a packet of "arg" bytes
+#define TRACE_SENT 6         // Frame written to the port, "arg" bytes long
+#define TRACE_RECEIVED 7     // Valid frame received with an information field of "arg" bytes
+#define TRACE_HEADER_ERROR 8 // Frame header with a wrong BCC1
+#define TRACE_BCC2_ERROR 9   // I-frame with a wrong BCC2 / CRC, or a cut COBS block
+#define TRACE_TIMEOUT 10     // Retransmission timer fired, "arg" timeouts in a row
+#define TRACE_ACKED 11       // llwrite returned, "arg" is the packet size or -1 if it failed
+#define TRACE_DELIVERED 12   // llread handed a packet of "arg" bytes over
+#define TRACE_LINK_DOWN 13   // The keepalive found the peer silent for "arg" msec
+#define TRACE_LINK_UP 14     // The peer was heard again after "arg" msec down
+
+typedef struct
+{
+    char magic[4];        // TRACE_MAGIC
+    uint16_t version;     // TRACE_VERSION
+    uint16_t eventSize;   // sizeof(TraceEvent)
+    uint8_t role;         // LlTx or LlRx
+    uint8_t reserved[3];
+    uint32_t baudRate;
+    uint32_t count;       // Events that follow
+    uint32_t lost;        // Events overwritten before the dump
+    int64_t startSec;     // Monotonic time of llopen, the same clock for both ends
+    int64_t startNsec;    // of a machine
+} TraceHeader;
+
+typedef struct
+{
+    uint64_t nsec;        // Time since startSec / startNsec
+    uint8_t event;        // TRACE_* code
+    uint8_t control;      // Control field of the frame, if any
+    uint16_t reserved;
+    int32_t arg;
+} TraceEvent;
+
+#endif // _TRACE_H_
@@ -0,0 +1,26 @@
+// Streaming XXH64 hash, used to verify transferred files end to end.
+
+#ifndef _XXHASH64_H_
+#define _XXHASH64_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t totalLen;
+    uint64_t acc[4];
+    unsigned char mem[32]; // Input not yet consumed by a full 32-byte stripe
+    unsigned int memSize;
+    uint64_t seed;
+} Xxh64State;
+
+// Start a new hash computation.
+void xxh64Reset(Xxh64State *state, uint64_t seed);
+
+// Add size bytes of input to the hash.
+void xxh64Update(Xxh64State *state, const void *input, uint64_t size);
+
+// Get the hash of all the input added so far (the state is not modified).
+uint64_t xxh64Digest(const Xxh64State *state);
+
+#endif // _XXHASH64_H_
@@ -0,0 +1,354 @@
+// Reader of the live metrics that the link layer publishes in shared memory
+// (main's "metrics" option or LinkLayer.metricsName). It only maps the
+// segments read-only and loads their fields, so it can poll as often as
+// wanted without slowing the transfer down.
+//
+// Usage: llmetrics [-i seconds] [-n count] [-p] [name...]
+//   -i seconds : time between samples (default 1, fractions allowed)
+//   -n count   : stop after count samples (default: until every link closes,
+//                or one sample with -p)
+//   -p         : print the Prometheus text format instead of one line per
+//                link and sample, e.g. to serve it from a textfile collector
+//   name       : shared memory segments (default /linklayer-tx /linklayer-rx)
+//
+// Each line shows the link state ("down" while the keepalive does not hear
+// the peer), frames sent / received, the wire and delivered bit rates since
+// the last sample, retransmissions, timeouts, header / FCS errors, the
+// retransmission timeout, the window occupancy, the asynchronous queues and
+// the framing overhead of the data sent.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "link_layer.h"
+#include "metrics.h"
+
+#define METRIC_GET(metrics, field) __atomic_load_n(&(metrics)->field, __ATOMIC_RELAXED)
+
+typedef struct
+{
+    const char *name;
+    const LinkMetrics *metrics; // NULL until the segment shows up
+    uint64_t lastBytesSent;
+    uint64_t lastBytesDelivered;
+    int closed;
+} Reader;
+
+// Prometheus metrics, by their offset in LinkMetrics
+typedef struct
+{
+    const char *name;
+    const char *help;
+    size_t offset;
+} Metric;
+
+static const Metric counters[] = {
+    {"frames_sent", "Frames written to the port", offsetof(LinkMetrics, framesSent)},
+    {"sent_bytes", "Bytes of the frames written to the port", offsetof(LinkMetrics, bytesSent)},
+    {"frames_received", "Valid frames received", offsetof(LinkMetrics, framesReceived)},
+    {"received_info_bytes", "Information bytes of the valid frames", offsetof(LinkMetrics, infoReceived)},
+    {"header_errors", "Frames with a wrong BCC1", offsetof(LinkMetrics, headerErrors)},
+    {"fcs_errors", "I-frames with a wrong BCC2 or CRC", offsetof(LinkMetrics, fcsErrors)},
+    {"packets_sent", "Packets acknowledged by the peer", offsetof(LinkMetrics, packetsSent)},
+    {"packets_delivered", "Packets returned by llread", offsetof(LinkMetrics, packetsDelivered)},
+    {"delivered_bytes", "Bytes of the packets returned by llread", offsetof(LinkMetrics, bytesDelivered)},
+    {"i_frames", "I-frames sent, not counting retransmissions", offsetof(LinkMetrics, iFrames)},
+    {"retransmissions", "Frames sent again", offsetof(LinkMetrics, retransmissions)},
+    {"timeouts", "Retransmission timeouts", offsetof(LinkMetrics, timeouts)},
+    {"duplicates", "Duplicate I-frames received", offsetof(LinkMetrics, duplicates)},
+    {"reconnects", "Connections that came back after a probe", offsetof(LinkMetrics, reconnects)},
+    {"not_ready", "RNR frames received or sent", offsetof(LinkMetrics, notReady)},
+    {"info_bytes", "Information fields sent, FCS included", offsetof(LinkMetrics, infoBytes)},
+    {"stuffed_bytes", "Information fields sent, once byte stuffed", offsetof(LinkMetrics, stuffedBytes)},
+    {"cobs_bytes", "Information fields sent, once COBS encoded", offsetof(LinkMetrics, cobsBytes)},
+    {"link_downs", "Times the keepalive found the peer silent", offsetof(LinkMetrics, linkDowns)},
+};
+
+static const Metric gauges[] = {
+    {"rto_seconds", "Retransmission timeout", offsetof(LinkMetrics, rtoMsec)},
+    {"window", "Frames that may wait for an acknowledgement", offsetof(LinkMetrics, window)},
+    {"unacked", "Frames waiting for an acknowledgement", offsetof(LinkMetrics, unacked)},
+    {"send_queue", "Sends submitted and not completed", offsetof(LinkMetrics, sendQueue)},
+    {"completion_queue", "Completions not collected", offsetof(LinkMetrics, completionQueue)},
+    {"receive_window", "Packets the receiver can still take", offsetof(LinkMetrics, receiveWindow)},
+    {"local_busy", "1 while we hold the peer with RNR", offsetof(LinkMetrics, localBusy)},
+    {"peer_busy", "1 while the peer holds us with RNR", offsetof(LinkMetrics, peerBusy)},
+    {"link_down", "1 while the keepalive does not hear the peer", offsetof(LinkMetrics, linkDown)},
+};
+
+// Map a segment read-only. Returns NULL if it does not exist (yet) or is not
+// a metrics segment
+const LinkMetrics *openMetrics(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+    {
+        if (errno != ENOENT)
+        {
+            perror(name);
+        }
+        return NULL;
+    }
+    struct stat st;
+    void *segment = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(LinkMetrics))
+    {
+        segment = mmap(NULL, sizeof(LinkMetrics), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (segment == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    // the link writes the magic last, once the rest is set
+    const LinkMetrics *metrics = segment;
+    if (memcmp(metrics->magic, METRICS_MAGIC, sizeof(metrics->magic)) != 0)
+    {
+        munmap(segment, sizeof(LinkMetrics));
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (metrics->version != METRICS_VERSION || metrics->size != sizeof(LinkMetrics))
+    {
+        fprintf(stderr, "%s: metrics version %d not supported\n", name, metrics->version);
+        munmap(segment, sizeof(LinkMetrics));
+        return NULL;
+    }
+    return metrics;
+}
+
+const char *stateName(int state)
+{
+    switch (state)
+    {
+    case METRICS_CONNECTING:
+        return "connecting";
+    case METRICS_CONNECTED:
+        return "connected";
+    case METRICS_CLOSING:
+        return "closing";
+    case METRICS_CLOSED:
+        return "closed";
+    }
+    return "unknown";
+}
+
+// The link may have died without closing
+int alive(const LinkMetrics *metrics)
+{
+    return kill(metrics->pid, 0) == 0 || errno != ESRCH;
+}
+
+// Print one line for a link, with rates over the last interval (seconds)
+void printLine(Reader *reader, double interval)
+{
+    const LinkMetrics *m = reader->metrics;
+    int state = METRIC_GET(m, state);
+    uint64_t bytesSent = METRIC_GET(m, bytesSent);
+    uint64_t bytesDelivered = METRIC_GET(m, bytesDelivered);
+    uint64_t infoBytes = METRIC_GET(m, infoBytes);
+    uint64_t encodedBytes = (METRIC_GET(m, features) & FEATURE_COBS) ? METRIC_GET(m, cobsBytes)
+                                                                       : METRIC_GET(m, stuffedBytes);
+
+    printf("%s %s%s: frames %llu/%llu, wire %.0f bit/s, delivered %.0f bit/s, retx %llu, timeouts %llu, "
+           "errors %llu/%llu, rto %d ms, window %d/%d, queues %d/%d%s%s",
+           reader->name, METRIC_GET(m, linkDown) && state == METRICS_CONNECTED ? "down" : stateName(state),
+           state != METRICS_CLOSED && !alive(m) ? " (process gone)" : "",
+           (unsigned long long) METRIC_GET(m, framesSent), (unsigned long long) METRIC_GET(m, framesReceived),
+           interval > 0 ? (bytesSent - reader->lastBytesSent) * 8 / interval : 0,
+           interval > 0 ? (bytesDelivered - reader->lastBytesDelivered) * 8 / interval : 0,
+           (unsigned long long) METRIC_GET(m, retransmissions), (unsigned long long) METRIC_GET(m, timeouts),
+           (unsigned long long) METRIC_GET(m, headerErrors), (unsigned long long) METRIC_GET(m, fcsErrors),
+           METRIC_GET(m, rtoMsec), METRIC_GET(m, unacked), METRIC_GET(m, window),
+           METRIC_GET(m, sendQueue), METRIC_GET(m, completionQueue),
+           METRIC_GET(m, localBusy) ? ", RNR sent" : "", METRIC_GET(m, peerBusy) ? ", RNR received" : "");
+    if (infoBytes > 0)
+    {
+        printf(", framing +%.2f%%", 100.0 * (encodedBytes - infoBytes) / infoBytes);
+    }
+    printf("\n");
+
+    reader->lastBytesSent = bytesSent;
+    reader->lastBytesDelivered = bytesDelivered;
+}
+
+// Print the Prometheus text format for every link that is there
+void printPrometheus(Reader *readers, int count)
+{
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        printf("# HELP linklayer_%s_total %s.\n# TYPE linklayer_%s_total counter\n",
+               counters[i].name, counters[i].help, counters[i].name);
+        for (int r = 0; r < count; r++)
+        {
+            if (readers[r].metrics == NULL)
+            {
+                continue;
+            }
+            const uint64_t *value = (const uint64_t *) ((const char *) readers[r].metrics + counters[i].offset);
+            printf("linklayer_%s_total{link=\"%s\"} %llu\n", counters[i].name, readers[r].name,
+                   (unsigned long long) __atomic_load_n(value, __ATOMIC_RELAXED));
+        }
+    }
+    for (size_t i = 0; i < sizeof(gauges) / sizeof(gauges[0]); i++)
+    {
+        printf("# HELP linklayer_%s %s.\n# TYPE linklayer_%s gauge\n", gauges[i].name, gauges[i].help, gauges[i].name);
+        for (int r = 0; r < count; r++)
+        {
+            if (readers[r].metrics == NULL)
+            {
+                continue;
+            }
+            const int32_t *value = (const int32_t *) ((const char *) readers[r].metrics + gauges[i].offset);
+            int32_t v = __atomic_load_n(value, __ATOMIC_RELAXED);
+            if (gauges[i].offset == offsetof(LinkMetrics, rtoMsec))
+            {
+                printf("linklayer_%s{link=\"%s\"} %.3f\n", gauges[i].name, readers[r].name, v / 1000.0);
+            }
+            else
+            {
+                printf("linklayer_%s{link=\"%s\"} %d\n", gauges[i].name, readers[r].name, v);
+            }
+        }
+    }
+    printf("# HELP linklayer_up 1 while the link is connected.\n# TYPE linklayer_up gauge\n");
+    for (int r = 0; r < count; r++)
+    {
+        if (readers[r].metrics != NULL)
+        {
+            printf("linklayer_up{link=\"%s\"} %d\n", readers[r].name,
+                   METRIC_GET(readers[r].metrics, state) == METRICS_CONNECTED && alive(readers[r].metrics));
+        }
+    }
+    fflush(stdout);
+}
+
+void printUsage(const char *program)
+{
+    printf("Usage: %s [-i seconds] [-n count] [-p] [name...]\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+    double interval = 1;
+    long samples = 0;
+    int prometheus = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:ph")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            samples = atol(optarg);
+            break;
+        case 'p':
+            prometheus = 1;
+            break;
+        default:
+            printUsage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (prometheus && samples == 0)
+    {
+        samples = 1;
+    }
+    if (interval <= 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    static const char *defaults[] = {"/linklayer-tx", "/linklayer-rx"};
+    int count = optind < argc ? argc - optind : 2;
+    Reader *readers = calloc(count, sizeof(Reader));
+    for (int i = 0; i < count; i++)
+    {
+        readers[i].name = optind < argc ? argv[optind + i] : defaults[i];
+    }
+
+    struct timespec delay = {(time_t) interval, (long) ((interval - (time_t) interval) * 1e9)};
+    int followed = 0; // a link was seen running
+    for (long sample = 0; samples == 0 || sample < samples; sample++)
+    {
+        if (sample > 0)
+        {
+            nanosleep(&delay, NULL);
+        }
+
+        int open = 0;
+        for (int i = 0; i < count; i++)
+        {
+            Reader *reader = &readers[i];
+            if (reader->metrics == NULL && (reader->metrics = openMetrics(reader->name)) != NULL)
+            {
+                // rates start from the first sample
+                reader->lastBytesSent = METRIC_GET(reader->metrics, bytesSent);
+                reader->lastBytesDelivered = METRIC_GET(reader->metrics, bytesDelivered);
+            }
+            if (reader->metrics == NULL)
+            {
+                continue;
+            }
+
+            // a link that closed or died is shown once with its final values,
+            // then its name is looked up again for the next connection
+            int closed = METRIC_GET(reader->metrics, state) == METRICS_CLOSED || !alive(reader->metrics);
+            if (!prometheus && !(closed && reader->closed))
+            {
+                printLine(reader, sample > 0 ? interval : 0);
+            }
+            if (closed && !prometheus)
+            {
+                munmap((void *) reader->metrics, sizeof(LinkMetrics));
+                reader->metrics = NULL;
+            }
+            reader->closed = closed;
+            open += !closed;
+        }
+        if (prometheus)
+        {
+            printPrometheus(readers, count);
+        }
+        else
+        {
+            fflush(stdout);
+        }
+
+        // following the links: stop once all of them closed
+        followed |= open > 0;
+        if (samples == 0 && followed && open == 0)
+        {
+            break;
+        }
+        if (samples == 0 && !followed && sample == 0)
+        {
+            fprintf(stderr, "Waiting for the links to open...\n");
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (readers[i].metrics != NULL)
+        {
+            munmap((void *) readers[i].metrics, sizeof(LinkMetrics));
+        }
+    }
+    free(readers);
+    return 0;
+}
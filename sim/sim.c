@@ -0,0 +1,684 @@
+// Deterministic simulation of a transfer over an emulated cable.
+// Both ends of the link run in this process, on a virtual clock: the link
+// layer is built with SIMULATION, so its timers read the clock below, and
+// the serial port functions are replaced by an emulated wire that takes
+// 10 bit times per byte, flips bits at random and can be unplugged.
+//
+// Each end runs on its own thread, but only one of them at a time: an end
+// runs until it waits for a byte, then the other one gets its turn, and once
+// both wait the clock jumps to the next byte arrival or read timeout (0.1 s,
+// as VTIME). So a run takes the time of its computation only, and the same
+// seed always gives the same run.
+//
+// Usage: sim [-b baud] [-e ber] [-t timeout] [-r retransmissions] [-c] [-k interval]
+//            [-o start:duration]... [-d delay] [-n runs] [-s seed] [-l limit] [-T prefix] [file]
+//   -b baud            : cable baud rate (default 9600)
+//   -e ber             : bit error rate of both directions (default 0)
+//   -t timeout         : retransmission timeout in seconds (default 4)
+//   -r retransmissions : retransmissions before probing the receiver (default 3)
+//   -c                 : COBS framing
+//   -k interval        : keepalive heartbeat interval in milliseconds (default none)
+//   -o start:duration  : unplug the cable at start seconds, for duration seconds
+//   -d delay           : start the receiver delay seconds after the transmitter
+//   -n runs            : number of runs, with seeds seed, seed + 1...
+//   -s seed            : seed of the first run (default 1)
+//   -l limit           : virtual seconds after which a run is given up (default 3600)
+//   -T prefix          : write the event trace of each end to prefix-tx.trace and
+//                        prefix-rx.trace (the last run's), see trace2json
+//   file               : file to send (default 64 KiB of random bytes)
+//
+// Each run reports its virtual duration, the efficiency (payload bits per
+// second over the baud rate), when llopen connected, when llclose returned
+// on both ends, the link statistics and, after each outage, how long the
+// first frame took to get through once the cable was back.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "link_layer.h"
+#include "serial_port.h"
+
+#define NS 1000000000LL
+#define VTIME_NS (NS / 10)    // Read timeout of the serial port
+#define WIRE_SIZE 65536       // Bytes in flight in a direction, more are lost as in a full tty buffer
+#define MAX_OUTAGES 8
+#define DEFAULT_SIZE 65536
+
+// Bytes travelling to one end, with the time each one arrives
+typedef struct
+{
+    unsigned char bytes[WIRE_SIZE];
+    int64_t arrival[WIRE_SIZE];
+    int head;
+    int count;
+    int64_t freeAt; // When the line is done sending the last byte
+} Wire;
+
+typedef struct
+{
+    int waiting;      // Waiting for a byte
+    int64_t deadline; // Read timeout while waiting
+    int done;
+} End;
+
+typedef struct
+{
+    int64_t start;
+    int64_t end;
+    int64_t recovery; // Time from the end of the outage to the first frame acknowledged, -1 if none
+} Outage;
+
+typedef struct
+{
+    // Settings
+    int baudRate;
+    double ber;
+    double byteError; // Probability that a byte has a bit flipped
+    LinkLayer params;
+    Outage outages[MAX_OUTAGES];
+    int outageCount;
+    int64_t rxDelay;   // Receiver start
+    int64_t limit;
+    const char *trace; // Prefix of the trace files, NULL for none
+    const unsigned char *data;
+    int size;
+
+    // State of the run
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    int running;    // End allowed to run
+    int64_t clock;
+    Wire wires[2];  // wires[i] carries the bytes to end i
+    End ends[2];
+    uint64_t random;
+    int aborted;
+
+    // Results
+    int64_t txConnected;
+    int64_t txEnd;
+    int64_t closed[2]; // When llclose of each end returned, -1 if it failed
+    int received;
+    int intact;
+    int newSessions;
+    LinkLayerStats txStats;
+    LinkLayerStats rxStats;
+} Simulation;
+
+// Ends, and the names passed as serial ports
+#define END_RX 0
+#define END_TX 1
+
+Simulation sim;
+
+////////////////////////////////////////////////
+// Virtual clock and scheduler
+////////////////////////////////////////////////
+
+void simTime(struct timespec *now)
+{
+    now->tv_sec = sim.clock / NS;
+    now->tv_nsec = sim.clock % NS;
+}
+
+// When an end has something to do: its next byte or its read timeout
+int64_t wakeTime(int end)
+{
+    Wire *wire = &sim.wires[end];
+    int64_t wake = sim.ends[end].deadline;
+    if (wire->count > 0 && wire->arrival[wire->head] < wake)
+    {
+        wake = wire->arrival[wire->head];
+    }
+    return wake;
+}
+
+// Choose the end to run next, advancing the clock if both are waiting.
+// Returns -1 once both are done. Called with the lock held.
+int schedule(int current)
+{
+    for (int i = 1; i <= 2; i++)
+    {
+        int end = (current + i) % 2;
+        if (!sim.ends[end].done && !sim.ends[end].waiting)
+        {
+            return end;
+        }
+    }
+
+    int next = -1;
+    for (int end = 0; end < 2; end++)
+    {
+        if (!sim.ends[end].done && (next == -1 || wakeTime(end) < wakeTime(next)))
+        {
+            next = end;
+        }
+    }
+    if (next != -1 && wakeTime(next) > sim.clock)
+    {
+        sim.clock = wakeTime(next);
+    }
+    return next;
+}
+
+// Give the turn to the other end until this one has something to do
+void waitTurn(int end, int64_t deadline)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim.ends[end].waiting = TRUE;
+    sim.ends[end].deadline = deadline;
+    sim.running = schedule(end);
+    pthread_cond_broadcast(&sim.turn);
+    while (sim.running != end)
+    {
+        pthread_cond_wait(&sim.turn, &sim.lock);
+    }
+    sim.ends[end].waiting = FALSE;
+
+    if (sim.clock >= sim.limit)
+    {
+        // stuck, e.g. a receiver waiting for a transmitter that gave up
+        sim.aborted = TRUE;
+        sim.ends[end].done = TRUE;
+        sim.running = schedule(end);
+        pthread_cond_broadcast(&sim.turn);
+        pthread_mutex_unlock(&sim.lock);
+        pthread_exit(NULL);
+    }
+    pthread_mutex_unlock(&sim.lock);
+}
+
+void startTurn(int end)
+{
+    pthread_mutex_lock(&sim.lock);
+    while (sim.running != end)
+    {
+        pthread_cond_wait(&sim.turn, &sim.lock);
+    }
+    pthread_mutex_unlock(&sim.lock);
+}
+
+void endTurn(int end)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim.ends[end].done = TRUE;
+    sim.running = schedule(end);
+    pthread_cond_broadcast(&sim.turn);
+    pthread_mutex_unlock(&sim.lock);
+}
+
+////////////////////////////////////////////////
+// Emulated wire, in place of serial_port.c
+////////////////////////////////////////////////
+
+// xorshift64*, uniform in [0, 1)
+double uniform(void)
+{
+    sim.random ^= sim.random >> 12;
+    sim.random ^= sim.random << 25;
+    sim.random ^= sim.random >> 27;
+    return (sim.random * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / (1ULL << 53));
+}
+
+int unplugged(int64_t time)
+{
+    for (int i = 0; i < sim.outageCount; i++)
+    {
+        if (time >= sim.outages[i].start && time < sim.outages[i].end)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+int openSerialPortOf(SerialPort *port, const char *serialPort, int baudRate)
+{
+    port->fd = strcmp(serialPort, "tx") == 0 ? END_TX : END_RX;
+    return port->fd;
+}
+
+int closeSerialPortOf(SerialPort *port)
+{
+    return 0;
+}
+
+int readByteSerialPortOf(SerialPort *port, unsigned char *byte)
+{
+    int end = port->fd;
+    Wire *wire = &sim.wires[end];
+    int64_t deadline = sim.clock + VTIME_NS;
+
+    while (TRUE)
+    {
+        if (wire->count > 0 && wire->arrival[wire->head] <= sim.clock)
+        {
+            *byte = wire->bytes[wire->head];
+            wire->head = (wire->head + 1) % WIRE_SIZE;
+            wire->count--;
+            return 1;
+        }
+        if (sim.clock >= deadline)
+        {
+            return 0;
+        }
+        waitTurn(end, deadline);
+    }
+}
+
+int writeVectorSerialPortOf(SerialPort *port, const struct iovec *iov, int numBuffers)
+{
+    Wire *wire = &sim.wires[1 - port->fd];
+    int64_t byteTime = 10 * NS / sim.baudRate;
+    int written = 0;
+
+    for (int i = 0; i < numBuffers; i++)
+    {
+        const unsigned char *bytes = iov[i].iov_base;
+        for (int j = 0; j < iov[i].iov_len; j++)
+        {
+            int64_t sent = wire->freeAt > sim.clock ? wire->freeAt : sim.clock;
+            wire->freeAt = sent + byteTime;
+            written++;
+            if (unplugged(sent) || wire->count == WIRE_SIZE)
+            {
+                continue;
+            }
+
+            unsigned char byte = bytes[j];
+            if (sim.byteError > 0 && uniform() < sim.byteError)
+            {
+                byte ^= 1 << (int)(uniform() * 8);
+            }
+            int tail = (wire->head + wire->count) % WIRE_SIZE;
+            wire->bytes[tail] = byte;
+            wire->arrival[tail] = wire->freeAt;
+            wire->count++;
+        }
+    }
+    return written;
+}
+
+////////////////////////////////////////////////
+// Ends
+////////////////////////////////////////////////
+
+void *transmitter(void *arg)
+{
+    startTurn(END_TX);
+    LinkLayer params = sim.params;
+    strcpy(params.serialPort, "tx");
+    params.role = LlTx;
+    char trace[FILENAME_MAX];
+    if (sim.trace != NULL)
+    {
+        snprintf(trace, sizeof(trace), "%s-tx.trace", sim.trace);
+        params.traceFile = trace;
+    }
+
+    Link *link = llopenLink(params);
+    if (link != NULL)
+    {
+        sim.txConnected = sim.clock;
+        for (int offset = 0; offset < sim.size; offset += MAX_PAYLOAD_SIZE)
+        {
+            int size = sim.size - offset < MAX_PAYLOAD_SIZE ? sim.size - offset : MAX_PAYLOAD_SIZE;
+            int last = offset + size == sim.size;
+            if ((last ? llwriteCloseLink : llwriteLink)(link, sim.data + offset, size) == -1)
+            {
+                break;
+            }
+
+            for (int i = 0; i < sim.outageCount; i++)
+            {
+                Outage *outage = &sim.outages[i];
+                if (outage->recovery == -1 && sim.clock >= outage->end)
+                {
+                    outage->recovery = sim.clock - outage->end;
+                }
+            }
+        }
+        sim.txEnd = sim.clock;
+        llstatsLink(link, &sim.txStats);
+        if (llcloseLink(link, FALSE) == 0)
+        {
+            sim.closed[END_TX] = sim.clock;
+        }
+    }
+    endTurn(END_TX);
+    return NULL;
+}
+
+// Let the other end run until start. The bytes that arrive meanwhile are
+// lost, as a port that is not open yet does not keep them.
+void startLate(int end, int64_t start)
+{
+    Wire *wire = &sim.wires[end];
+    while (TRUE)
+    {
+        while (wire->count > 0 && wire->arrival[wire->head] <= sim.clock)
+        {
+            wire->head = (wire->head + 1) % WIRE_SIZE;
+            wire->count--;
+        }
+        if (sim.clock >= start)
+        {
+            return;
+        }
+        waitTurn(end, start);
+    }
+}
+
+void *receiver(void *arg)
+{
+    startTurn(END_RX);
+    startLate(END_RX, sim.rxDelay);
+    LinkLayer params = sim.params;
+    strcpy(params.serialPort, "rx");
+    params.role = LlRx;
+    char trace[FILENAME_MAX];
+    if (sim.trace != NULL)
+    {
+        snprintf(trace, sizeof(trace), "%s-rx.trace", sim.trace);
+        params.traceFile = trace;
+    }
+
+    Link *link = llopenLink(params);
+    if (link != NULL)
+    {
+        unsigned char packet[MAX_PAYLOAD_SIZE + 1];
+        sim.intact = TRUE;
+        while (sim.received < sim.size)
+        {
+            int size = llreadLink(link, packet);
+            LinkLayerStats stats;
+            llstatsLink(link, &stats);
+            if (size == -1 && stats.down)
+            {
+                break; // the keepalive gave up on the transmitter
+            }
+            if (size == -1)
+            {
+                // the transmitter started over
+                sim.newSessions++;
+                sim.received = 0;
+                continue;
+            }
+            if (sim.received + size > sim.size || memcmp(packet, sim.data + sim.received, size) != 0)
+            {
+                sim.intact = FALSE;
+            }
+            sim.received += size;
+        }
+        llstatsLink(link, &sim.rxStats);
+        if (llcloseLink(link, FALSE) == 0)
+        {
+            sim.closed[END_RX] = sim.clock;
+        }
+    }
+    endTurn(END_RX);
+    return NULL;
+}
+
+////////////////////////////////////////////////
+// Runs
+////////////////////////////////////////////////
+
+// Returns TRUE if the file was delivered intact
+int simulate(uint64_t seed, double *efficiency, double *duration)
+{
+    memset(sim.wires, 0, sizeof(sim.wires));
+    memset(sim.ends, 0, sizeof(sim.ends));
+    memset(&sim.txStats, 0, sizeof(sim.txStats));
+    memset(&sim.rxStats, 0, sizeof(sim.rxStats));
+    for (int i = 0; i < sim.outageCount; i++)
+    {
+        sim.outages[i].recovery = -1;
+    }
+    sim.clock = 0;
+    sim.random = seed * 0x9E3779B97F4A7C15ULL + 1;
+    sim.running = END_RX;
+    sim.aborted = FALSE;
+    sim.txConnected = -1;
+    sim.txEnd = -1;
+    sim.closed[END_RX] = sim.closed[END_TX] = -1;
+    sim.received = 0;
+    sim.intact = FALSE;
+    sim.newSessions = 0;
+
+    pthread_t threads[2];
+    pthread_create(&threads[END_RX], NULL, receiver, NULL);
+    pthread_create(&threads[END_TX], NULL, transmitter, NULL);
+    pthread_join(threads[END_RX], NULL);
+    pthread_join(threads[END_TX], NULL);
+
+    int delivered = !sim.aborted && sim.intact && sim.received == sim.size && sim.txEnd >= 0;
+    *duration = sim.txEnd >= 0 ? (double)sim.txEnd / NS : (double)sim.clock / NS;
+    *efficiency = delivered ? sim.size * 8.0 / *duration / sim.baudRate : 0;
+
+    printf("seed %llu: %s in %.3f s, efficiency %.4f, ", (unsigned long long)seed,
+           delivered ? "delivered" : "FAILED", *duration, *efficiency);
+    if (sim.txConnected >= 0)
+    {
+        printf("connected at %.3f s, ", (double)sim.txConnected / NS);
+    }
+    else
+    {
+        printf("not connected, ");
+    }
+    if (sim.closed[END_RX] >= 0 && sim.closed[END_TX] >= 0)
+    {
+        printf("closed at %.3f s, ",
+               (double)(sim.closed[END_RX] > sim.closed[END_TX] ? sim.closed[END_RX] : sim.closed[END_TX]) / NS);
+    }
+    else
+    {
+        printf("not closed, ");
+    }
+    // duplicates are only seen by the receiver
+    printf("frames %d, retransmissions %d, timeouts %d, duplicates %d, reconnects %d",
+           sim.txStats.frames, sim.txStats.retransmissions, sim.txStats.timeouts, sim.rxStats.duplicates,
+           sim.txStats.reconnects);
+    if (!delivered)
+    {
+        printf(" (received %d bytes%s%s)", sim.received, sim.intact ? "" : ", corrupted",
+               sim.aborted ? ", stuck" : "");
+    }
+    if (sim.newSessions > 0)
+    {
+        printf(", new sessions %d", sim.newSessions);
+    }
+    if (sim.params.keepalive > 0)
+    {
+        printf(", link downs %d", sim.txStats.linkDowns);
+    }
+    for (int i = 0; i < sim.outageCount; i++)
+    {
+        if (sim.outages[i].recovery >= 0)
+        {
+            printf(", recovery %.3f s", (double)sim.outages[i].recovery / NS);
+        }
+        else
+        {
+            printf(", no recovery");
+        }
+    }
+    printf("\n");
+    return delivered;
+}
+
+int loadFile(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    sim.size = fread(data, 1, size, fp);
+    sim.data = data;
+    fclose(fp);
+    return 0;
+}
+
+void printUsage(const char *program)
+{
+    printf("Usage: %s [-b baud] [-e ber] [-t timeout] [-r retransmissions] [-c] [-k interval]\n"
+           "       [-o start:duration]... [-d delay] [-n runs] [-s seed] [-l limit] [-T prefix] [file]\n"
+           "  -b baud            : cable baud rate (default 9600)\n"
+           "  -e ber             : bit error rate of both directions (default 0)\n"
+           "  -t timeout         : retransmission timeout in seconds (default 4)\n"
+           "  -r retransmissions : retransmissions before probing the receiver (default 3)\n"
+           "  -c                 : COBS framing\n"
+           "  -k interval        : keepalive heartbeat interval in milliseconds (default none)\n"
+           "  -o start:duration  : unplug the cable at start seconds, for duration seconds\n"
+           "  -d delay           : start the receiver delay seconds after the transmitter\n"
+           "  -n runs            : number of runs, with seeds seed, seed + 1...\n"
+           "  -s seed            : seed of the first run (default 1)\n"
+           "  -l limit           : virtual seconds after which a run is given up (default 3600)\n"
+           "  -T prefix          : write the event trace of each end to prefix-tx.trace and prefix-rx.trace\n"
+           "  file               : file to send (default 64 KiB of random bytes)\n",
+           program);
+}
+
+int main(int argc, char *argv[])
+{
+    sim.baudRate = 9600;
+    sim.params.timeout = 4;
+    sim.params.nRetransmissions = 3;
+    sim.limit = 3600 * NS;
+    int runs = 1;
+    uint64_t seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:e:t:r:ck:o:d:n:s:l:T:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            sim.baudRate = atoi(optarg);
+            break;
+        case 'e':
+            sim.ber = atof(optarg);
+            break;
+        case 't':
+            sim.params.timeout = atoi(optarg);
+            break;
+        case 'r':
+            sim.params.nRetransmissions = atoi(optarg);
+            break;
+        case 'c':
+            sim.params.cobs = TRUE;
+            break;
+        case 'k':
+            sim.params.keepalive = atoi(optarg);
+            break;
+        case 'o':
+        {
+            double start, duration;
+            if (sim.outageCount == MAX_OUTAGES || sscanf(optarg, "%lf:%lf", &start, &duration) != 2)
+            {
+                printf("Invalid outage %s (at most %d, start:duration)\n", optarg, MAX_OUTAGES);
+                return 1;
+            }
+            sim.outages[sim.outageCount].start = start * NS;
+            sim.outages[sim.outageCount].end = (start + duration) * NS;
+            sim.outageCount++;
+            break;
+        }
+        case 'd':
+            sim.rxDelay = atof(optarg) * NS;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            sim.limit = atof(optarg) * NS;
+            break;
+        case 'T':
+            sim.trace = optarg;
+            break;
+        default:
+            printUsage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (sim.baudRate <= 0 || runs <= 0)
+    {
+        printf("Invalid baud rate or number of runs\n");
+        return 1;
+    }
+    sim.params.baudRate = sim.baudRate;
+    double intact = 1;
+    for (int i = 0; i < 8; i++)
+    {
+        intact *= 1 - sim.ber;
+    }
+    sim.byteError = 1 - intact;
+
+    if (optind < argc)
+    {
+        if (loadFile(argv[optind]) == -1)
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        unsigned char *data = malloc(DEFAULT_SIZE);
+        for (int i = 0; i < DEFAULT_SIZE; i++)
+        {
+            data[i] = rand() & 0xFF;
+        }
+        sim.data = data;
+        sim.size = DEFAULT_SIZE;
+    }
+
+    pthread_mutex_init(&sim.lock, NULL);
+    pthread_cond_init(&sim.turn, NULL);
+
+    struct timespec realStart, realEnd;
+    clock_gettime(CLOCK_MONOTONIC, &realStart);
+    int delivered = 0;
+    double totalEfficiency = 0, totalDuration = 0;
+    double minEfficiency = 1, maxEfficiency = 0;
+    for (int i = 0; i < runs; i++)
+    {
+        double efficiency, duration;
+        if (simulate(seed + i, &efficiency, &duration))
+        {
+            delivered++;
+            totalEfficiency += efficiency;
+            if (efficiency < minEfficiency)
+            {
+                minEfficiency = efficiency;
+            }
+            if (efficiency > maxEfficiency)
+            {
+                maxEfficiency = efficiency;
+            }
+        }
+        totalDuration += duration;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &realEnd);
+    double real = realEnd.tv_sec - realStart.tv_sec + (realEnd.tv_nsec - realStart.tv_nsec) / 1e9;
+
+    printf("%d of %d runs delivered %d bytes", delivered, runs, sim.size);
+    if (delivered > 0)
+    {
+        printf(", efficiency mean %.4f min %.4f max %.4f", totalEfficiency / delivered, minEfficiency, maxEfficiency);
+    }
+    printf("\n%.1f s simulated in %.2f s\n", totalDuration, real);
+    return delivered == runs ? 0 : 1;
+}
@@ -2,6 +2,10 @@
 
 #include "application_layer.h"
 #include "link_layer.h"
+#include "xxhash64.h"
+#include "progress.h"
+#include "mux.h"
+#include "file_io.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -9,74 +13,763 @@
 #include <malloc.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 
 
 
-#define HEADER_SIZE 8
-#define CTRL_HEADER_SIZE 7
+#define HEADER_SIZE 8 // Version 1 data packet header
 #define CTRL_FILESIZE 0x0
 #define CTRL_FILENAME 0x01
+#define CTRL_VERSION 0x02
+#define CTRL_HASH 0x03 // XXH64 of the whole file, sent in CTRL_END
+#define CTRL_FILES 0x04 // Number of files sent in the session, if more than one
 #define CTRL_START 0x01
 #define CTRL_DATA 0x02
 #define CTRL_END 0x03
+#define CTRL_MESSAGE 0x05 // Text typed on the transmitter, followed by the text
 
+// Version 2 data packets: control, varint sequence number, varint byte offset
+#define PACKET_VERSION 2
+#define DATA_HEADER_MAX_SIZE (1 + 5 + 10)
+#define MAX_FILENAME 255
 
-void drawHeader(const char* header, LinkLayerRole role){
-    #ifdef _WIN32
-        system("cls");
-    #endif
-    #ifdef __linux__
-        system("clear");
-    #endif
-    
-    
-    if(role == LlRx) printf("Receiving file %s\n", header);
-    else printf("Transmiting file %s\n", header);
+// Each file has its own channel, the messages one with a higher priority
+#define MAX_FILES (MUX_MAX_CHANNELS - 1)
+#define FILE_PRIORITY 0
+#define MESSAGE_PRIORITY 1
+#define MAX_MESSAGE 256
+#define SUBMIT_AHEAD 2 // packets queued on the link, more would delay the messages
+#define KEEPALIVE_INTERVAL 250 // msec between heartbeats, a lost link is reported after 4 of them
+
+typedef struct{
+    int version;
+    uint64_t fileSize;
+    char filename[MAX_FILENAME + 1];
+    int hasDigest;
+    uint64_t digest;
+    int files;
+} FileInfo;
+
+
+// Encode value as a little-endian base-128 varint
+// Returns the number of bytes written (at most 10)
+int putVarint(unsigned char *buf, uint64_t value){
+    int size = 0;
+    while(value >= 0x80){
+        buf[size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[size++] = value;
+    return size;
 }
 
-void drawProgress(float progress){
-    float width = 20.0;
+// Decode a varint from at most bufSize bytes
+// Returns the number of bytes read or -1 if the varint is truncated or too long
+int getVarint(const unsigned char *buf, int bufSize, uint64_t *value){
+    *value = 0;
+    for(int i = 0; i < bufSize && i < 10; i++){
+        *value |= (uint64_t) (buf[i] & 0x7F) << (7 * i);
+        if((buf[i] & 0x80) == 0) return i + 1;
+    }
+    return -1;
+}
+
+// Build a CTRL_START / CTRL_END packet announcing the file and the packet
+// format version used for the data packets. digest is only sent if not NULL,
+// the number of files only if there are several.
+// Returns the packet size
+int buildControlPacket(unsigned char control, uint64_t fileSize, const char *filename, const uint64_t *digest,
+                       int files, int version, unsigned char *buf){
+    int size = 0;
+    buf[size++] = control;
+
+    buf[size++] = CTRL_FILESIZE;
+    buf[size++] = 8;
+    for(int i = 7; i >= 0; i--){
+        buf[size++] = (fileSize >> (8 * i)) & 0xFF;
+    }
+
+    unsigned char filenameSize = strlen(filename);
+    buf[size++] = CTRL_FILENAME;
+    buf[size++] = filenameSize;
+    memcpy(&buf[size], filename, filenameSize);
+    size += filenameSize;
 
-    printf("Progress [");
-    for(int i = 1; i <= width; i++){
-        if((i / width) <= progress) printf("#");
-        else printf(" ");
-    }   
-    printf("] %.2f%%\n", progress * 100);
+    buf[size++] = CTRL_VERSION;
+    buf[size++] = 1;
+    buf[size++] = version;
+
+    if(digest != NULL){
+        buf[size++] = CTRL_HASH;
+        buf[size++] = 8;
+        for(int i = 7; i >= 0; i--){
+            buf[size++] = (*digest >> (8 * i)) & 0xFF;
+        }
+    }
+
+    if(files > 1){
+        buf[size++] = CTRL_FILES;
+        buf[size++] = 1;
+        buf[size++] = files;
+    }
+    return size;
 }
 
-int saveToFile(char* filename, unsigned char* file, int size){
-    FILE* fp = fopen(filename, "w");
-    if (fp == NULL) {
-        perror("Error opening file");
-        return - 1;
+// Build the start packet of the first transmitters, the only one a legacy
+// receiver reads: [4-byte size][name length][name], see parseControlPacket
+// Returns the packet size
+int buildLegacyStartPacket(uint32_t fileSize, const char *filename, unsigned char *buf){
+    unsigned char filenameSize = strlen(filename);
+    buf[0] = CTRL_START;
+    buf[1] = CTRL_FILESIZE;
+    buf[2] = 4;
+    for(int i = 0; i < 4; i++){
+        buf[3 + i] = (fileSize >> (8 * (3 - i))) & 0xFF;
     }
-    size_t written = fwrite(file, 1, size, fp);
+    buf[7] = filenameSize;
+    memcpy(&buf[8], filename, filenameSize);
+    return 8 + filenameSize;
+}
 
-    if(written != size){
-        perror("Error writing to file");
+// Parse the TLVs of a CTRL_START / CTRL_END packet. Unknown TLVs are skipped.
+// A transmitter that does not send CTRL_VERSION uses the version 1 format.
+// Returns 0 on success or -1 if the packet is malformed
+int parseControlPacket(const unsigned char *packet, int size, FileInfo *info){
+    info->version = 1;
+    info->fileSize = 0;
+    info->filename[0] = '\0';
+    info->hasDigest = FALSE;
+    info->files = 1;
+
+    // The first transmitters overwrote the CTRL_FILENAME type byte, so their
+    // start packet is [4-byte size][name length][name] with no type
+    if(size >= 8 && packet[1] == CTRL_FILESIZE && packet[2] == 4 && size == 8 + packet[7]){
+        info->fileSize = (uint64_t) packet[3] << 24 | packet[4] << 16 | packet[5] << 8 | packet[6];
+        memcpy(info->filename, &packet[8], packet[7]);
+        info->filename[packet[7]] = '\0';
+        return 0;
+    }
+
+    int i = 1;
+    while(i + 2 <= size){
+        unsigned char type = packet[i];
+        unsigned char length = packet[i + 1];
+        const unsigned char *value = &packet[i + 2];
+        if(i + 2 + length > size) return -1;
+
+        switch (type)
+        {
+        case CTRL_FILESIZE:
+            // 4 bytes (version 1) or 8 bytes, big endian
+            if(length > 8) return -1;
+            info->fileSize = 0;
+            for(int j = 0; j < length; j++){
+                info->fileSize = (info->fileSize << 8) | value[j];
+            }
+            break;
+        case CTRL_FILENAME:
+            memcpy(info->filename, value, length);
+            info->filename[length] = '\0';
+            break;
+        case CTRL_VERSION:
+            if(length >= 1) info->version = value[0];
+            break;
+        case CTRL_HASH:
+            if(length != 8) return -1;
+            info->digest = 0;
+            for(int j = 0; j < 8; j++){
+                info->digest = (info->digest << 8) | value[j];
+            }
+            info->hasDigest = TRUE;
+            break;
+        case CTRL_FILES:
+            if(length >= 1 && value[0] > 0) info->files = value[0];
+            break;
+        default:
+            break;
+        }
+        i += 2 + length;
     }
-    fclose(fp);
     return 0;
 }
 
-int sendInformationPacket(int sequence, int payload, unsigned char* frameBuf){
-    frameBuf[0] = 2;
-    frameBuf[1] = sequence % 256;
-    frameBuf[2] = (payload >> 8) & 0xFF;
-    frameBuf[3] = (payload & 0xFF);
+// Hash a file that was written out of order, by reading it back
+uint64_t hashFile(int fd, uint64_t size){
+    Xxh64State state;
+    unsigned char buf[65536];
+    uint64_t offset = 0;
+    xxh64Reset(&state, 0);
+    while(offset < size){
+        ssize_t n = pread(fd, buf, sizeof(buf), offset);
+        if(n <= 0) break;
+        xxh64Update(&state, buf, n);
+        offset += n;
+    }
+    return xxh64Digest(&state);
+}
 
-    int ret = llwrite(frameBuf, payload);
-    if(ret == -1){
-        printf("Disconnected! Please reconnect the cable.\n");
+// File being sent: builds its start, data and end packets. The data is read
+// ahead, each packet is built in place in the buffer its data was read into.
+typedef struct{
+    int fd;
+    FileIo *io;
+    const char *filename;
+    uint64_t fileSize;
+    uint64_t offset;
+    uint32_t sequence;
+    uint64_t readOffset;    // of the next read ahead
+    uint32_t readSequence;
+    int maxPayload;         // agreed with the peer in llopen, less the channel tag
+    int files;              // files sent in the session
+    int version;            // of the packets, 1 for a legacy receiver
+    int next;               // next packet: CTRL_START, CTRL_DATA, CTRL_END or 0 when done
+    Xxh64State hashState;   // the file is hashed as it goes out, no second pass is needed
+    Progress progress;
+    unsigned char *buf;     // control packets
+} Sender;
+
+// File being received: every data packet is written at its offset, up to
+// FILE_IO_DEPTH of them in the background
+typedef struct{
+    FileInfo info;
+    int fd;
+    FileIo *io;
+    uint64_t received;
+    uint64_t nextOffset;    // offset of a version 1 packet (sequential)
+    uint32_t nextSequence;
+    Xxh64State hashState;   // the file is hashed while it is written, as long as it arrives in order
+    uint64_t hashed;
+    int hashInOrder;
+    int writeFailed;        // the file on disk is not what was received, the rest of it is dropped
+    Progress progress;
+} Receiver;
+
+// Size of the header for a data packet
+int dataHeaderSize(int version, uint32_t sequence, uint64_t offset){
+    unsigned char header[DATA_HEADER_MAX_SIZE];
+    if(version < 2) return HEADER_SIZE;
+    return 1 + putVarint(header, sequence) + putVarint(header, offset);
+}
+
+// Open the file to send (relative to the parent directory), sent in packets
+// of at most maxPayload bytes along with files - 1 other files, in the
+// given packet format version
+// Returns 0 on success or -1 on error
+int senderOpen(Sender *sender, const char *filename, int maxPayload, int files, int version){
+    char* filePath = malloc(strlen(filename) + 4);
+    sprintf(filePath, "%s%s", "../", filename);
+    sender->fd = open(filePath, O_RDONLY);
+    free(filePath);
+
+    if(sender->fd == -1){
+        printf("%s file does not exist!", filename);
+        return -1;
+    }
+
+    // Get file size
+    sender->fileSize = lseek(sender->fd, 0, SEEK_END);
+    if(version < 2 && sender->fileSize > UINT32_MAX){
+        printf("%s is too large for the peer\n", filename);
+        close(sender->fd);
+        return -1;
+    }
+    sender->io = fileIoCreate();
+    if(sender->io == NULL){
+        close(sender->fd);
+        return -1;
+    }
+
+    sender->maxPayload = maxPayload;
+    sender->files = files;
+    sender->version = version;
+    sender->filename = filename;
+    sender->offset = 0;
+    sender->sequence = 0;
+    sender->readOffset = 0;
+    sender->readSequence = 0;
+    sender->next = CTRL_START;
+    xxh64Reset(&sender->hashState, 0);
+    sender->buf = (unsigned char*) malloc(MAX_PAYLOAD_SIZE);
+    if(sender->buf == NULL){
+        perror("malloc");
+        fileIoDestroy(sender->io);
+        close(sender->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Size of the data packet payload at offset
+int senderPayload(Sender *sender, uint32_t sequence, uint64_t offset){
+    int payload = sender->maxPayload - dataHeaderSize(sender->version, sequence, offset);
+    if(sender->fileSize - offset < payload) payload = sender->fileSize - offset;
+    return payload;
+}
+
+// Keep reads in flight for the packets after the current one, the buffer of
+// the packet returned last is free again once the next one is asked for
+void senderReadAhead(Sender *sender){
+    while(fileIoPending(sender->io) < FILE_IO_DEPTH && sender->readOffset < sender->fileSize){
+        int payload = senderPayload(sender, sender->readSequence, sender->readOffset);
+        unsigned char *data = fileIoBuffer(sender->io) + DATA_HEADER_MAX_SIZE;
+        fileIoRead(sender->io, sender->fd, data, payload, sender->readOffset);
+        sender->readOffset += payload;
+        sender->readSequence++;
+    }
+}
+
+// Build the next packet to send, *packet is set to its start
+// Returns the packet size, 0 when the whole file was sent or -1 on error
+int senderNext(Sender *sender, unsigned char **packet){
+    *packet = sender->buf;
+
+    switch (sender->next)
+    {
+    case CTRL_START:
+        // File is opened, control packet must be sent to start transmission
+        progressStart(&sender->progress, sender->filename, LlTx, sender->fileSize);
+        sender->next = sender->fileSize > 0 ? CTRL_DATA : CTRL_END;
+        senderReadAhead(sender);
+        if(sender->version < 2) return buildLegacyStartPacket(sender->fileSize, sender->filename, sender->buf);
+        return buildControlPacket(CTRL_START, sender->fileSize, sender->filename, NULL, sender->files,
+                                  sender->version, sender->buf);
+    case CTRL_DATA: {
+        progressUpdate(&sender->progress, sender->offset);
+
+        uint64_t offset = sender->offset;
+        uint32_t sequence = sender->sequence;
+        int maxPayload = senderPayload(sender, sequence, offset);
+
+        senderReadAhead(sender);
+        unsigned char *payload;
+        int bytesRead = fileIoCollect(sender->io, &payload);
+        if(bytesRead != maxPayload){
+            printf("Error reading frame %u : %d\n", sequence, bytesRead);
+            return -1;
+        }
+        xxh64Update(&sender->hashState, payload, bytesRead);
+
+        // the header is written just before the payload
+        unsigned char header[DATA_HEADER_MAX_SIZE];
+        int headerSize = 0;
+        header[headerSize++] = CTRL_DATA;
+        if(sender->version < 2){
+            // sequence number, packet size and 4 unused bytes
+            header[headerSize++] = sequence & 0xFF;
+            header[headerSize++] = ((HEADER_SIZE + bytesRead) >> 8) & 0xFF;
+            header[headerSize++] = (HEADER_SIZE + bytesRead) & 0xFF;
+            memset(&header[headerSize], 0, HEADER_SIZE - headerSize);
+            headerSize = HEADER_SIZE;
+        }
+        else{
+            headerSize += putVarint(&header[headerSize], sequence);
+            headerSize += putVarint(&header[headerSize], offset);
+        }
+        *packet = payload - headerSize;
+        memcpy(*packet, header, headerSize);
+
+        sender->sequence++;
+        sender->offset += bytesRead;
+        if(sender->offset == sender->fileSize) sender->next = CTRL_END;
+        return headerSize + bytesRead;
+    }
+    case CTRL_END: {
+        progressFinish(&sender->progress, sender->offset);
+
+        // send end control, with the digest of the file
+        uint64_t digest = xxh64Digest(&sender->hashState);
+        sender->next = 0;
+        return buildControlPacket(CTRL_END, sender->fileSize, sender->filename, &digest, sender->files,
+                                  sender->version, sender->buf);
+    }
+    default:
+        return 0;
+    }
+}
+
+void senderClose(Sender *sender){
+    free(sender->buf);
+    fileIoDestroy(sender->io);
+    close(sender->fd);
+}
+
+void receiverInit(Receiver *receiver){
+    memset(receiver, 0, sizeof(Receiver));
+    receiver->fd = -1;
+    receiver->hashInOrder = TRUE;
+}
+
+void receiverClose(Receiver *receiver){
+    if(receiver->io != NULL) fileIoDestroy(receiver->io);
+    if(receiver->fd != -1) close(receiver->fd);
+    receiver->io = NULL;
+    receiver->fd = -1;
+}
+
+// Wait for the oldest write of the file, a failed or short one fails the file
+void receiverWritten(Receiver *receiver){
+    unsigned char *data;
+    int size = fileIoCollect(receiver->io, &data);
+    if(size == -1 && !receiver->writeFailed){
+        perror("Error writing to file");
+        receiver->writeFailed = TRUE;
+    }
+}
+
+// Handle a packet received from the link layer
+// Returns TRUE once the end packet was received, FALSE otherwise or -1 on error
+int receiverHandle(Receiver *receiver, const unsigned char *packet, int bytes){
+    FileInfo *info = &receiver->info;
+
+    switch (packet[0])
+    {
+    case CTRL_START:
+        if(parseControlPacket(packet, bytes, info) == -1){
+            printf("Invalid start packet!\n");
+            break;
+        }
+        receiverClose(receiver);
+        receiver->fd = open(info->filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(receiver->fd == -1){
+            perror("Error opening file");
+            return -1;
+        }
+        receiver->io = fileIoCreate();
+        if(receiver->io == NULL) return -1;
+        receiver->writeFailed = FALSE;
+        xxh64Reset(&receiver->hashState, 0);
+        progressStart(&receiver->progress, info->filename, LlRx, info->fileSize);
+        break;
+    case CTRL_DATA:
+        if(receiver->fd == -1 || receiver->writeFailed) break;
+        uint64_t sequence, offset;
+        int headerSize;
+        if(info->version >= 2){
+            int seqSize = getVarint(&packet[1], bytes - 1, &sequence);
+            int offSize = seqSize == -1 ? -1 : getVarint(&packet[1 + seqSize], bytes - 1 - seqSize, &offset);
+            if(offSize == -1){
+                printf("Invalid data packet!\n");
+                break;
+            }
+            headerSize = 1 + seqSize + offSize;
+        }
+        else{
+            if(bytes < HEADER_SIZE){
+                printf("Invalid data packet!\n");
+                break;
+            }
+            sequence = packet[1];
+            offset = receiver->nextOffset;
+            headerSize = HEADER_SIZE;
+        }
+        if(info->version >= 2 && sequence != receiver->nextSequence){
+            printf("Unexpected packet %" PRIu64 " (expected %u)\n", sequence, receiver->nextSequence);
+        }
+        receiver->nextSequence = sequence + 1;
+
+        int dataSize = bytes - headerSize;
+        if(dataSize < 0 || dataSize > FILE_IO_BUFFER_SIZE){
+            printf("Invalid data packet!\n");
+            break;
+        }
+        if(fileIoPending(receiver->io) == FILE_IO_DEPTH) receiverWritten(receiver);
+        unsigned char *data = fileIoBuffer(receiver->io);
+        memcpy(data, &packet[headerSize], dataSize);
+        fileIoWrite(receiver->io, receiver->fd, data, dataSize, offset);
+        receiver->received += dataSize;
+        receiver->nextOffset = offset + dataSize;
+
+        if(offset == receiver->hashed){
+            xxh64Update(&receiver->hashState, &packet[headerSize], dataSize);
+            receiver->hashed += dataSize;
+        }
+        else receiver->hashInOrder = FALSE;
+        progressUpdate(&receiver->progress, receiver->received);
+        break;
+    case CTRL_END:
+        if(receiver->fd != -1) progressFinish(&receiver->progress, receiver->received);
+        if(receiver->received != info->fileSize){
+            printf("Received %" PRIu64 " of %" PRIu64 " bytes!\n", receiver->received, info->fileSize);
+        }
+        // the file is read back to hash it
+        while(receiver->io != NULL && fileIoPending(receiver->io) > 0) receiverWritten(receiver);
+        FileInfo end;
+        if(receiver->writeFailed) printf("File not saved, not verified\n");
+        else if(parseControlPacket(packet, bytes, &end) == 0 && end.hasDigest && receiver->fd != -1){
+            uint64_t digest = receiver->hashInOrder ? xxh64Digest(&receiver->hashState)
+                                                    : hashFile(receiver->fd, info->fileSize);
+            if(digest == end.digest) printf("File verified (XXH64 %016" PRIx64 ")\n", digest);
+            else printf("File corrupted! XXH64 %016" PRIx64 ", expected %016" PRIx64 "\n", digest, end.digest);
+        }
+        else printf("Transmitter sent no digest, file not verified\n");
+        return TRUE;
+    default:
+        break;
+    }
+    return FALSE;
+}
+
+////////////////////////////////////////////////
+// Channels
+////////////////////////////////////////////////
+
+// Lines typed on the standard input of the transmitter, sent as messages
+typedef struct{
+    int maxText;            // longest text that fits in a packet, longer lines are split
+    int eof;
+    char line[MAX_MESSAGE];
+    int lineSize;
+    unsigned char buf[1 + MAX_MESSAGE];
+} MessageSource;
+
+// Files sent in the session, each one on its own channel, and the messages
+typedef struct{
+    Mux mux;
+    Sender senders[MAX_FILES];
+    int files;
+    MessageSource messages;
+    char *names;
+} Outgoing;
+
+// Files received in the session, by channel
+typedef struct{
+    Receiver receivers[MUX_MAX_CHANNELS];
+    int files;              // announced by the transmitter
+    int done;               // completely received
+} Incoming;
+
+int fileSource(void *source, unsigned char **packet){
+    int size = senderNext((Sender *) source, packet);
+    if(size == -1) return MUX_ERROR;
+    return size > 0 ? size : -1;
+}
+
+// Returns the next typed line, without waiting for one
+int messageSource(void *source, unsigned char **packet){
+    MessageSource *messages = (MessageSource *) source;
+
+    while(TRUE){
+        char *newline = memchr(messages->line, '\n', messages->lineSize);
+        if(newline != NULL || messages->lineSize == messages->maxText || (messages->eof && messages->lineSize > 0)){
+            int textSize = newline != NULL ? newline - messages->line : messages->lineSize;
+            int consumed = newline != NULL ? textSize + 1 : textSize;
+            messages->buf[0] = CTRL_MESSAGE;
+            memcpy(&messages->buf[1], messages->line, textSize);
+            memmove(messages->line, messages->line + consumed, messages->lineSize - consumed);
+            messages->lineSize -= consumed;
+            if(textSize == 0) continue;
+
+            *packet = messages->buf;
+            return 1 + textSize;
+        }
+        if(messages->eof) return -1;
+
+        struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+        if(poll(&input, 1, 0) != 1) return 0;
+        int n = read(STDIN_FILENO, messages->line + messages->lineSize, messages->maxText - messages->lineSize);
+        if(n <= 0) messages->eof = TRUE;
+        else messages->lineSize += n;
+    }
+}
+
+// Open the files to send: a comma separated list of names, each one
+// optionally followed by ":weight", its share of the link (1 by default).
+// Returns 0 on success or -1 on error
+int outgoingOpen(Outgoing *out, const char *filenames){
+    LinkLayerCaps caps;
+    llcaps(&caps);
+    muxInit(&out->mux);
+    out->names = strdup(filenames);
+    out->files = 0;
+
+    char *names[MAX_FILES];
+    int weights[MAX_FILES];
+    char *save;
+    for(char *name = strtok_r(out->names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)){
+        if(out->files == MAX_FILES){
+            printf("Too many files, at most %d can be sent at once\n", MAX_FILES);
+            free(out->names);
+            return -1;
+        }
+        char *colon = strrchr(name, ':');
+        weights[out->files] = 1;
+        if(colon != NULL && colon[1] != '\0' && strspn(colon + 1, "0123456789") == strlen(colon + 1)){
+            weights[out->files] = atoi(colon + 1);
+            *colon = '\0';
+        }
+        names[out->files++] = name;
+    }
+    if(out->files == 0){
+        printf("No file to send!\n");
+        free(out->names);
+        return -1;
+    }
+    // a legacy receiver takes a single file, in the version 1 packets
+    if(caps.legacy && out->files > 1){
+        printf("The peer only takes one file at a time\n");
+        free(out->names);
         return -1;
     }
+    int version = caps.legacy ? 1 : PACKET_VERSION;
+
+    for(int i = 0; i < out->files; i++){
+        int channel = muxAdd(&out->mux, FILE_PRIORITY, weights[i], fileSource, &out->senders[i]);
+        if(senderOpen(&out->senders[i], names[i], muxPayload(channel, caps.maxPayload), out->files, version) == -1){
+            while(--i >= 0) senderClose(&out->senders[i]);
+            free(out->names);
+            return -1;
+        }
+    }
+
+    // a legacy receiver knows no messages, and reading a terminal from the
+    // background would stop the process
+    if(!caps.legacy && (!isatty(STDIN_FILENO) || tcgetpgrp(STDIN_FILENO) == getpgrp())){
+        int channel = muxAdd(&out->mux, MESSAGE_PRIORITY, 1, messageSource, &out->messages);
+        memset(&out->messages, 0, sizeof(MessageSource));
+        out->messages.maxText = muxPayload(channel, caps.maxPayload) - 1;
+        if(out->messages.maxText > MAX_MESSAGE) out->messages.maxText = MAX_MESSAGE;
+    }
     return 0;
 }
 
+void outgoingClose(Outgoing *out){
+    for(int i = 0; i < out->files; i++){
+        senderClose(&out->senders[i]);
+    }
+    free(out->names);
+}
+
+void incomingInit(Incoming *in){
+    for(int i = 0; i < MUX_MAX_CHANNELS; i++){
+        receiverInit(&in->receivers[i]);
+    }
+    in->files = 1;
+    in->done = 0;
+}
+
+// Handle a packet of any channel
+// Returns TRUE once every file was received, FALSE otherwise or -1 on error
+int incomingHandle(Incoming *in, unsigned char *packet, int bytes){
+    int channel = muxChannel(&packet, &bytes);
+    if(channel == -1 || channel >= MUX_MAX_CHANNELS){
+        printf("Invalid channel!\n");
+        return FALSE;
+    }
+
+    if(packet[0] == CTRL_MESSAGE){
+        // over the progress line
+        if(isatty(STDOUT_FILENO)) printf("\r\033[K");
+        printf("Message: %.*s\n", bytes - 1, (const char *) &packet[1]);
+        return FALSE;
+    }
+
+    Receiver *receiver = &in->receivers[channel];
+    int ret = receiverHandle(receiver, packet, bytes);
+    if(ret == -1) return -1;
+    if(packet[0] == CTRL_START && receiver->info.files > in->files) in->files = receiver->info.files;
+    if(ret == TRUE) in->done++;
+    return in->done >= in->files;
+}
+
+void incomingClose(Incoming *in){
+    for(int i = 0; i < MUX_MAX_CHANNELS; i++){
+        receiverClose(&in->receivers[i]);
+    }
+}
+
+// Send the files and messages and receive the peer's, one of them is NULL on a
+// one-way link. The link thread does the waiting: a few packets are submitted
+// ahead so it always has the next one, and the packets it reads are handled as
+// their completions come.
+// Returns 0 when done or the link failed, -1 on error
+int runTransfer(Outgoing *out, Incoming *in){
+    int completionFd = llstart();
+    if(completionFd == -1) return -1;
+
+    int sending = out != NULL;
+    int receiving = in != NULL;
+    int pending = 0;
+    int ret = 0;
+
+    // one packet is held back until the next is known, so the last one can
+    // carry the close request
+    unsigned char held[MAX_PAYLOAD_SIZE];
+    int heldSize = 0;
+
+    while(sending || pending > 0 || receiving){
+        while(sending && pending < SUBMIT_AHEAD){
+            unsigned char *packet;
+            int size = muxNext(&out->mux, &packet);
+            if(size == -1){
+                // a file could not be read, the rest of it would be missing
+                printf("Transfer aborted!\n");
+                ret = -1;
+                break;
+            }
+            if(size == 0){
+                sending = FALSE;
+                if(heldSize > 0 && llsubmitClose(held, heldSize) != -1) pending++;
+                heldSize = 0;
+                break;
+            }
+            if(heldSize > 0){
+                if(llsubmit(held, heldSize) == -1) break;
+                pending++;
+            }
+            memcpy(held, packet, size);
+            heldSize = size;
+        }
+        if(ret == -1) break;
+
+        struct pollfd completions = {completionFd, POLLIN, 0};
+        if(poll(&completions, 1, -1) == -1 && errno != EINTR){
+            perror("poll");
+            ret = -1;
+            break;
+        }
+
+        LlCompletion completion;
+        while(llcomplete(&completion)){
+            if(completion.type == LL_RECEIVED){
+                if(completion.size == -1){
+                    // the transmitter started a new session, it sends the files again
+                    printf("New session, restarting the transfer\n");
+                    incomingClose(in);
+                    incomingInit(in);
+                    continue;
+                }
+                int done = incomingHandle(in, completion.packet, completion.size);
+                if(done == -1) ret = -1;
+                if(done == TRUE) receiving = FALSE;
+                continue;
+            }
+
+            if(completion.id == 0){
+                // the link layer gave up on a silent transmitter
+                printf("Disconnected! Transfer aborted.\n");
+                receiving = FALSE;
+                continue;
+            }
+
+            pending--;
+            if(completion.type != LL_SENT && (sending || receiving)){
+                // llwrite reconnects by itself, a failure means the peer is gone
+                printf("Disconnected! Transfer aborted.\n");
+                sending = FALSE;
+                receiving = FALSE;
+            }
+        }
+        if(ret == -1) break;
+    }
+
+    llstop();
+    return ret;
+}
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename)
+                      int nTries, int timeout, const char *filename, int options)
 {
     
     LinkLayer linkLayerStruct;
@@ -86,137 +779,46 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     linkLayerStruct.baudRate = baudRate;
     linkLayerStruct.nRetransmissions = nTries;
     linkLayerStruct.timeout = timeout;
+    linkLayerStruct.duplex = (options & APP_DUPLEX) != 0;
+    linkLayerStruct.cobs = (options & APP_COBS) != 0;
+    linkLayerStruct.traceFile = NULL;
+    if(options & APP_TRACE) linkLayerStruct.traceFile = linkLayerStruct.role == LlTx ? "tx.trace" : "rx.trace";
+    linkLayerStruct.metricsName = NULL;
+    if(options & APP_METRICS) linkLayerStruct.metricsName = linkLayerStruct.role == LlTx ? "/linklayer-tx" : "/linklayer-rx";
+    linkLayerStruct.keepalive = (options & APP_KEEPALIVE) ? KEEPALIVE_INTERVAL : 0;
     int ret = llopen(linkLayerStruct);
     if(ret == -1){
         printf("Couldn't establish connection!\n");
         return;
     }
 
-    if(strcmp(role, "tx") == 0){
-        // transmitter
-        // try to open file
-        FILE* file;
-        char* filePath = malloc(sizeof(filename) + 10);
-        sprintf(filePath, "%s%s", "../", filename);
+    LinkLayerCaps caps;
+    llcaps(&caps);
+    printf("Link: payload %d, window %d, %s, %s%s\n", caps.maxPayload, caps.window,
+           caps.fcs == FCS_CRC16 ? "CRC-16" : "BCC2", (caps.features & FEATURE_COBS) ? "COBS" : "byte stuffing",
+           (caps.features & FEATURE_DUPLEX) ? ", full-duplex" : "");
+    if(linkLayerStruct.duplex && !(caps.features & FEATURE_DUPLEX)){
+        printf("The peer does not use full-duplex, transferring one way\n");
+    }
+    if(linkLayerStruct.cobs && linkLayerStruct.role == LlTx && !(caps.features & FEATURE_COBS)){
+        printf("The peer does not support COBS, using byte stuffing\n");
+    }
 
-        file = fopen(filePath, "rb");
-        free(filePath);
+    // both ends send and receive at the same time on a full-duplex link
+    int sends = (caps.features & FEATURE_DUPLEX) || linkLayerStruct.role == LlTx;
+    int receives = (caps.features & FEATURE_DUPLEX) || linkLayerStruct.role == LlRx;
 
-        if(file == NULL){
-            printf("%s file does not exist!", filename);
-            return ;
-        } 
+    Outgoing out;
+    Incoming in;
+    if(sends && outgoingOpen(&out, filename) == -1) return;
+    if(receives) incomingInit(&in);
 
-        // Get file size
-        uint32_t nrBytes;
-        fseek(file, 0, SEEK_END);
-        nrBytes = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        // File is opened, control packet must be sent to start transmission
-        unsigned char filenameSize = strlen(filename);
-        unsigned char ctrlBuf[CTRL_HEADER_SIZE + filenameSize];
-        ctrlBuf[0] = CTRL_START;
-        ctrlBuf[1] = CTRL_FILESIZE;
-        ctrlBuf[2] = 4;
-        ctrlBuf[3] = (nrBytes >> 24) & 0xFF;
-        ctrlBuf[4] = (nrBytes >> 16) & 0xFF;
-        ctrlBuf[5]  = (nrBytes >> 8) & 0xFF;
-        ctrlBuf[6] = nrBytes & 0xFF;
-        ctrlBuf[7] = CTRL_FILENAME;
-        ctrlBuf[CTRL_HEADER_SIZE] = filenameSize;
-        memcpy(&ctrlBuf[CTRL_HEADER_SIZE + 1], filename, filenameSize);
-
-
-        // write control word
-        llwrite(ctrlBuf, CTRL_HEADER_SIZE + filenameSize + 1);
-
-        int maxPayload = MAX_PAYLOAD_SIZE - HEADER_SIZE;
-        uint16_t nrFrames = (nrBytes / (maxPayload));
-        uint8_t lastFrameSize = nrBytes % (maxPayload);
-        
-        unsigned char* frameBuff = (unsigned char*) malloc(MAX_PAYLOAD_SIZE);
-
-        for(int i = 0; i < nrFrames ; i++){
-            drawHeader(filename, LlTx);
-            drawProgress(i / (nrFrames + 1.0));
-            
-            unsigned int bytesRead = fread(frameBuff + HEADER_SIZE, 1, maxPayload, file);
-            if(bytesRead != maxPayload){
-                printf("Error reading frame %d : %d\n", i, bytesRead);
-                return;
-            }
-
-            int ret = sendInformationPacket(i, bytesRead + HEADER_SIZE, frameBuff);
-            if (ret == -1) sleep(1);
-        }
-        if(lastFrameSize > 0){
-            unsigned bytesRead = fread(&frameBuff[HEADER_SIZE], 1, lastFrameSize, file);
-            if(bytesRead != lastFrameSize){
-                printf("Error reading frame %d\n", nrFrames);
-            }
-
-            int ret = sendInformationPacket(nrFrames + 1, bytesRead + HEADER_SIZE, frameBuff);
-            if(ret == -1) return;
-        }
-        
-        free(frameBuff);
-        drawHeader(filename, LlTx);
-        drawProgress(1.0);
-    
-        fclose(file);
-
-        // send end control
-        ctrlBuf[0] = CTRL_END;
-        llwrite(ctrlBuf, 5);
-
-        // Start llclose
-        llclose(1);
-
-        printf("Closed\n");
-
-    }else{
-        // receiver
-        // receive file and save it
-        
-        uint32_t fileSize;
-        int idx = 0;
-        unsigned char* file;
-        char* filename = NULL;
-        int done = FALSE;
-        unsigned char packet[MAX_PAYLOAD_SIZE + 1];
-
-        while(!done){
-            int bytes = llread(&packet[0]);
-            if (filename != NULL) drawHeader(filename, LlRx);
-            if(bytes == -1){
-                llopen(linkLayerStruct);
-                continue;
-            }
+    ret = runTransfer(sends ? &out : NULL, receives ? &in : NULL);
+    if(sends) outgoingClose(&out);
+    if(receives) incomingClose(&in);
+    if(ret == -1) return;
 
-            switch (packet[0])
-            {
-            case CTRL_START:
-                fileSize = (packet[3] << 24) | (packet[4] << 16) | (packet[5] << 8) | packet[6];
-                filename = (char*) malloc(packet[CTRL_HEADER_SIZE]);
-                memcpy(filename, &packet[CTRL_HEADER_SIZE + 1], packet[CTRL_HEADER_SIZE]);
-                file = (unsigned char*) malloc(fileSize);
-                break;
-            case CTRL_DATA:
-                drawProgress((idx + 0.0) / (fileSize + 0.0));
-                memcpy(&file[idx], &packet[HEADER_SIZE], bytes - HEADER_SIZE);
-                idx += (bytes - HEADER_SIZE);
-                break;
-            case CTRL_END:
-                saveToFile(filename, file, idx);
-                done = TRUE;
-                break;
-            default:
-                break;
-            }
-        }
-        free(file);
-        free(filename);
-        llclose(0);
-        printf("CLOSED!\n");
-    }
-}
\ No newline at end of file
+    // Start llclose
+    llclose(1);
+    printf(sends ? "Closed\n" : "CLOSED!\n");
+}
@@ -0,0 +1,50 @@
+// COBS implementation.
+// Plain COBS removes the zero bytes. Removing FLAG instead is the same as
+// encoding the data xor'd with FLAG and xor'ing the result back, which leaves
+// the data bytes untouched and only xors the code bytes. So a block is found
+// with memchr and copied with memcpy.
+
+#include "cobs.h"
+#include "macros.h"
+
+#include <string.h>
+
+int cobsEncode(const unsigned char *in, int size, unsigned char *out){
+    const unsigned char *end = in + size;
+    int outSize = 0;
+
+    while(1){
+        int run = end - in < COBS_MAX_RUN ? end - in : COBS_MAX_RUN;
+        const unsigned char *flag = memchr(in, FLAG, run);
+        if(flag != NULL) run = flag - in;
+
+        // a block shorter than COBS_MAX_RUN is followed by a FLAG, unless it is the last one
+        if(out != NULL){
+            out[outSize] = (run + 1) ^ FLAG;
+            memcpy(&out[outSize + 1], in, run);
+        }
+        outSize += run + 1;
+        in += run;
+
+        if(flag != NULL) in++;
+        else if(in == end) break;
+    }
+    return outSize;
+}
+
+int cobsDecode(const unsigned char *in, int size, unsigned char *out){
+    if(size == 0) return -1;
+
+    int outSize = 0;
+    int i = 0;
+    while(i < size){
+        int code = in[i++] ^ FLAG;
+        if(code == 0 || i + code - 1 > size) return -1;
+
+        memcpy(&out[outSize], &in[i], code - 1);
+        outSize += code - 1;
+        i += code - 1;
+        if(code <= COBS_MAX_RUN && i < size) out[outSize++] = FLAG;
+    }
+    return outSize;
+}
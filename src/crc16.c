@@ -0,0 +1,30 @@
+// CRC-16/CCITT-FALSE implementation
+
+#include "crc16.h"
+
+static uint16_t table[256];
+static int tableReady = 0;
+
+static void buildTable(void){
+    for(int i = 0; i < 256; i++){
+        uint16_t crc = i << 8;
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+        table[i] = crc;
+    }
+    tableReady = 1;
+}
+
+uint16_t crc16Update(uint16_t crc, unsigned char byte){
+    if(!tableReady) buildTable();
+    return (crc << 8) ^ table[(crc >> 8) ^ byte];
+}
+
+uint16_t crc16(const unsigned char *data, int size){
+    uint16_t crc = CRC16_INIT;
+    for(int i = 0; i < size; i++){
+        crc = crc16Update(crc, data[i]);
+    }
+    return crc;
+}
@@ -0,0 +1,359 @@
+// Asynchronous file reads and writes implementation
+
+#include "file_io.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include) && !defined(FILE_IO_NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+typedef enum{
+    REQUEST_QUEUED,     // waiting for a thread of the pool
+    REQUEST_RUNNING,
+    REQUEST_DONE
+} RequestState;
+
+typedef struct{
+    int write;
+    int fd;
+    unsigned char *data;
+    int size;
+    uint64_t offset;
+    RequestState state;
+    int result;         // bytes read or written, or -errno
+} FileIoRequest;
+
+struct FileIo{
+    FileIoBackend backend;
+    unsigned char buffers[FILE_IO_DEPTH][FILE_IO_BUFFER_SIZE];
+    FileIoRequest requests[FILE_IO_DEPTH];
+    int head;           // oldest request
+    int count;
+
+#ifdef HAVE_IO_URING
+    int ringFd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+#endif
+
+    // Thread pool
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t workers[FILE_IO_WORKERS];
+    int stopping;
+};
+
+////////////////////////////////////////////////
+// io_uring
+////////////////////////////////////////////////
+
+#ifdef HAVE_IO_URING
+
+// liburing is not needed for the few calls made here
+
+void uringUnmap(FileIo *io){
+    if(io->sqes != NULL && io->sqes != MAP_FAILED) munmap(io->sqes, io->sqesSize);
+    if(io->cqRing != NULL && io->cqRing != MAP_FAILED && io->cqRing != io->sqRing) munmap(io->cqRing, io->cqRingSize);
+    if(io->sqRing != NULL && io->sqRing != MAP_FAILED) munmap(io->sqRing, io->sqRingSize);
+    close(io->ringFd);
+}
+
+// Returns 0 on success or -1 if the kernel does not let us use io_uring
+int uringSetup(FileIo *io){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    io->ringFd = syscall(__NR_io_uring_setup, FILE_IO_DEPTH, &params);
+    if(io->ringFd < 0) return -1;
+
+    io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(io->cqRingSize > io->sqRingSize) io->sqRingSize = io->cqRingSize;
+    }
+    io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ringFd, IORING_OFF_SQ_RING);
+    io->cqRing = io->sqRing;
+    if(io->sqRing != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)){
+        io->cqRing = mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          io->ringFd, IORING_OFF_CQ_RING);
+    }
+    io->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = MAP_FAILED;
+    if(io->sqRing != MAP_FAILED && io->cqRing != MAP_FAILED){
+        io->sqes = mmap(NULL, io->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        io->ringFd, IORING_OFF_SQES);
+    }
+    if(io->sqes == MAP_FAILED){
+        uringUnmap(io);
+        return -1;
+    }
+
+    unsigned char *sq = io->sqRing;
+    unsigned char *cq = io->cqRing;
+    io->sqHead = (unsigned *) (sq + params.sq_off.head);
+    io->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    io->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    io->sqArray = (unsigned *) (sq + params.sq_off.array);
+    io->cqHead = (unsigned *) (cq + params.cq_off.head);
+    io->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    io->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // the buffers are pinned once, instead of on every request
+    struct iovec iov[FILE_IO_DEPTH];
+    for(int i = 0; i < FILE_IO_DEPTH; i++){
+        iov[i].iov_base = io->buffers[i];
+        iov[i].iov_len = FILE_IO_BUFFER_SIZE;
+    }
+    if(syscall(__NR_io_uring_register, io->ringFd, IORING_REGISTER_BUFFERS, iov, FILE_IO_DEPTH) < 0){
+        uringUnmap(io);
+        return -1;
+    }
+    return 0;
+}
+
+int uringSubmit(FileIo *io, int slot){
+    FileIoRequest *request = &io->requests[slot];
+    unsigned tail = *io->sqTail;
+    unsigned index = tail & *io->sqMask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->fd = request->fd;
+    sqe->addr = (uintptr_t) request->data;
+    sqe->len = request->size;
+    sqe->off = request->offset;
+    sqe->buf_index = slot;
+    sqe->user_data = slot;
+    io->sqArray[index] = index;
+    __atomic_store_n(io->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    int submitted;
+    do{
+        submitted = syscall(__NR_io_uring_enter, io->ringFd, 1, 0, 0, NULL, 0);
+    }while(submitted < 0 && (errno == EINTR || errno == EAGAIN));
+
+    // The kernel only takes the SQE inside io_uring_enter (there is no SQPOLL),
+    // so one it did not take is withdrawn: no late CQE can then complete the
+    // request that reuses this slot. One it took is in flight and gets its CQE.
+    if(submitted < 0 && __atomic_load_n(io->sqHead, __ATOMIC_ACQUIRE) == tail){
+        __atomic_store_n(io->sqTail, tail, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+// Mark the finished requests as done, waiting for one if none is
+void uringReap(FileIo *io, int wait){
+    unsigned head = *io->cqHead;
+    if(wait && head == __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE)){
+        syscall(__NR_io_uring_enter, io->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+    while(head != __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE)){
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cqMask];
+        FileIoRequest *request = &io->requests[cqe->user_data];
+        request->result = cqe->res;
+        request->state = REQUEST_DONE;
+        head++;
+    }
+    __atomic_store_n(io->cqHead, head, __ATOMIC_RELEASE);
+}
+
+#endif
+
+////////////////////////////////////////////////
+// Thread pool
+////////////////////////////////////////////////
+
+void *fileIoWorkerMain(void *arg){
+    FileIo *io = (FileIo *) arg;
+
+    pthread_mutex_lock(&io->lock);
+    while(TRUE){
+        // oldest request no worker took yet
+        FileIoRequest *request = NULL;
+        for(int i = 0; i < io->count && request == NULL; i++){
+            FileIoRequest *next = &io->requests[(io->head + i) % FILE_IO_DEPTH];
+            if(next->state == REQUEST_QUEUED) request = next;
+        }
+        if(request == NULL){
+            if(io->stopping) break;
+            pthread_cond_wait(&io->cond, &io->lock);
+            continue;
+        }
+
+        request->state = REQUEST_RUNNING;
+        pthread_mutex_unlock(&io->lock);
+        ssize_t ret = request->write ? pwrite(request->fd, request->data, request->size, request->offset)
+                                     : pread(request->fd, request->data, request->size, request->offset);
+        pthread_mutex_lock(&io->lock);
+        request->result = ret < 0 ? -errno : ret;
+        request->state = REQUEST_DONE;
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+int poolSetup(FileIo *io){
+    for(int i = 0; i < FILE_IO_WORKERS; i++){
+        if(pthread_create(&io->workers[i], NULL, fileIoWorkerMain, io) == 0) continue;
+
+        pthread_mutex_lock(&io->lock);
+        io->stopping = TRUE;
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+        while(--i >= 0) pthread_join(io->workers[i], NULL);
+        return -1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////
+// Requests
+////////////////////////////////////////////////
+
+FileIo *fileIoCreate(void){
+    FileIo *io = calloc(1, sizeof(FileIo));
+    if(io == NULL){
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+
+#ifdef HAVE_IO_URING
+    io->backend = FILE_IO_URING;
+    if(uringSetup(io) == 0) return io;
+#endif
+    io->backend = FILE_IO_POOL;
+    if(poolSetup(io) == 0) return io;
+
+    printf("Couldn't start the file threads!\n");
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+    free(io);
+    return NULL;
+}
+
+void fileIoDestroy(FileIo *io){
+    unsigned char *data;
+    while(io->count > 0) fileIoCollect(io, &data);
+
+#ifdef HAVE_IO_URING
+    if(io->backend == FILE_IO_URING) uringUnmap(io);
+#endif
+    if(io->backend == FILE_IO_POOL){
+        pthread_mutex_lock(&io->lock);
+        io->stopping = TRUE;
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+        for(int i = 0; i < FILE_IO_WORKERS; i++) pthread_join(io->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+    free(io);
+}
+
+FileIoBackend fileIoBackend(FileIo *io){
+    return io->backend;
+}
+
+int fileIoPending(FileIo *io){
+    return io->count;
+}
+
+unsigned char *fileIoBuffer(FileIo *io){
+    return io->buffers[(io->head + io->count) % FILE_IO_DEPTH];
+}
+
+int fileIoRequest(FileIo *io, int write, int fd, unsigned char *data, int size, uint64_t offset){
+    if(io->count == FILE_IO_DEPTH) return -1;
+
+    int slot = (io->head + io->count) % FILE_IO_DEPTH;
+    FileIoRequest *request = &io->requests[slot];
+    request->write = write;
+    request->fd = fd;
+    request->data = data;
+    request->size = size;
+    request->offset = offset;
+    request->state = REQUEST_QUEUED;
+
+#ifdef HAVE_IO_URING
+    if(io->backend == FILE_IO_URING){
+        request->state = REQUEST_RUNNING;
+        if(uringSubmit(io, slot) == -1){
+            request->result = -errno;
+            request->state = REQUEST_DONE;
+        }
+        io->count++;
+        return 0;
+    }
+#endif
+    pthread_mutex_lock(&io->lock);
+    io->count++;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+    return 0;
+}
+
+int fileIoRead(FileIo *io, int fd, unsigned char *data, int size, uint64_t offset){
+    return fileIoRequest(io, FALSE, fd, data, size, offset);
+}
+
+int fileIoWrite(FileIo *io, int fd, unsigned char *data, int size, uint64_t offset){
+    return fileIoRequest(io, TRUE, fd, data, size, offset);
+}
+
+int fileIoCollect(FileIo *io, unsigned char **data){
+    if(io->count == 0){
+        errno = EINVAL;
+        return -1;
+    }
+    FileIoRequest *request = &io->requests[io->head];
+
+#ifdef HAVE_IO_URING
+    if(io->backend == FILE_IO_URING){
+        while(request->state != REQUEST_DONE) uringReap(io, TRUE);
+    }
+#endif
+    pthread_mutex_lock(&io->lock);
+    while(request->state != REQUEST_DONE) pthread_cond_wait(&io->cond, &io->lock);
+    io->head = (io->head + 1) % FILE_IO_DEPTH;
+    io->count--;
+    pthread_mutex_unlock(&io->lock);
+
+    *data = request->data;
+    // a regular file only takes part of a write when the disk is full
+    if(request->write && request->result >= 0 && request->result != request->size) request->result = -EIO;
+    if(request->result < 0){
+        errno = -request->result;
+        return -1;
+    }
+    return request->result;
+}
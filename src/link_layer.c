@@ -3,29 +3,148 @@
 #include "link_layer.h"
 #include "serial_port.h"
 #include "macros.h"
+#include "crc16.h"
+#include "cobs.h"
+#include "trace.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
-int alarmTimeout = 0;
-int alarmCount = 0;
-int alarmEnabled = FALSE;
-int retransmissions = 0;
-unsigned char frameNr = 0;
+// Information field of a frame with the largest FCS
+#define FRAME_DATA_SIZE (MAX_PAYLOAD_SIZE + 2)
+// Same, once stuffed (or COBS encoded) in the worst case
+#define ENCODED_DATA_SIZE (2 * FRAME_DATA_SIZE)
 
+// I-frames received while llwrite was waiting, until llread returns them.
+// The peer keeps sending while our frame is lost or delayed, so there is room
+// for a few of them before they have to be dropped.
+#define RX_QUEUE_SIZE 8
 
-int nrFrames = 0;
-int nrRetransmissions = 0;
-int nrTimeouts = 0;
+// Asynchronous API: the link runs on a thread of its own between llstart and
+// llstop, llwrite and llread give up when the application interrupts them
+#define LL_INTERRUPTED -2
 
-LinkLayer curLL;
+typedef struct{
+    int id;
+    int size;
+    int close;  // submitted with llsubmitClose
+    unsigned char buf[MAX_PAYLOAD_SIZE];
+} AsyncSend;
+
+// Fast close (FEATURE_FAST_CLOSE)
+typedef enum{
+    CLOSE_NONE,
+    CLOSE_ANSWERED,     // receiver: the last I-frame was acknowledged with our DISC
+    CLOSE_DONE          // the DISC was answered with UA, llclose has nothing to do
+} CloseState;
+
+typedef enum{
+    LINK_IDLE,
+    LINK_WRITING,
+    LINK_READING
+} LinkActivity;
+
+// Everything about one connection, so a process can run several of them
+struct Link{
+    SerialPort port;
+    LinkLayer curLL;
+
+    // Retransmission timer: alarmEnabled is cleared and alarmCount
+    // incremented once the deadline passes
+    int alarmTimeout;
+    int alarmCount;
+    int alarmEnabled;
+    int timerArmed;
+    struct timespec deadline;
+    int retransmissions;
+    unsigned char frameNr;
+
+    int nrFrames;
+    int nrRetransmissions;
+    int nrTimeouts;
+    int nrDuplicates;
+    int nrReconnects;
+    int nrNotReady;
+    uint64_t nrInfoBytes;
+    uint64_t nrStuffedBytes;
+    uint64_t nrCobsBytes;
+
+    // Parameters agreed with the peer in llopen
+    LinkLayerCaps caps;
+    int localFeatures;
+    uint32_t sessionId;
+    int peerExtended;
+    struct timespec probeStart;
+
+    // Flow control
+    int localBusy;              // we answered with RNR, the peer waits for our RR
+    int peerBusy;               // the peer answered with RNR, our next I-frame waits for its RR
+    CloseState closeState;
+
+    // Keepalive, when keepaliveMsec is not 0
+    int keepaliveMsec;          // heartbeat interval agreed with the peer
+    int peerHeard;              // a byte arrived since the last keepalive check
+    struct timespec heardAt;    // when the last byte arrived
+    struct timespec sentUntil;  // when our last frame is all on the wire
+    int unanswered;             // heartbeats sent since the peer was heard
+    int linkDown;
+    struct timespec downSince;
+    int nrLinkDowns;
+
+    // Full-duplex state
+    unsigned char localAddress;
+    unsigned char peerAddress;
+    unsigned char sendSeq;      // N(S) of our next I-frame
+    unsigned char recvSeq;      // N(S) expected from the peer
+    int ackPending;             // a peer I-frame was accepted but not acknowledged yet
+    unsigned char rxQueue[RX_QUEUE_SIZE][MAX_PAYLOAD_SIZE + 1];
+    int rxQueueSize[RX_QUEUE_SIZE];
+    int rxHead;
+    int rxCount;
+
+    // Asynchronous API
+    pthread_mutex_t asyncLock;
+    pthread_cond_t asyncCond;
+    int asyncRunning;
+    int interruptRequested;
+    AsyncSend sendQueue[LL_MAX_PENDING];
+    int sendHead;
+    int sendCount;
+    LlCompletion completions[LL_MAX_COMPLETIONS];
+    int completionHead;
+    int completionCount;
+    pthread_t linkThread;
+    int completionPipe[2];
+    int asyncStopping;
+    int asyncBroken;            // a send failed or was cancelled in flight: the peer is gone
+    LinkActivity activity;
+    int nextSendId;
+    LinkLayerStats asyncStats;  // the counters as of the last completion, for llstats
+
+    // Event trace, NULL unless LinkLayer.traceFile is set
+    TraceEvent *trace;
+    uint32_t traceNext;         // events recorded, the ring keeps the last TRACE_RING_SIZE
+    struct timespec traceStart;
+    int traceRequests;          // dumps asked for with SIGUSR1 and done
+
+    // Live metrics, NULL unless LinkLayer.metricsName is set
+    LinkMetrics *metrics;
+};
 
 typedef enum{
     START,
@@ -35,6 +154,7 @@ typedef enum{
     BCC1_OK,
     READING_DATA,
     ESCAPED_DATA,
+    COBS_DATA,
     STOP
 } LinkLayerState;
 
@@ -45,526 +165,1821 @@ typedef struct{
     unsigned char bcc;
 } Message;
 
-////////////////////////////////////////////////
-// alarmHandler
-////////////////////////////////////////////////
+////////////////////////////////////////////////
+// Timer
+////////////////////////////////////////////////
+
+#ifdef SIMULATION
+// Virtual clock of the simulator (sim/sim.c), which also emulates the port
+void simTime(struct timespec *now);
+#endif
+
+// Monotonic time, virtual in the simulation build
+void getTime(struct timespec *now){
+#ifdef SIMULATION
+    simTime(now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, now);
+#endif
+}
+
+// Identifier of a new session, different for every connection. The
+// simulation takes it from the virtual clock so runs are reproducible.
+uint32_t newSessionId(void){
+#ifdef SIMULATION
+    struct timespec now;
+    getTime(&now);
+    return (uint32_t) now.tv_sec ^ (uint32_t) now.tv_nsec ^ 0x5EED0000;
+#else
+    return (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
+#endif
+}
+
+// Milliseconds since a time taken with getTime
+long elapsedMsec(const struct timespec *since){
+    struct timespec now;
+    getTime(&now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+int timeBefore(const struct timespec *time, const struct timespec *other){
+    return time->tv_sec < other->tv_sec || (time->tv_sec == other->tv_sec && time->tv_nsec < other->tv_nsec);
+}
+
+// Move a time msec milliseconds later
+void addMsec(struct timespec *time, long msec){
+    time->tv_sec += msec / 1000;
+    time->tv_nsec += (msec % 1000) * 1000000;
+    if(time->tv_nsec >= 1000000000){
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000;
+    }
+}
+
+// Each connection keeps its own deadline instead of sharing SIGALRM. The
+// reads wait up to 0.1 s, so the loops check it after every read.
+void setTimerMsec(Link *link, int msec){
+    getTime(&link->deadline);
+    addMsec(&link->deadline, msec);
+    link->timerArmed = msec > 0;
+}
+
+void setTimer(Link *link, int seconds){
+    setTimerMsec(link, seconds * 1000);
+}
+
+////////////////////////////////////////////////
+// Live metrics
+////////////////////////////////////////////////
+
+// The counters and gauges of a connection are published in the shared memory
+// segment named by LinkLayer.metricsName, where llmetrics reads them while
+// the transfer runs. Only the thread using the connection writes them, each
+// field with a relaxed atomic store: nothing waits for the readers.
+
+#define METRIC_SET(metrics, field, value) __atomic_store_n(&(metrics)->field, (value), __ATOMIC_RELAXED)
+#define METRIC_ADD(metrics, field, n) METRIC_SET(metrics, field, (metrics)->field + (n))
+
+// Create the segment if the connection has one. Returns 0 on success or -1 on error
+int metricsOpen(Link *link, const LinkLayer *connectionParameters){
+    if(connectionParameters->metricsName == NULL) return 0;
+    int fd = shm_open(connectionParameters->metricsName, O_RDWR | O_CREAT, 0644);
+    if(fd == -1){
+        perror("Error creating metrics segment");
+        return -1;
+    }
+    void *segment = MAP_FAILED;
+    if(ftruncate(fd, sizeof(LinkMetrics)) == 0){
+        segment = mmap(NULL, sizeof(LinkMetrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(segment == MAP_FAILED){
+        perror("Error mapping metrics segment");
+        shm_unlink(connectionParameters->metricsName);
+        return -1;
+    }
+
+    // a segment left by an earlier connection starts over, the magic last
+    LinkMetrics *metrics = segment;
+    memset(metrics, 0, sizeof(LinkMetrics));
+    metrics->version = METRICS_VERSION;
+    metrics->size = sizeof(LinkMetrics);
+    metrics->pid = getpid();
+    metrics->role = connectionParameters->role;
+    metrics->state = METRICS_CONNECTING;
+    metrics->baudRate = connectionParameters->baudRate;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(metrics->magic, METRICS_MAGIC, sizeof(metrics->magic));
+    link->metrics = metrics;
+    return 0;
+}
+
+// Remove the segment, readers that have it mapped keep the final values
+void metricsClose(Link *link){
+    if(link->metrics == NULL) return;
+    METRIC_SET(link->metrics, state, METRICS_CLOSED);
+    munmap(link->metrics, sizeof(LinkMetrics));
+    shm_unlink(link->curLL.metricsName);
+    link->metrics = NULL;
+}
+
+// Count an event (TRACE_* code) and publish the counters and gauges
+void metricsEvent(Link *link, int event, unsigned char control, int arg){
+    LinkMetrics *metrics = link->metrics;
+    if(metrics == NULL) return;
+
+    switch (event)
+    {
+    case TRACE_CONNECTED:
+        METRIC_SET(metrics, features, arg);
+        METRIC_SET(metrics, state, METRICS_CONNECTED);
+        break;
+    case TRACE_CLOSE:
+        METRIC_SET(metrics, state, METRICS_CLOSING);
+        break;
+    case TRACE_QUEUED:
+        METRIC_SET(metrics, unacked, 1);
+        break;
+    case TRACE_ACKED:
+        METRIC_SET(metrics, unacked, 0);
+        if(arg >= 0) METRIC_ADD(metrics, packetsSent, 1);
+        break;
+    case TRACE_SENT:
+        METRIC_ADD(metrics, framesSent, 1);
+        METRIC_ADD(metrics, bytesSent, arg);
+        break;
+    case TRACE_RECEIVED:
+        METRIC_ADD(metrics, framesReceived, 1);
+        METRIC_ADD(metrics, infoReceived, arg);
+        break;
+    case TRACE_HEADER_ERROR:
+        METRIC_ADD(metrics, headerErrors, 1);
+        break;
+    case TRACE_BCC2_ERROR:
+        METRIC_ADD(metrics, fcsErrors, 1);
+        break;
+    case TRACE_DELIVERED:
+        METRIC_ADD(metrics, packetsDelivered, 1);
+        METRIC_ADD(metrics, bytesDelivered, arg);
+        break;
+    default:
+        break;
+    }
+
+    METRIC_SET(metrics, iFrames, link->nrFrames);
+    METRIC_SET(metrics, retransmissions, link->nrRetransmissions);
+    METRIC_SET(metrics, timeouts, link->nrTimeouts);
+    METRIC_SET(metrics, duplicates, link->nrDuplicates);
+    METRIC_SET(metrics, reconnects, link->nrReconnects);
+    METRIC_SET(metrics, notReady, link->nrNotReady);
+    METRIC_SET(metrics, infoBytes, link->nrInfoBytes);
+    METRIC_SET(metrics, stuffedBytes, link->nrStuffedBytes);
+    METRIC_SET(metrics, cobsBytes, link->nrCobsBytes);
+    METRIC_SET(metrics, linkDowns, link->nrLinkDowns);
+
+    // the queues change under asyncLock on the other thread, a stale value will do
+    int sendQueue = link->asyncRunning ? __atomic_load_n(&link->sendCount, __ATOMIC_RELAXED) : 0;
+    int completionQueue = link->asyncRunning ? __atomic_load_n(&link->completionCount, __ATOMIC_RELAXED) : 0;
+    METRIC_SET(metrics, rtoMsec, link->alarmTimeout * 1000);
+    METRIC_SET(metrics, window, link->caps.window);
+    METRIC_SET(metrics, sendQueue, sendQueue);
+    METRIC_SET(metrics, completionQueue, completionQueue);
+    METRIC_SET(metrics, receiveWindow, LL_MAX_COMPLETIONS - completionQueue);
+    METRIC_SET(metrics, localBusy, link->localBusy);
+    METRIC_SET(metrics, peerBusy, link->peerBusy);
+    METRIC_SET(metrics, linkDown, link->linkDown);
+    METRIC_ADD(metrics, events, 1);
+}
+
+////////////////////////////////////////////////
+// Event trace
+////////////////////////////////////////////////
+
+// Each connection records what it does in a ring of fixed-size events, with
+// nothing but a clock read and a store per event. The ring is written to
+// LinkLayer.traceFile by llclose, or whenever the process gets SIGUSR1.
+
+static volatile sig_atomic_t traceRequests;
+
+void traceSignalHandler(int signal){
+    traceRequests++;
+}
+
+// Record an event, which also updates the live metrics
+void traceEvent(Link *link, int event, unsigned char control, int arg){
+    metricsEvent(link, event, control, arg);
+    if(link->trace == NULL) return;
+    struct timespec now;
+    getTime(&now);
+    TraceEvent *entry = &link->trace[link->traceNext++ % TRACE_RING_SIZE];
+    entry->nsec = (uint64_t) (now.tv_sec - link->traceStart.tv_sec) * 1000000000 + now.tv_nsec - link->traceStart.tv_nsec;
+    entry->event = event;
+    entry->control = control;
+    entry->reserved = 0;
+    entry->arg = arg;
+}
+
+// Start recording if the connection has a trace file.
+// Returns 0 on success or -1 on error
+int traceOpen(Link *link, const LinkLayer *connectionParameters){
+    if(connectionParameters->traceFile == NULL) return 0;
+    link->trace = malloc(TRACE_RING_SIZE * sizeof(TraceEvent));
+    if(link->trace == NULL){
+        perror("malloc");
+        return -1;
+    }
+    getTime(&link->traceStart);
+    link->traceRequests = traceRequests;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = traceSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+    return 0;
+}
+
+// Write the events in the ring, oldest first. Returns 0 on success or -1 on error
+int traceDump(Link *link){
+    if(link->trace == NULL) return 0;
+    FILE *file = fopen(link->curLL.traceFile, "wb");
+    if(file == NULL){
+        perror("Error opening trace file");
+        return -1;
+    }
+
+    uint32_t count = link->traceNext < TRACE_RING_SIZE ? link->traceNext : TRACE_RING_SIZE;
+    uint32_t first = (link->traceNext - count) % TRACE_RING_SIZE;
+    uint32_t tail = first + count <= TRACE_RING_SIZE ? count : TRACE_RING_SIZE - first;
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.eventSize = sizeof(TraceEvent);
+    header.role = link->curLL.role;
+    header.baudRate = link->curLL.baudRate;
+    header.count = count;
+    header.lost = link->traceNext - count;
+    header.startSec = link->traceStart.tv_sec;
+    header.startNsec = link->traceStart.tv_nsec;
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(&link->trace[first], sizeof(TraceEvent), tail, file) == tail &&
+             fwrite(link->trace, sizeof(TraceEvent), count - tail, file) == count - tail;
+    if(fclose(file) != 0) ok = FALSE;
+    if(!ok){
+        perror("Error writing trace file");
+        return -1;
+    }
+    printf("Trace of %u events written to %s\n", count, link->curLL.traceFile);
+    return 0;
+}
+
+void checkTimer(Link *link){
+    if(!link->timerArmed) return;
+    struct timespec now;
+    getTime(&now);
+    if(timeBefore(&now, &link->deadline)) return;
+    link->timerArmed = FALSE;
+    link->alarmEnabled = FALSE;
+    link->alarmCount++;
+    traceEvent(link, TRACE_TIMEOUT, 0, link->alarmCount);
+}
+
+// Wait up to 0.1 s for a byte, then check the retransmission timer and if a
+// trace dump was asked for
+int readByte(Link *link, unsigned char *byte){
+    int ret = readByteSerialPortOf(&link->port, byte);
+    if(ret == 1 && link->keepaliveMsec > 0){
+        link->peerHeard = TRUE;
+        getTime(&link->heardAt);
+    }
+    checkTimer(link);
+    if(link->trace != NULL && link->traceRequests != traceRequests){
+        link->traceRequests = traceRequests;
+        traceDump(link);
+    }
+    return ret;
+}
+
+int interrupted(Link *link){
+    if(!link->asyncRunning) return FALSE;
+    pthread_mutex_lock(&link->asyncLock);
+    int ret = link->interruptRequested;
+    pthread_mutex_unlock(&link->asyncLock);
+    return ret;
+}
+
+////////////////////////////////////////////////
+// sendMessageWrapper
+////////////////////////////////////////////////
+
+// Write a frame made of count pieces with a single system call. The tty may
+// take only part of it (e.g. its buffer is nearly full), the rest is written
+// from where it stopped instead of waiting for a retransmission.
+int sendMessageWrapper(Link *link, struct iovec *iov, int count){
+    if(link->trace != NULL || link->metrics != NULL || link->keepaliveMsec > 0){
+        int size = 0;
+        for(int i = 0; i < count; i++) size += iov[i].iov_len;
+        traceEvent(link, TRACE_SENT, ((const unsigned char *) iov[0].iov_base)[2], size);
+
+        // the peer cannot answer before the frame is through, 10 bits a byte
+        struct timespec now;
+        getTime(&now);
+        if(timeBefore(&link->sentUntil, &now)) link->sentUntil = now;
+        if(link->curLL.baudRate > 0) addMsec(&link->sentUntil, (long) size * 10 * 1000 / link->curLL.baudRate);
+    }
+    while(count > 0){
+        int written = writeVectorSerialPortOf(&link->port, iov, count);
+        if(written == -1){
+            if(errno == EINTR || errno == EAGAIN) continue;
+            perror("Error writing to serial port");
+            return -1;
+        }
+
+        // skip the pieces that were written, then the written part of the next one
+        while(count > 0 && written >= (int) iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (unsigned char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Send a frame with an information field: header (FLAG, A, C, BCC1), the
+// stuffed data and the closing FLAG, without copying them together
+int sendFrame(Link *link, const unsigned char *header, const unsigned char *data, int dataSize){
+    static const unsigned char trailer = FLAG;
+    struct iovec iov[3] = {
+        {(void *) header, FRAME_SIZE - 1},
+        {(void *) data, dataSize},
+        {(void *) &trailer, 1}
+    };
+    return sendMessageWrapper(link, iov, 3);
+}
+
+////////////////////////////////////////////////
+// sendSupervisionMessage
+////////////////////////////////////////////////
+
+// Every supervision frame this side can send, by address (A_RX, A_TX) and control
+#define S_FRAME(a, c) [c] = {FLAG, a, c, BCC1(a, c), FLAG}
+#define S_FRAMES(a) { \
+    S_FRAME(a, C_SET), S_FRAME(a, C_UA), S_FRAME(a, C_DISC), \
+    S_FRAME(a, C_RR0), S_FRAME(a, C_RR1), S_FRAME(a, C_REJ0), S_FRAME(a, C_REJ1), \
+    S_FRAME(a, C_RNR0), S_FRAME(a, C_RNR1), S_FRAME(a, C_POLL) \
+}
+static const unsigned char supervisionFrames[2][256][FRAME_SIZE] = {S_FRAMES(A_RX), S_FRAMES(A_TX)};
+
+int sendSupervisionMessage(Link *link, unsigned char address, unsigned char control){
+    const unsigned char *frame = supervisionFrames[address == A_TX][control];
+    if(frame[0] != FLAG) return -1;
+    struct iovec iov = {(void *) frame, FRAME_SIZE};
+    return sendMessageWrapper(link, &iov, 1);
+}
+
+
+
+////////////////////////////////////////////////
+// stuffData
+////////////////////////////////////////////////
+
+// Copy the data to out followed by its frame check sequence (fcs is FCS_XOR
+// or FCS_CRC16, most significant byte first). Returns the size of both
+int appendFcs(const unsigned char *buf, int bufSize, unsigned char *out, int fcs){
+    memcpy(out, buf, bufSize);
+    if(fcs == FCS_CRC16){
+        uint16_t crc = crc16(buf, bufSize);
+        out[bufSize] = crc >> 8;
+        out[bufSize + 1] = crc & 0xFF;
+        return bufSize + 2;
+    }
+    unsigned char bcc2 = 0;
+    for(int i = 0; i < bufSize; i++){
+        bcc2 ^= buf[i];
+    }
+    out[bufSize] = bcc2;
+    return bufSize + 1;
+}
+
+// Escape FLAG and ESC bytes. If out is NULL, only computes the stuffed size
+int stuffBytes(const unsigned char *buf, int bufSize, unsigned char *out){
+    int bytesInserted = 0;
+    for(int i = 0; i < bufSize; i++){
+        // Data that needs to be escaped
+        if(buf[i] == FLAG || buf[i] == ESC){
+            if(out != NULL){
+                out[bytesInserted] = ESC;
+                out[bytesInserted + 1] = buf[i] ^ 0x20;
+            }
+            bytesInserted += 2;
+        }else{
+            if(out != NULL) out[bytesInserted] = buf[i];
+            bytesInserted++;
+        }
+    }
+    return bytesInserted;
+}
+
+// Stuff the data followed by its frame check sequence (fcs is FCS_XOR or
+// FCS_CRC16) into stuffedBuf, which holds ENCODED_DATA_SIZE bytes
+int stuffData(const unsigned char *buf, int bufSize, unsigned char *stuffedBuf, int fcs){
+    unsigned char data[FRAME_DATA_SIZE];
+    int dataSize = appendFcs(buf, bufSize, data, fcs);
+    return stuffBytes(data, dataSize, stuffedBuf);
+}
+
+// Encode the information field of an I-frame with the agreed FCS and framing
+// into encodedBuf, which holds ENCODED_DATA_SIZE bytes.
+// Also counts what it takes on the wire with either framing.
+int encodeInformation(Link *link, const unsigned char *buf, int bufSize, unsigned char *encodedBuf){
+    unsigned char data[FRAME_DATA_SIZE];
+    int dataSize = appendFcs(buf, bufSize, data, link->caps.fcs);
+    int cobs = (link->caps.features & FEATURE_COBS) != 0;
+
+    int stuffedSize = stuffBytes(data, dataSize, cobs ? NULL : encodedBuf);
+    int cobsSize = cobsEncode(data, dataSize, cobs ? encodedBuf : NULL);
+
+    link->nrInfoBytes += dataSize;
+    link->nrStuffedBytes += stuffedSize;
+    link->nrCobsBytes += cobsSize;
+
+    return cobs ? cobsSize : stuffedSize;
+}
+
+////////////////////////////////////////////////
+// Frame parser
+////////////////////////////////////////////////
+
+typedef enum{
+    FRAME_NONE,         // frame not complete yet
+    FRAME_SUPERVISION,  // frame without information field
+    FRAME_INFORMATION,  // frame with a valid information field
+    FRAME_BAD_DATA      // frame with a valid header but a wrong BCC2
+} FrameType;
+
+typedef struct{
+    LinkLayerState state;
+    unsigned char address;
+    unsigned char control;
+    unsigned char bcc2;
+    uint16_t crc;
+    int size;           // information bytes read, FCS included
+    int cobsLeft;       // bytes left in the current COBS block
+    int cobsFlag;       // the current COBS block is followed by a FLAG
+} FrameParser;
+
+int isInformationControl(unsigned char control){
+    return IS_C_I(control) || IS_C_IP(control);
+}
+
+// Add a byte to the information field. Returns FALSE if the frame is too long
+int addDataByte(FrameParser *parser, unsigned char byte, unsigned char *data){
+    if(parser->size >= FRAME_DATA_SIZE){
+        parser->state = START;
+        return FALSE;
+    }
+    data[parser->size++] = byte;
+    parser->bcc2 ^= byte;
+    parser->crc = crc16Update(parser->crc, byte);
+    return TRUE;
+}
+
+// Check the FCS of the information field
+FrameType checkFcs(Link *link, FrameParser *parser){
+    // BCC2 was xor'd with the data, so a valid frame gives 0, and so
+    // does the CRC of the data followed by its CRC
+    if(isInformationControl(parser->control) && link->caps.fcs == FCS_CRC16){
+        if(parser->size < 2) return FRAME_BAD_DATA;
+        parser->size -= 2;
+        return parser->crc == 0 ? FRAME_INFORMATION : FRAME_BAD_DATA;
+    }
+    if(parser->size < 1) return FRAME_BAD_DATA;
+    parser->size--;
+    return parser->bcc2 == 0 ? FRAME_INFORMATION : FRAME_BAD_DATA;
+}
+
+// Check the information field once the closing flag arrives
+FrameType checkFrame(Link *link, FrameParser *parser){
+    FrameType type = checkFcs(link, parser);
+    traceEvent(link, type == FRAME_INFORMATION ? TRACE_RECEIVED : TRACE_BCC2_ERROR, parser->control, parser->size);
+    return type;
+}
+
+// Feed one byte to the parser, data must hold FRAME_DATA_SIZE bytes.
+// I-frames are checked with the agreed FCS and decoded with the agreed
+// framing, other frames are byte stuffed and checked with BCC2.
+// Frames from both addresses are accepted, the caller checks the control.
+FrameType parseFrameByte(Link *link, FrameParser *parser, unsigned char byte, unsigned char *data){
+    switch (parser->state)
+    {
+    case START:
+        if(byte == FLAG) parser->state = FLAG_RCV;
+        break;
+    case FLAG_RCV:
+        if(byte == A_TX || byte == A_RX){
+            parser->address = byte;
+            parser->state = A_RCV;
+        }
+        else if(byte != FLAG) parser->state = START;
+        break;
+    case A_RCV:
+        if(byte == FLAG){parser->state = FLAG_RCV; break;}
+        parser->control = byte;
+        parser->state = C_RCV;
+        break;
+    case C_RCV:
+        if(byte == FLAG){parser->state = FLAG_RCV; break;}
+        if(byte != BCC1(parser->address, parser->control)){
+            traceEvent(link, TRACE_HEADER_ERROR, parser->control, 0);
+            parser->state = START;
+            break;
+        }
+        parser->size = 0;
+        parser->bcc2 = 0;
+        parser->crc = CRC16_INIT;
+        parser->state = BCC1_OK;
+        break;
+    case BCC1_OK:
+        // the closing flag may also open the next frame
+        if(byte == FLAG){
+            traceEvent(link, TRACE_RECEIVED, parser->control, 0);
+            parser->state = FLAG_RCV;
+            return FRAME_SUPERVISION;
+        }
+        if(isInformationControl(parser->control) && (link->caps.features & FEATURE_COBS)){
+            parser->cobsLeft = 0;
+            parser->cobsFlag = FALSE;
+            parser->state = COBS_DATA;
+        }
+        else parser->state = READING_DATA;
+        return parseFrameByte(link, parser, byte, data);
+    case READING_DATA:
+        if(byte == ESC){parser->state = ESCAPED_DATA; break;}
+        if(byte == FLAG){
+            parser->state = FLAG_RCV;
+            return checkFrame(link, parser);
+        }
+        addDataByte(parser, byte, data);
+        break;
+    case ESCAPED_DATA:
+        if(addDataByte(parser, byte ^ 0x20, data)) parser->state = READING_DATA;
+        break;
+    case COBS_DATA:
+        if(byte == FLAG){
+            parser->state = FLAG_RCV;
+            // a block cut short lost some bytes
+            if(parser->cobsLeft > 0){
+                traceEvent(link, TRACE_BCC2_ERROR, parser->control, parser->size);
+                return FRAME_BAD_DATA;
+            }
+            return checkFrame(link, parser);
+        }
+        if(parser->cobsLeft > 0){
+            parser->cobsLeft--;
+            addDataByte(parser, byte, data);
+            break;
+        }
+        // code byte of the next block, the previous one may end with a FLAG
+        if(parser->cobsFlag && !addDataByte(parser, FLAG, data)) break;
+        parser->cobsLeft = (byte ^ FLAG) - 1;
+        parser->cobsFlag = parser->cobsLeft < COBS_MAX_RUN;
+        break;
+    default:
+        parser->state = START;
+        break;
+    }
+    return FRAME_NONE;
+}
+
+////////////////////////////////////////////////
+// Handshake parameters
+////////////////////////////////////////////////
+
+// SET and UA carry the session identifier, the sequence number their sender
+// expects to receive next and its capabilities. Both ends settle on the best
+// set they have in common. A legacy peer sends 5-byte SET / UA frames and
+// gets the legacy frame format.
+//
+// When llwrite runs out of retransmissions it probes the peer with SET
+// frames, backing off, and both sides continue the same session from where
+// the peer says it is. A legacy peer can only be sent the pending frame again.
+
+#define RECONNECT_TIME 120      // Seconds of reconnect probing before giving up
+#define PROBE_MAX_INTERVAL 8    // Maximum seconds between reconnect probes
+#define KEEPALIVE_MIN_INTERVAL 100 // Milliseconds, the reads wait up to 0.1 s
+
+// What this side supports
+#define LOCAL_WINDOW 1          // Stop and wait
+#define LOCAL_FCS (FCS_XOR | FCS_CRC16)
+
+typedef struct{
+    int hasSession;
+    uint32_t session;
+    int hasNextSeq;
+    unsigned char nextSeq;
+    int maxPayload;
+    int window;
+    int fcs;            // FCS_* types supported
+    int features;
+    int keepalive;      // Heartbeat interval asked for, 0 for none
+} HandshakeParams;
+
+typedef enum{
+    TIMER_STARTED,
+    TIMER_RETRANSMIT,   // send the frame again
+    TIMER_PROBE,        // too many retransmissions: probe the peer
+    TIMER_EXPIRED       // the peer did not come back
+} TimerEvent;
+
+void parseHandshakeParams(FrameType type, const unsigned char *data, int size, HandshakeParams *params){
+    // what a legacy peer supports
+    memset(params, 0, sizeof(HandshakeParams));
+    params->maxPayload = MAX_PAYLOAD_SIZE;
+    params->window = 1;
+    params->fcs = FCS_XOR;
+    if(type != FRAME_INFORMATION) return;
+
+    int i = 0;
+    while(i + 2 <= size && i + 2 + data[i + 1] <= size){
+        const unsigned char *value = &data[i + 2];
+        if(data[i] == PARAM_SESSION && data[i + 1] == 4){
+            params->session = (uint32_t) value[0] << 24 | value[1] << 16 | value[2] << 8 | value[3];
+            params->hasSession = TRUE;
+        }
+        else if(data[i] == PARAM_NEXT_SEQ && data[i + 1] == 1){
+            params->nextSeq = value[0] & 0x1;
+            params->hasNextSeq = TRUE;
+        }
+        else if(data[i] == PARAM_MAX_PAYLOAD && data[i + 1] == 2){
+            params->maxPayload = value[0] << 8 | value[1];
+        }
+        else if(data[i] == PARAM_WINDOW && data[i + 1] == 1){
+            params->window = value[0];
+        }
+        else if(data[i] == PARAM_FCS && data[i + 1] == 1){
+            // XOR is always available
+            params->fcs = value[0] | FCS_XOR;
+        }
+        else if(data[i] == PARAM_FEATURES && data[i + 1] == 1){
+            params->features = value[0];
+        }
+        else if(data[i] == PARAM_KEEPALIVE && data[i + 1] == 2){
+            params->keepalive = value[0] << 8 | value[1];
+        }
+        i += 2 + data[i + 1];
+    }
+}
+
+// Send a SET / UA frame, with the parameters unless the peer is legacy
+int sendHandshakeFrame(Link *link, unsigned char address, unsigned char control, int withParams){
+    if(!withParams) return sendSupervisionMessage(link, address, control);
+
+    unsigned char params[26];
+    int size = 0;
+    params[size++] = PARAM_SESSION;
+    params[size++] = 4;
+    for(int i = 3; i >= 0; i--){
+        params[size++] = (link->sessionId >> (8 * i)) & 0xFF;
+    }
+    // only a side that receives I-frames has a sequence to tell
+    if(link->curLL.duplex || link->curLL.role == LlRx){
+        params[size++] = PARAM_NEXT_SEQ;
+        params[size++] = 1;
+        params[size++] = link->curLL.duplex ? link->recvSeq : link->frameNr;
+    }
+    params[size++] = PARAM_MAX_PAYLOAD;
+    params[size++] = 2;
+    params[size++] = MAX_PAYLOAD_SIZE >> 8;
+    params[size++] = MAX_PAYLOAD_SIZE & 0xFF;
+    params[size++] = PARAM_WINDOW;
+    params[size++] = 1;
+    params[size++] = LOCAL_WINDOW;
+    params[size++] = PARAM_FCS;
+    params[size++] = 1;
+    params[size++] = LOCAL_FCS;
+    params[size++] = PARAM_FEATURES;
+    params[size++] = 1;
+    params[size++] = link->localFeatures;
+    if(link->curLL.keepalive > 0){
+        int keepalive = link->curLL.keepalive < 0xFFFF ? link->curLL.keepalive : 0xFFFF;
+        params[size++] = PARAM_KEEPALIVE;
+        params[size++] = 2;
+        params[size++] = keepalive >> 8;
+        params[size++] = keepalive & 0xFF;
+    }
+
+    unsigned char stuffedBuf[ENCODED_DATA_SIZE];
+    int stuffedSize = stuffData(params, size, stuffedBuf, FCS_XOR);
+    unsigned char header[FRAME_SIZE - 1] = {FLAG, address, control, BCC1(address, control)};
+    return sendFrame(link, header, stuffedBuf, stuffedSize);
+}
+
+// Settle on the best parameters both ends support
+void negotiate(Link *link, const HandshakeParams *params){
+    link->caps.maxPayload = params->maxPayload < MAX_PAYLOAD_SIZE ? params->maxPayload : MAX_PAYLOAD_SIZE;
+    link->caps.window = params->window < LOCAL_WINDOW ? params->window : LOCAL_WINDOW;
+    if(link->caps.window < 1) link->caps.window = 1;
+    link->caps.fcs = (params->fcs & LOCAL_FCS & FCS_CRC16) ? FCS_CRC16 : FCS_XOR;
+    link->caps.features = params->features & link->localFeatures;
+    link->curLL.duplex = (link->caps.features & FEATURE_DUPLEX) != 0;
+    link->caps.legacy = !link->peerExtended;
+
+    // the shorter interval asked for by either end, the full-duplex mode has
+    // no keepalive
+    int keepalive = params->keepalive;
+    if(link->curLL.keepalive > 0 && (keepalive == 0 || link->curLL.keepalive < keepalive)) keepalive = link->curLL.keepalive;
+    if(keepalive > 0 && keepalive < KEEPALIVE_MIN_INTERVAL) keepalive = KEEPALIVE_MIN_INTERVAL;
+    if(!(link->caps.features & FEATURE_KEEPALIVE) || link->curLL.duplex) keepalive = 0;
+    link->keepaliveMsec = keepalive;
+    // the peer was just heard
+    link->peerHeard = FALSE;
+    link->unanswered = 0;
+    link->linkDown = FALSE;
+    getTime(&link->heardAt);
+}
+
+void resetDuplex(Link *link){
+    link->sendSeq = 0;
+    link->recvSeq = 0;
+    link->ackPending = FALSE;
+    link->rxHead = 0;
+    link->rxCount = 0;
+}
+
+// Answer a SET. Returns TRUE if it resumes the current session, otherwise
+// the peer started a new one and the sequence numbers start over.
+int acceptSet(Link *link, FrameType type, const unsigned char *data, int size, HandshakeParams *params){
+    parseHandshakeParams(type, data, size, params);
+    int resumed = params->hasSession && link->peerExtended && params->session == link->sessionId;
+
+    if(!resumed){
+        link->sessionId = params->session;
+        link->peerExtended = params->hasSession;
+        link->frameNr = 0;
+        link->closeState = CLOSE_NONE;
+        resetDuplex(link);
+        negotiate(link, params);
+    }
+    sendHandshakeFrame(link, A_TX, C_UA, link->peerExtended);
+    return resumed;
+}
+
+// In an extended session a legacy SET is one of the probes the transmitter
+// alternates with while our UA does not get through, as in handshake: the
+// extended SET that follows resumes the session, so it is ignored
+int ignoredSet(Link *link, FrameType type){
+    return type == FRAME_SUPERVISION && link->peerExtended;
+}
+
+// The peer answered a reconnect probe with UA.
+// Returns the sequence number it expects next, or -1 if it did not tell.
+int resumeSession(Link *link, FrameType type, const unsigned char *data, int size){
+    HandshakeParams params;
+    parseHandshakeParams(type, data, size, &params);
+    if(params.hasSession && params.session == link->sessionId && params.hasNextSeq) return params.nextSeq;
+    return -1;
+}
+
+int probing(Link *link){
+    return link->alarmCount > link->retransmissions;
+}
+
+// The peer answered while llwrite was probing
+void reconnected(Link *link){
+    if(!probing(link)) return;
+    link->nrReconnects++;
+    link->alarmCount = 0;
+    printf("Reconnected\n");
+}
+
+// Arm the retransmission timer of llwrite: retransmissions every alarmTimeout
+// seconds, then reconnect probes 1, 2, 4... PROBE_MAX_INTERVAL seconds apart
+TimerEvent armTimer(Link *link){
+    link->alarmEnabled = TRUE;
+    if(!probing(link)){
+        setTimer(link, link->alarmTimeout);
+        return link->alarmCount == 0 ? TIMER_STARTED : TIMER_RETRANSMIT;
+    }
+
+    int probe = link->alarmCount - link->retransmissions - 1;
+    struct timespec now;
+    getTime(&now);
+    if(probe == 0){
+        printf("Connection lost, trying to reconnect...\n");
+        link->probeStart = now;
+    }
+    else if(now.tv_sec - link->probeStart.tv_sec >= RECONNECT_TIME){
+        return TIMER_EXPIRED;
+    }
+
+    int interval = PROBE_MAX_INTERVAL;
+    if(probe < 8 && (1 << probe) < PROBE_MAX_INTERVAL) interval = 1 << probe;
+    setTimer(link, interval);
+    return TIMER_PROBE;
+}
+
+////////////////////////////////////////////////
+// Keepalive
+////////////////////////////////////////////////
+
+// With FEATURE_KEEPALIVE and an interval asked for by either end, the
+// transmitter sends a POLL whenever the line has been quiet for an interval
+// while it waits for the receiver, even between packets with the
+// asynchronous API. The receiver answers it with RR or RNR as any POLL.
+// The transmitter finds the link down once KEEPALIVE_MISSES polls in a row
+// went unanswered, and probes the receiver right away instead of waiting for
+// its retransmissions to run out. The receiver only listens: the link is
+// down once nothing came for one interval more, and llread gives up once
+// the transmitter would have stopped probing.
+
+#define KEEPALIVE_MISSES 3      // Heartbeats lost in a row before the link is down
+
+// Milliseconds since the peer was heard or could last answer us
+long quietMsec(Link *link){
+    long heard = elapsedMsec(&link->heardAt);
+    long sent = elapsedMsec(&link->sentUntil);
+    return heard < sent ? heard : sent;
+}
+
+// Check the link while waiting for the peer, after every read. The
+// transmitter (poll set) also sends the heartbeats.
+// Returns TRUE while the link is down
+int keepalive(Link *link, int poll){
+    if(link->keepaliveMsec == 0) return FALSE;
+
+    if(link->peerHeard){
+        link->peerHeard = FALSE;
+        link->unanswered = 0;
+        if(link->linkDown){
+            long down = elapsedMsec(&link->downSince);
+            link->linkDown = FALSE;
+            printf("Link up after %.1f s\n", down / 1000.0);
+            traceEvent(link, TRACE_LINK_UP, 0, down);
+        }
+    }
+
+    long quiet = quietMsec(link);
+    int silent = poll ? quiet >= link->keepaliveMsec && link->unanswered >= KEEPALIVE_MISSES
+                      : quiet >= (KEEPALIVE_MISSES + 1) * link->keepaliveMsec;
+    if(silent && !link->linkDown){
+        long heard = elapsedMsec(&link->heardAt);
+        link->linkDown = TRUE;
+        link->nrLinkDowns++;
+        getTime(&link->downSince);
+        printf("Link down, the peer was last heard %.1f s ago\n", heard / 1000.0);
+        traceEvent(link, TRACE_LINK_DOWN, 0, heard);
+    }
+    if(poll && quiet >= link->keepaliveMsec){
+        link->unanswered++;
+        sendSupervisionMessage(link, A_TX, C_POLL);
+    }
+    return link->linkDown;
+}
+
+////////////////////////////////////////////////
+// Full-duplex mode
+////////////////////////////////////////////////
+
+// Both ends send I-frames. Each I-frame carries the sequence number expected
+// from the peer (N(R)), so the acknowledgement rides on reverse data and a
+// standalone RR is only sent when there is nothing to piggyback it on.
+
+typedef enum{
+    DUPLEX_NONE,
+    DUPLEX_ACKED,       // our outstanding I-frame was acknowledged
+    DUPLEX_REJECTED     // our outstanding I-frame must be sent again
+} DuplexEvent;
+
+// Send (or resend) our I-frame with the current acknowledgement number
+int duplexSendFrame(Link *link, const unsigned char *stuffedBuf, int stuffedSize){
+    unsigned char control = C_IP(link->sendSeq, link->recvSeq);
+    unsigned char header[FRAME_SIZE - 1] = {FLAG, link->localAddress, control, BCC1(link->localAddress, control)};
+    link->ackPending = FALSE;
+    return sendFrame(link, header, stuffedBuf, stuffedSize);
+}
+
+int duplexSendAck(Link *link, unsigned char control){
+    link->ackPending = FALSE;
+    return sendSupervisionMessage(link, link->localAddress, control);
+}
+
+// Handle a frame received from the peer. waitingAck tells if we have an
+// I-frame waiting for its acknowledgement.
+DuplexEvent duplexHandleFrame(Link *link, FrameType type, FrameParser *parser, unsigned char *data, int waitingAck){
+    unsigned char control = parser->control;
+
+    if(!IS_C_IP(control)){
+        if(type == FRAME_BAD_DATA) return DUPLEX_NONE;
+
+        if(control == C_SET && link->curLL.role == LlRx){
+            if(ignoredSet(link, type)) return DUPLEX_NONE;
+            // the peer is reconnecting: our frame was delivered if it expects the next one
+            HandshakeParams params;
+            int resumed = acceptSet(link, type, data, parser->size, &params);
+            if(!waitingAck) return DUPLEX_NONE;
+            if(resumed && params.hasNextSeq && params.nextSeq == (link->sendSeq ^ 0x1)) return DUPLEX_ACKED;
+            return DUPLEX_REJECTED;
+        }
+        if(control == C_UA && waitingAck && probing(link)){
+            int nextSeq = resumeSession(link, type, data, parser->size);
+            return nextSeq == (link->sendSeq ^ 0x1) ? DUPLEX_ACKED : DUPLEX_REJECTED;
+        }
+        if(type != FRAME_SUPERVISION || !waitingAck) return DUPLEX_NONE;
+        if(control == C_RR0 + (link->sendSeq ^ 0x1)) return DUPLEX_ACKED;
+        if(control == C_REJ0 + link->sendSeq) return DUPLEX_REJECTED;
+        return DUPLEX_NONE;
+    }
+    if(type == FRAME_SUPERVISION) return DUPLEX_NONE;
+
+    // the header was valid, so the piggybacked acknowledgement can be used
+    int acked = waitingAck && C_IP_NR(control) == (link->sendSeq ^ 0x1);
+    unsigned char ns = C_IP_NS(control);
+
+    if(type == FRAME_BAD_DATA){
+        if(ns == link->recvSeq) duplexSendAck(link, C_REJ0 + link->recvSeq);
+    }
+    else if(ns != link->recvSeq){
+        // duplicate of the last accepted frame (our acknowledgement was lost)
+        link->nrDuplicates++;
+        duplexSendAck(link, C_RR0 + link->recvSeq);
+    }
+    else if(link->rxCount < RX_QUEUE_SIZE){
+        int tail = (link->rxHead + link->rxCount) % RX_QUEUE_SIZE;
+        memcpy(link->rxQueue[tail], data, parser->size);
+        link->rxQueueSize[tail] = parser->size;
+        link->rxCount++;
+        link->recvSeq ^= 0x1;
+        link->ackPending = TRUE;
+        // our I-frame is already on the wire with an older N(R), and the
+        // next one can only go out after it is acknowledged
+        if(waitingAck && !acked) duplexSendAck(link, C_RR0 + link->recvSeq);
+    }
+    // else the queue is full: drop the frame unacknowledged
+
+    return acked ? DUPLEX_ACKED : DUPLEX_NONE;
+}
+
+int duplexWrite(Link *link, const unsigned char *buf, int bufSize){
+    unsigned char stuffedBuf[ENCODED_DATA_SIZE];
+    int stuffedSize = encodeInformation(link, buf, bufSize, stuffedBuf);
+
+    link->alarmEnabled = FALSE;
+    link->alarmCount = 0;
+
+    FrameParser parser = {START};
+    unsigned char data[FRAME_DATA_SIZE];
+    int result = -1;
+
+    link->nrFrames++;
+    duplexSendFrame(link, stuffedBuf, stuffedSize);
+    while(result == -1){
+        if(interrupted(link)) break;
+        if(link->alarmEnabled == FALSE){
+            TimerEvent event = armTimer(link);
+            if(event == TIMER_EXPIRED) break;
+            if(event == TIMER_RETRANSMIT) link->nrTimeouts++;
+            // only the side that connected can probe with SET, the other
+            // one probes by sending its frame again
+            if(event == TIMER_PROBE && link->curLL.role == LlTx) sendHandshakeFrame(link, A_TX, C_SET, link->peerExtended);
+            else if(event != TIMER_STARTED) duplexSendFrame(link, stuffedBuf, stuffedSize);
+        }
+
+        unsigned char byteRCV;
+        int ret = readByte(link, &byteRCV);
+        if(ret != 1) continue;
+
+        FrameType type = parseFrameByte(link, &parser, byteRCV, data);
+        if(type == FRAME_NONE) continue;
+
+        DuplexEvent event = duplexHandleFrame(link, type, &parser, data, TRUE);
+        if(event != DUPLEX_NONE) reconnected(link);
+
+        switch (event)
+        {
+        case DUPLEX_ACKED:
+            link->sendSeq ^= 0x1;
+            result = bufSize;
+            break;
+        case DUPLEX_REJECTED:
+            duplexSendFrame(link, stuffedBuf, stuffedSize);
+            link->nrRetransmissions++;
+            link->alarmEnabled = FALSE;
+            link->alarmCount = 0;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if(result == -1 && !interrupted(link)) printf("Max retransmissions reached!\n");
+    if(result == -1) link->timerArmed = FALSE;
+    return result;
+}
+
+int duplexRead(Link *link, unsigned char *packet){
+    // nothing left to piggyback the acknowledgement on
+    if(link->rxCount == 0 && link->ackPending) duplexSendAck(link, C_RR0 + link->recvSeq);
+
+    FrameParser parser = {START};
+    unsigned char data[FRAME_DATA_SIZE];
+
+    while(link->rxCount == 0){
+        unsigned char byteRCV;
+        int ret = readByte(link, &byteRCV);
+        // only stop between frames, a frame cut in two would be lost
+        if(ret != 1){
+            if(parser.state <= FLAG_RCV && interrupted(link)) return LL_INTERRUPTED;
+            continue;
+        }
+
+        FrameType type = parseFrameByte(link, &parser, byteRCV, data);
+        if(type == FRAME_NONE) continue;
+        duplexHandleFrame(link, type, &parser, data, FALSE);
+        if(link->rxCount == 0 && interrupted(link)) return LL_INTERRUPTED;
+    }
+
+    int size = link->rxQueueSize[link->rxHead];
+    memcpy(packet, link->rxQueue[link->rxHead], size);
+    link->rxHead = (link->rxHead + 1) % RX_QUEUE_SIZE;
+    link->rxCount--;
+    return size;
+}
+
+////////////////////////////////////////////////
+// LLOPEN
+////////////////////////////////////////////////
+
+// The transmitter does not wait a whole timeout for the receiver to show up:
+// it sends SETs CONNECT_MIN_INTERVAL plus the round trip of a SET and its UA
+// apart, doubling up to CONNECT_MAX_INTERVAL (or the timeout, if shorter).
+// A receiver started late is found within an interval, and one that is
+// there answers the first SET it gets right.
+#define CONNECT_MIN_INTERVAL 100    // Milliseconds
+#define CONNECT_MAX_INTERVAL 1000   // Milliseconds
+#define HANDSHAKE_FRAME_SIZE 36     // Bytes of a SET / UA with parameters, stuffed
+
+// First interval between SETs, in milliseconds
+int connectInterval(Link *link){
+    int roundTrip = 2 * HANDSHAKE_FRAME_SIZE * 10 * 1000 / (link->curLL.baudRate > 0 ? link->curLL.baudRate : 9600);
+    return CONNECT_MIN_INTERVAL + roundTrip;
+}
+
+// Connect to the peer over the open port. Returns 0 on success or -1 on error
+int handshake(Link *link, LinkLayer connectionParameters)
+{
+    link->alarmTimeout = connectionParameters.timeout;
+    link->retransmissions = connectionParameters.nRetransmissions;
+
+    FrameParser parser = {START};
+    unsigned char data[FRAME_DATA_SIZE];
+    link->curLL = connectionParameters;
+
+    // the side that connects uses the transmitter address for its frames
+    link->localAddress = connectionParameters.role == LlTx ? A_TX : A_RX;
+    link->peerAddress = connectionParameters.role == LlTx ? A_RX : A_TX;
+    link->frameNr = 0;
+    resetDuplex(link);
+
+    // legacy parameters until the handshake tells otherwise
+    HandshakeParams params;
+    link->localFeatures = connectionParameters.duplex ? FEATURE_DUPLEX : 0;
+    // the transmitter picks the framing, a receiver decodes both
+    if(connectionParameters.cobs || connectionParameters.role == LlRx) link->localFeatures |= FEATURE_COBS;
+    link->localFeatures |= FEATURE_RNR | FEATURE_FAST_CLOSE | FEATURE_KEEPALIVE;
+    parseHandshakeParams(FRAME_SUPERVISION, NULL, 0, &params);
+    negotiate(link, &params);
+
+    // Handle logic for transmitter side
+    if(connectionParameters.role == LlTx){
+        // every connection starts a new session
+        link->sessionId = newSessionId();
+        sendHandshakeFrame(link, A_TX, C_SET, TRUE);
+        link->nrFrames++;
+
+        // probe with SETs that back off from about a round trip, for as long
+        // as the retransmissions of a frame would take
+        struct timespec start;
+        getTime(&start);
+        long patience = (long) (link->retransmissions + 1) * link->alarmTimeout * 1000;
+        int interval = connectInterval(link);
+        int maxInterval = link->alarmTimeout * 1000 < CONNECT_MAX_INTERVAL ? link->alarmTimeout * 1000 : CONNECT_MAX_INTERVAL;
+        if(maxInterval < interval) maxInterval = interval;
+
+        while(TRUE){
+            if(link->alarmEnabled == FALSE){
+                long elapsed = elapsedMsec(&start);
+                if(elapsed >= patience) return -1;
+                if(link->alarmCount > 0){
+                    // a legacy receiver ignores the SETs with parameters, so every
+                    // other one is a legacy SET once an extended receiver had the
+                    // time to answer (and waits for the extended one that
+                    // follows before answering a legacy SET)
+                    int legacy = elapsed >= link->alarmTimeout * 1000 && link->alarmCount % 2 == 1;
+                    sendHandshakeFrame(link, A_TX, C_SET, !legacy);
+                    link->nrTimeouts++;
+                    interval = 2 * interval < maxInterval ? 2 * interval : maxInterval;
+                }
+                setTimerMsec(link, interval);
+                link->alarmEnabled = TRUE;
+            }
+
+            // wait (0.1s according to serial_port.c) for response
+            unsigned char byteRCV;
+            int ret = readByte(link, &byteRCV);
+            if(ret != 1) continue;
+
+            FrameType type = parseFrameByte(link, &parser, byteRCV, data);
+            if((type == FRAME_SUPERVISION || type == FRAME_INFORMATION) && parser.control == C_UA){
+                // a legacy receiver answers without the parameters
+                parseHandshakeParams(type, data, parser.size, &params);
+                link->peerExtended = params.hasSession && params.session == link->sessionId;
+                if(!link->peerExtended) parseHandshakeParams(FRAME_SUPERVISION, NULL, 0, &params);
+                negotiate(link, &params);
+                return 0;
+            }
+        }
+    }
+    // Handle logic for receiving side
+    else{
+        // a receiver started late may get one of the legacy SETs first: its
+        // answer waits for the next SET, so an extended transmitter is never
+        // held to the legacy format
+        int legacySet = FALSE;
+        struct timespec legacyAt;
+        long legacyWait = CONNECT_MAX_INTERVAL + connectInterval(link);
+
+        // state machine for each byte
+        while(TRUE){
+            if(legacySet && elapsedMsec(&legacyAt) >= legacyWait){
+                // transmitin UA
+                link->peerExtended = FALSE;
+                acceptSet(link, FRAME_SUPERVISION, NULL, 0, &params);
+                link->nrFrames++;
+                return 0;
+            }
+
+            unsigned char byteRCV;
+            int ret = readByte(link, &byteRCV);
+            if(ret != 1) continue;
+
+            FrameType type = parseFrameByte(link, &parser, byteRCV, data);
+            if(type == FRAME_SUPERVISION && parser.control == C_SET){
+                if(!legacySet) getTime(&legacyAt);
+                legacySet = TRUE;
+            }
+            else if(type == FRAME_INFORMATION && parser.control == C_SET){
+                // transmitin UA
+                link->peerExtended = FALSE;
+                acceptSet(link, type, data, parser.size, &params);
+                link->nrFrames++;
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+void freeLink(Link *link){
+    free(link->trace);
+    metricsClose(link);
+    pthread_mutex_destroy(&link->asyncLock);
+    pthread_cond_destroy(&link->asyncCond);
+    free(link);
+}
+
+Link *llopenLink(LinkLayer connectionParameters)
+{
+    Link *link = calloc(1, sizeof(Link));
+    if(link == NULL){
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_init(&link->asyncLock, NULL);
+    pthread_cond_init(&link->asyncCond, NULL);
+    link->completionPipe[0] = link->completionPipe[1] = -1;
+    link->nextSendId = 1;
+
+    link->curLL = connectionParameters;
+    if (traceOpen(link, &connectionParameters) == -1 || metricsOpen(link, &connectionParameters) == -1 ||
+        openSerialPortOf(&link->port, connectionParameters.serialPort,
+                         connectionParameters.baudRate) < 0)
+    {
+        freeLink(link);
+        return NULL;
+    }
+    traceEvent(link, TRACE_OPEN, 0, 0);
+    if(handshake(link, connectionParameters) == -1){
+        traceDump(link);
+        closeSerialPortOf(&link->port);
+        freeLink(link);
+        return NULL;
+    }
+    traceEvent(link, TRACE_CONNECTED, 0, link->caps.features);
+    return link;
+}
+
+////////////////////////////////////////////////
+// Flow control
+////////////////////////////////////////////////
+
+// A receiver that runs out of room acknowledges the frame that took its last
+// slot with RNR instead of RR. The transmitter holds its next I-frame and
+// polls every timeout instead of retransmitting it, until an RR (sent as soon
+// as there is room again, or in answer to a poll) lets it go on.
+
+// Packets the receiver can still take: the link thread keeps them as
+// completions until the application collects them, without it llread hands
+// each one over as it arrives
+int receiveWindow(Link *link){
+    if(!link->asyncRunning) return LL_MAX_COMPLETIONS;
+    pthread_mutex_lock(&link->asyncLock);
+    int window = LL_MAX_COMPLETIONS - link->completionCount;
+    pthread_mutex_unlock(&link->asyncLock);
+    return window;
+}
+
+// RR or RNR for the frame the receiver expects next
+unsigned char readyControl(Link *link){
+    return (link->localBusy ? C_RNR0 : C_RR0) + link->frameNr;
+}
+
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+
+// Send a packet, the last one with C_I_CLOSE if close is set and the peer
+// supports the fast close
+int writePacket(Link *link, const unsigned char *buf, int bufSize, int close)
+{   
+    if(buf == NULL || bufSize > link->caps.maxPayload){
+        perror("Couldn't send frame!\n");
+        return -1;
+    }
+
+    traceEvent(link, TRACE_QUEUED, 0, bufSize);
+    if(link->curLL.duplex){
+        int ret = duplexWrite(link, buf, bufSize);
+        traceEvent(link, TRACE_ACKED, 0, ret);
+        return ret;
+    }
+
+    unsigned char stuffedBuf[ENCODED_DATA_SIZE];
+    int stuffedSize = encodeInformation(link, buf, bufSize, stuffedBuf);
+
+    // Information frame is ready for shipment, sent in place from the header,
+    // the stuffed data and the closing flag
+    close = close && (link->caps.features & FEATURE_FAST_CLOSE);
+    unsigned char control = link->frameNr << 7 | (close ? C_I_CLOSE : 0);
+    unsigned char header[FRAME_SIZE - 1] = {FLAG, A_TX, control, BCC1(A_TX, control)};
+
+    // Initialize alarm
+    link->alarmEnabled = FALSE;
+    link->alarmCount = 0;
+    
+    FrameParser parser = {START};
+    unsigned char data[FRAME_DATA_SIZE];
+    int result = -1;
+    
+    // send first message, unless the receiver told us to wait for its RR
+    link->nrFrames++;
+    int sent = !link->peerBusy;
+    if(sent) sendFrame(link, header, stuffedBuf, stuffedSize);
+    while(result == -1){
+        if(interrupted(link)) break;
+
+        // enable alarm and send
+        if(link->alarmEnabled == FALSE){
+            TimerEvent event = armTimer(link);
+            if(event == TIMER_EXPIRED) break;
+            // ask a busy receiver if it has room, otherwise send the message again
+            if(event == TIMER_RETRANSMIT && link->peerBusy) sendSupervisionMessage(link, A_TX, C_POLL);
+            else if(event == TIMER_RETRANSMIT){
+                link->nrTimeouts++;
+                sendFrame(link, header, stuffedBuf, stuffedSize);
+            }
+            else if(event == TIMER_PROBE) sendHandshakeFrame(link, A_TX, C_SET, link->peerExtended);
+        }
+
+        // llwrite should receive either a RR / RNR(frameNr ^ 0x1) or REJ(frameNr),
+        // RR / RNR(frameNr) while the receiver is busy, the UA answering a
+        // reconnect probe, or the DISC acknowledging the last frame
+        unsigned char byteRCV;
+        int ret = readByte(link, &byteRCV);
+        // the heartbeats go on while probing, so the receiver is back as soon
+        // as it answers one
+        if(keepalive(link, TRUE) && !probing(link)){
+            // the receiver stopped answering the heartbeats: probe it now
+            link->alarmCount = link->retransmissions + 1;
+            link->alarmEnabled = FALSE;
+            continue;
+        }
+        if(ret != 1) continue;
+
+        FrameType type = parseFrameByte(link, &parser, byteRCV, data);
+        if(close && type == FRAME_SUPERVISION && parser.control == C_DISC){
+            reconnected(link);
+            sendSupervisionMessage(link, A_RX, C_UA);
+            link->closeState = CLOSE_DONE;
+            link->peerBusy = FALSE;
+            result = bufSize;
+            break;
+        }
+        if(type == FRAME_SUPERVISION && (parser.control == (C_RR0 + (link->frameNr ^ 0x1)) ||
+                                         parser.control == (C_RNR0 + (link->frameNr ^ 0x1)))){
+            // frame accepted, after an RNR the next one waits for an RR
+            reconnected(link);
+            link->peerBusy = parser.control != C_RR0 + (link->frameNr ^ 0x1);
+            if(link->peerBusy) link->nrNotReady++;
+            result = bufSize;
+            break;
+        }
+        if(type == FRAME_SUPERVISION && parser.control == (C_RNR0 + link->frameNr)){
+            // the receiver is there but has no room, a frame we sent was dropped:
+            // keep polling without giving up on it
+            reconnected(link);
+            if(!link->peerBusy) link->nrNotReady++;
+            link->peerBusy = TRUE;
+            link->alarmCount = 0;
+            continue;
+        }
+
+        // RR(frameNr) answers a poll: the receiver has room, or is back and
+        // did not get the frame
+        int resend = type == FRAME_SUPERVISION && (parser.control == (C_REJ0 + link->frameNr) ||
+                                                   ((link->peerBusy || probing(link)) && parser.control == (C_RR0 + link->frameNr)));
+        if((type == FRAME_SUPERVISION || type == FRAME_INFORMATION) && parser.control == C_UA && probing(link)){
+            // the frame was delivered if the receiver expects the next one
+            reconnected(link);
+            if(resumeSession(link, type, data, parser.size) == (link->frameNr ^ 0x1)){
+                link->peerBusy = FALSE;
+                result = bufSize;
+                break;
+            }
+            resend = TRUE;
+        }
+        if(resend){
+            reconnected(link);
+            sendFrame(link, header, stuffedBuf, stuffedSize);
+            if(sent) link->nrRetransmissions++;
+            sent = TRUE;
+            link->peerBusy = FALSE;
+            link->alarmEnabled = FALSE;
+            link->alarmCount = 0;
+        }
+    }
+
+    traceEvent(link, TRACE_ACKED, 0, result);
+    if(result == -1){
+        if(!interrupted(link)) printf("Max retransmissions reached!\n");
+        link->timerArmed = FALSE;
+        return -1;
+    }
+    link->frameNr ^= 0x1;
+    return result;
+}
+
+int llwriteLink(Link *link, const unsigned char *buf, int bufSize)
+{
+    return writePacket(link, buf, bufSize, FALSE);
+}
+
+int llwriteCloseLink(Link *link, const unsigned char *buf, int bufSize)
+{
+    return writePacket(link, buf, bufSize, TRUE);
+}
+
+
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+int llreadLink(Link *link, unsigned char *packet)
+{
+    if(link->curLL.duplex){
+        int ret = duplexRead(link, packet);
+        if(ret >= 0) traceEvent(link, TRACE_DELIVERED, 0, ret);
+        return ret;
+    }
+
+    FrameParser parser = {START};
+    unsigned char data[FRAME_DATA_SIZE];
+
+    // receives a packet, or a SET frame if the transmitter reconnects
+    while(TRUE){
+        // room again: let the transmitter go on
+        if(link->localBusy && receiveWindow(link) > 0){
+            link->localBusy = FALSE;
+            sendSupervisionMessage(link, A_TX, C_RR0 + link->frameNr);
+        }
+
+        unsigned char byteRCV;
+        // receive bytes
+        int ret = readByte(link, &byteRCV);
+        // after the last I-frame the transmitter is gone on purpose
+        if(link->closeState == CLOSE_NONE && keepalive(link, FALSE) &&
+           elapsedMsec(&link->downSince) >= (RECONNECT_TIME + PROBE_MAX_INTERVAL) * 1000L){
+            // the transmitter would have stopped probing by now
+            printf("The transmitter is gone\n");
+            return -1;
+        }
+        if(ret != 1){
+            if(parser.state <= FLAG_RCV && interrupted(link)) return LL_INTERRUPTED;
+            continue;
+        }
 
-void alarmHandler(int signal){
-    alarmEnabled = FALSE;
-    alarmCount++;
-}
+        FrameType type = parseFrameByte(link, &parser, byteRCV, data);
+        if(type == FRAME_NONE) continue;
 
-////////////////////////////////////////////////
-// sendMessageWrapper
-////////////////////////////////////////////////
+        if(type != FRAME_BAD_DATA && parser.control == C_SET){
+            if(ignoredSet(link, type)) continue;
+            // a new session: the transmitter restarted, so does the transfer
+            HandshakeParams params;
+            if(!acceptSet(link, type, data, parser.size, &params)) return -1;
+            continue;
+        }
+        if(type == FRAME_SUPERVISION && parser.control == C_POLL){
+            sendSupervisionMessage(link, A_TX, readyControl(link));
+            continue;
+        }
+        if(type == FRAME_SUPERVISION && parser.control == C_UA && link->closeState == CLOSE_ANSWERED){
+            // the transmitter is gone, llclose has nothing left to do
+            link->closeState = CLOSE_DONE;
+            continue;
+        }
+        if(type == FRAME_SUPERVISION || !IS_C_I(parser.control)) continue;
 
-int sendMessageWrapper(unsigned char* message, int messageSize){
-    
-    int ret = writeBytesSerialPort(message , messageSize);
-    if(ret != messageSize){
-        // handle different written != size
-        return -1;
+        unsigned char sequence = parser.control >> 7;
+        int close = (parser.control & C_I_CLOSE) != 0;
+        if(type == FRAME_INFORMATION && sequence == link->frameNr && !link->localBusy){
+            // acknowledge frame, with RNR if it takes the last slot, or with
+            // our DISC if it is the last one
+            link->frameNr = link->frameNr ^ 0x1;
+            if(close){
+                link->closeState = CLOSE_ANSWERED;
+                sendSupervisionMessage(link, A_RX, C_DISC);
+            }
+            else{
+                if((link->caps.features & FEATURE_RNR) && receiveWindow(link) == 1){
+                    link->localBusy = TRUE;
+                    link->nrNotReady++;
+                }
+                sendSupervisionMessage(link, A_TX, readyControl(link));
+            }
+            memcpy(packet, data, parser.size);
+            traceEvent(link, TRACE_DELIVERED, 0, parser.size);
+            return parser.size;
+        }
+        else if(type == FRAME_INFORMATION && sequence == link->frameNr){
+            // no room for it: the transmitter sends it again after our RR
+            sendSupervisionMessage(link, A_TX, readyControl(link));
+        }
+        else if(type == FRAME_INFORMATION){
+            // duplicate of the last accepted frame (its RR or DISC was lost):
+            // discard it and acknowledge again the frame we expect
+            link->nrDuplicates++;
+            if(close && link->closeState == CLOSE_ANSWERED) sendSupervisionMessage(link, A_RX, C_DISC);
+            else sendSupervisionMessage(link, A_TX, readyControl(link));
+        }
+        else{
+            // reject frame
+            sendSupervisionMessage(link, A_TX, C_REJ0 + sequence);
+        }
     }
     return 0;
 }
+
 ////////////////////////////////////////////////
-// sendSupervisionMessage
+// LLPENDING
 ////////////////////////////////////////////////
-
-int sendSupervisionMessage(unsigned char address, unsigned char control){
-    unsigned char s_frame[5];
-    s_frame[0] = FLAG;
-    s_frame[1] = address;
-    s_frame[2] = control;  
-    s_frame[3] = BCC1(s_frame[1], s_frame[2]);
-    s_frame[4] = FLAG;
-    return sendMessageWrapper(s_frame, 5);
+int llpendingLink(Link *link)
+{
+    return link->curLL.duplex && link->rxCount > 0;
 }
 
-
-
 ////////////////////////////////////////////////
-// stuffData
+// LLCAPS
 ////////////////////////////////////////////////
+void llcapsLink(Link *link, LinkLayerCaps *agreed)
+{
+    *agreed = link->caps;
+}
 
-int stuffData(const unsigned char *buf, int bufSize, unsigned char** stuffedBuf){
-    unsigned char bcc2 = 0;
-
-    // allocate memory for worst case scenario
-    unsigned char* stuffedBuffer = (unsigned char*) malloc(sizeof(unsigned char) * bufSize * 2);
-    if(!stuffedBuffer){
-        printf("Error allocating space for stuffed buffer!\n");
-        return -1;
-    }
+////////////////////////////////////////////////
+// LLSTATS
+////////////////////////////////////////////////
+// Copy the counters, on the thread that updates them
+void fillStats(Link *link, LinkLayerStats *stats){
+    stats->frames = link->nrFrames;
+    stats->retransmissions = link->nrRetransmissions;
+    stats->timeouts = link->nrTimeouts;
+    stats->duplicates = link->nrDuplicates;
+    stats->reconnects = link->nrReconnects;
+    stats->notReady = link->nrNotReady;
+    stats->rto = link->alarmTimeout;
+    stats->infoBytes = link->nrInfoBytes;
+    stats->stuffedBytes = link->nrStuffedBytes;
+    stats->cobsBytes = link->nrCobsBytes;
+    stats->linkDowns = link->nrLinkDowns;
+    stats->down = link->linkDown;
+}
 
-    // Get bcc2 from singular bytes from payload and generate stuffedPayload
-    int bytesInserted = 0;
-    for(int i = 0; i < bufSize; i++){
-        bcc2 ^= buf[i];
-        // Data that needs to be escaped
-        if(buf[i] == FLAG || buf[i] == ESC){
-            stuffedBuffer[bytesInserted++] = ESC;
-            stuffedBuffer[bytesInserted++] = buf[i] ^ 0x20;
-        }else{
-            stuffedBuffer[bytesInserted++] = buf[i];
-        }
-    }
-    
-    // insert bcc2 in stuffedBuf
-    if(bcc2 == FLAG || bcc2 == ESC){
-        // stuff bcc2
-        stuffedBuffer[bytesInserted++] = ESC;
-        stuffedBuffer[bytesInserted++] = bcc2 ^ 0x20;
-    }else{
-        stuffedBuffer[bytesInserted++] = bcc2;
-    }
-
-    // deallocate not used bytes
-    unsigned char* temp = (unsigned char*) realloc(stuffedBuffer, sizeof(unsigned char) * bytesInserted);
-    if(!temp){
-        free(temp);
-        free(stuffedBuf);
-        printf("Couldn't reallocate memory!\n");
-        return -1;
+void llstatsLink(Link *link, LinkLayerStats *stats)
+{
+    // the link thread owns the counters while it runs, the application gets
+    // the copy it took with the last completion
+    if(link->asyncRunning){
+        pthread_mutex_lock(&link->asyncLock);
+        *stats = link->asyncStats;
+        pthread_mutex_unlock(&link->asyncLock);
+        return;
     }
-    *stuffedBuf = temp;
-    return bytesInserted;
+    fillStats(link, stats);
 }
 
 ////////////////////////////////////////////////
-// LLOPEN
+// Asynchronous API
 ////////////////////////////////////////////////
 
-int llopen(LinkLayer connectionParameters)
-{
-    if (openSerialPort(connectionParameters.serialPort,
-                       connectionParameters.baudRate) < 0)
-    {
-        return -1;
-    }
+// The link thread sends the submitted packets one at a time and, when it can
+// receive, reads packets in between. Each finished operation is queued as a
+// completion and a byte is written to a pipe, so the read end of the pipe is
+// readable while there are completions.
 
-    // assign alarHandler
-    (void) signal(SIGALRM, alarmHandler);
+// Queue a completion, waiting for room (asyncLock held)
+LlCompletion *postCompletion(Link *link, LlCompletionType type, int id, int size){
+    while(link->completionCount == LL_MAX_COMPLETIONS) pthread_cond_wait(&link->asyncCond, &link->asyncLock);
 
-    alarmTimeout = connectionParameters.timeout;
-    retransmissions = connectionParameters.nRetransmissions;
+    LlCompletion *completion = &link->completions[(link->completionHead + link->completionCount) % LL_MAX_COMPLETIONS];
+    link->completionCount++;
+    completion->type = type;
+    completion->id = id;
+    completion->size = size;
+    fillStats(link, &link->asyncStats);
+    unsigned char byte = 0;
+    if(write(link->completionPipe[1], &byte, 1) != 1) perror("Error signaling completion");
+    return completion;
+}
 
-    LinkLayerState llState = START;
-    Message message;
-    curLL = connectionParameters;
-    // Handle logic for transmitter side
+// An idle transmitter keeps sending the heartbeats until a packet is
+// submitted or the link is stopped. It only listens to the answers, and to
+// the RR of a receiver that was out of room.
+void idleKeepalive(Link *link){
+    FrameParser parser = {START};
+    unsigned char data[FRAME_DATA_SIZE];
+    while(!interrupted(link)){
+        unsigned char byteRCV;
+        int ret = readByte(link, &byteRCV);
+        keepalive(link, TRUE);
+        if(ret != 1) continue;
 
+        FrameType type = parseFrameByte(link, &parser, byteRCV, data);
+        if(type == FRAME_SUPERVISION && link->peerBusy && parser.control == C_RR0 + link->frameNr) link->peerBusy = FALSE;
+    }
+}
 
-    if(connectionParameters.role == LlTx){
-        sendSupervisionMessage(A_TX, C_SET);
-        nrFrames++;
-        
-        // retransmission logic (send 3 messages)
-        while(alarmCount <= retransmissions && llState != STOP){
-            if(alarmEnabled == FALSE){
-                alarm(alarmTimeout);
-                if(alarmCount > 0) {
-                    sendSupervisionMessage(A_TX, C_SET);
-                    nrTimeouts++;
-                }
-                alarmEnabled = TRUE;
-            }
+void *linkThreadMain(void *arg){
+    Link *link = (Link *) arg;
+    int canSend = link->curLL.duplex || link->curLL.role == LlTx;
+    int canReceive = link->curLL.duplex || link->curLL.role == LlRx;
+    unsigned char packet[MAX_PAYLOAD_SIZE + 1];
 
-            // wait (0.1s according to serial_port.c) for response
-            unsigned char byteRCV;
-            int ret = readByteSerialPort(&byteRCV);
-            if(ret != 1) continue;
+    pthread_mutex_lock(&link->asyncLock);
+    while(TRUE){
+        link->interruptRequested = FALSE;
 
-            switch(llState){
-                // START state that should receive a valid flag (FLAG)
-                case START:
-                    if(byteRCV == FLAG){
-                        llState = FLAG_RCV;
-                        message.flag = FLAG;
-                    }
-                    break;
-                // FLAG_RCV state that should receive a valid Address (0x03)
-                case FLAG_RCV:
-                    if(byteRCV == FLAG){break;}
-                    else if(byteRCV == 0x03){
-                        llState = A_RCV;
-                        message.address = 0x03;
-                    }
-                    else{
-                        llState = START;
-                    }
-                    break;
-                // A_RCV state that should receive a valid Control (0x07)
-                case A_RCV:
-                    if(byteRCV == FLAG){llState = FLAG_RCV;break;}
-                    else if(byteRCV == 0x07){
-                        llState = C_RCV;
-                        message.control = 0x07;
-                        break;
-                        }
-                    else{llState = START;}
-                    break;
-                // C_RCV state that should receive a valid BCC (A ^ C)
-                case C_RCV:
-                    if(byteRCV == FLAG){llState = FLAG_RCV;break;}
-                    else if(byteRCV == (message.control ^ message.address)){llState = BCC1_OK;break;}
-                    else{llState = START;}
-                    break;
-                // BCC_OK state that should receive a valid flag (FLAG)
-                case BCC1_OK:
-                    if(byteRCV == FLAG){llState = STOP;break;}
-                    else{llState = START;}
-                    break;
-                default:
-                    break;
+        if(canSend && link->sendCount > 0 && !llpendingLink(link)){
+            AsyncSend *send = &link->sendQueue[link->sendHead];
+            int ret = -1;
+            if(!link->asyncBroken){
+                link->activity = LINK_WRITING;
+                pthread_mutex_unlock(&link->asyncLock);
+                ret = writePacket(link, send->buf, send->size, send->close);
+                pthread_mutex_lock(&link->asyncLock);
+                link->activity = LINK_IDLE;
             }
+            if(ret == -1) link->asyncBroken = TRUE;
+
+            LlCompletionType type = ret != -1 ? LL_SENT : link->interruptRequested ? LL_CANCELLED : LL_FAILED;
+            postCompletion(link, type, send->id, ret);
+            link->sendHead = (link->sendHead + 1) % LL_MAX_PENDING;
+            link->sendCount--;
+            pthread_cond_broadcast(&link->asyncCond);
+            continue;
         }
-        if(llState == STOP){
-            // returns data link identifier ????
-            return 0;
-        }
-        return -1;
-    }
-    // Handle logic for receiving side
-    else{
-        // state machine for each byte
-        while(llState != STOP){
-            unsigned char byteRCV;
-            int ret = readByteSerialPort(&byteRCV);
-            if(ret != 1) continue;
+        if(link->asyncStopping) break;
 
-            switch(llState){
-                // START state that should receive a valid flag (FLAG)
-                case START:
-                    if(byteRCV == FLAG){
-                        llState = FLAG_RCV;
-                        message.flag = FLAG;
-                    }
-                    break;
-                // FLAG_RCV state that should receive a valid Address (0x03)
-                case FLAG_RCV:
-                    if(byteRCV == FLAG){break;}
-                    else if(byteRCV == 0x03){
-                        llState = A_RCV;
-                        message.address = 0x03;
-                    }
-                    else{
-                        llState = START;
-                    }
-                    break;
-                // A_RCV state that should receive a valid Control (0x03)
-                case A_RCV:
-                    if(byteRCV == FLAG){llState = FLAG_RCV;break;}
-                    else if(byteRCV == 0x03){
-                        llState = C_RCV;
-                        message.control = 0x03;
-                        break;
-                        }
-                    else{llState = START;}
-                    break;
-                // C_RCV state that should receive a valid BCC (A ^ C)
-                case C_RCV:
-                    if(byteRCV == FLAG){llState = FLAG_RCV;break;}
-                    else if(byteRCV == (message.control ^ message.address)){llState = BCC1_OK;break;}
-                    else{llState = START;}
-                    break;
-                // BCC_OK state that should receive a valid flag (FLAG)
-                case BCC1_OK:
-                    if(byteRCV == FLAG){llState = STOP;break;}
-                    else{llState = START;}
-                    break;
-                default:
-                    break;
+        // a receiver that sent RNR keeps answering polls until there is room
+        if(canReceive && (link->completionCount < LL_MAX_COMPLETIONS || link->localBusy)){
+            link->activity = LINK_READING;
+            pthread_mutex_unlock(&link->asyncLock);
+            int ret = llreadLink(link, packet);
+            pthread_mutex_lock(&link->asyncLock);
+            link->activity = LINK_IDLE;
+            if(ret == LL_INTERRUPTED) continue;
+            if(ret == -1 && link->linkDown){
+                // the keepalive gave up on the transmitter
+                postCompletion(link, LL_FAILED, 0, -1);
+                canReceive = FALSE;
+                continue;
             }
+
+            LlCompletion *completion = postCompletion(link, LL_RECEIVED, 0, ret);
+            if(ret > 0) memcpy(completion->packet, packet, ret);
+            continue;
         }
-        // transmitin UA
-        int ret = sendSupervisionMessage(A_TX, C_UA);
-        nrFrames++;
-        return ret;
+        if(canSend && !canReceive && link->keepaliveMsec > 0 && !link->asyncBroken && link->closeState == CLOSE_NONE){
+            link->activity = LINK_READING;
+            pthread_mutex_unlock(&link->asyncLock);
+            idleKeepalive(link);
+            pthread_mutex_lock(&link->asyncLock);
+            link->activity = LINK_IDLE;
+            continue;
+        }
+        pthread_cond_wait(&link->asyncCond, &link->asyncLock);
     }
-    return 0;
+    pthread_mutex_unlock(&link->asyncLock);
+    return NULL;
 }
 
 ////////////////////////////////////////////////
-// LLWRITE
+// LLSTART
 ////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize)
-{   
-    if(buf == NULL || bufSize > MAX_PAYLOAD_SIZE){
-        perror("Couldn't send frame!\n");
+int llstartLink(Link *link)
+{
+    if(link->asyncRunning) return link->completionPipe[0];
+    if(pipe(link->completionPipe) == -1){
+        perror("pipe");
         return -1;
     }
+    fcntl(link->completionPipe[0], F_SETFL, O_NONBLOCK);
 
-    (void) signal(SIGALRM, alarmHandler);
+    link->sendHead = link->sendCount = 0;
+    link->completionHead = link->completionCount = 0;
+    link->asyncStopping = FALSE;
+    link->asyncBroken = FALSE;
+    link->interruptRequested = FALSE;
+    link->activity = LINK_IDLE;
+    fillStats(link, &link->asyncStats);
 
-    unsigned char* stuffedBuf;
-    int stuffedSize = stuffData(buf, bufSize, &stuffedBuf);
-    
-    if(stuffedSize == -1){
-        printf("Couldn't allocate memory for stuffed data!\n");
+    link->asyncRunning = TRUE;
+    if(pthread_create(&link->linkThread, NULL, linkThreadMain, link) != 0){
+        printf("Couldn't start the link thread!\n");
+        link->asyncRunning = FALSE;
+        close(link->completionPipe[0]);
+        close(link->completionPipe[1]);
         return -1;
     }
+    return link->completionPipe[0];
+}
 
-    // Information frame is ready for shipment
-    int messageSize = FRAME_SIZE + stuffedSize;
-    unsigned char* message = (unsigned char*) malloc(messageSize);
-    message[0] = FLAG;
-    message[1] = A_TX;
-    message[2] = (frameNr << 7);
-    message[3] = BCC1(message[1], message[2]);
-    memcpy(&message[4], stuffedBuf, stuffedSize);
-    message[messageSize - 1] = FLAG;
+////////////////////////////////////////////////
+// LLSUBMIT
+////////////////////////////////////////////////
 
-    // Initialize alarm
-    alarmEnabled = FALSE;
-    alarmCount = 0;
-    
-    LinkLayerState llState = START;
-    Message received;
-    
-    // send first message
-    nrFrames++;
-    sendMessageWrapper(message, messageSize);
-    while(alarmCount <= retransmissions){
-        
-        // enable alarm and send
-        if(alarmEnabled == FALSE){
-            alarm(alarmTimeout);
-            // logic to send message again
-            if(alarmCount > 0){
-                nrTimeouts++;
-                sendMessageWrapper(message, messageSize);
-            } 
-            alarmEnabled = TRUE;
-        }
+// Queue a packet for the link thread, sent with writePacket
+int submitPacket(Link *link, const unsigned char *buf, int bufSize, int close)
+{
+    if(buf == NULL || bufSize > link->caps.maxPayload) return -1;
 
-        // llwrite should receive either a RR(frameNr ^ 0x1) or REJ(frameNr) 
-        unsigned char byteRCV;
-        int ret = readByteSerialPort(&byteRCV);
-        if(ret != 1 && llState != STOP) continue;
+    pthread_mutex_lock(&link->asyncLock);
+    if(!link->asyncRunning || link->asyncStopping || link->sendCount == LL_MAX_PENDING){
+        pthread_mutex_unlock(&link->asyncLock);
+        return -1;
+    }
+    AsyncSend *send = &link->sendQueue[(link->sendHead + link->sendCount) % LL_MAX_PENDING];
+    link->sendCount++;
+    send->id = link->nextSendId++;
+    send->size = bufSize;
+    send->close = close;
+    memcpy(send->buf, buf, bufSize);
 
-        switch (llState)
-        {
-        case START:
-            memset(&received, 0, sizeof(Message));
-            // Got flag
-            if(byteRCV == FLAG){
-                llState = FLAG_RCV;
-                received.flag = FLAG;
-            }
-            break;
-        // FLAG_RCV state that should receive a valid address : 0x03
-        case FLAG_RCV:
-            if(byteRCV == FLAG){break;}
-            else if(byteRCV == A_TX){
-                llState = A_RCV;
-                received.address = A_TX;
-            }else{
-                llState = START;
-            }
-            break;
-        // A_RCV state that should receive a valid control byte : (RR0) -> 0xAA (RR1) -> 0xAB (REJ0) -> 0x54 (REJ1) -> 0x55
-        case A_RCV:
-            if(byteRCV == FLAG){llState = FLAG_RCV; break;}
-            // received response
-            else if(byteRCV == (C_RR0 + (frameNr ^ 0x1)) || byteRCV == (C_REJ0 + frameNr)){
-                // frame was accepted or rejected
-                llState = C_RCV;
-                received.control = byteRCV;
-                break;
-            }
-            else{llState = START;}
-            break;
-        // C_RCV state that should receive a valid BCC
-        case C_RCV:
-            if(byteRCV == FLAG){llState = FLAG_RCV; break;}
-            else if(byteRCV == BCC1(received.control, received.address)){
-                llState = BCC1_OK;
-                break;
-            }else{
-                llState = START;
-            }
-            break;
-        case BCC1_OK:
-            if(byteRCV == FLAG){
-                // check if frame was rejected
-                if(received.control == (C_REJ0 + frameNr)){
-                    llState = START;
-                    sendMessageWrapper(message, messageSize);
-                    nrRetransmissions++;
-                    alarmEnabled = FALSE;
-                    alarmCount = 0;
-                    break;
-                }
-                llState = STOP;
-                break;
-            }
-            else{llState = START;}
-            break;
-        case STOP:
-            frameNr ^= 0x1;
-            return bufSize;
-        default:
+    // a full-duplex link waiting for the peer's packets sends first
+    if(link->activity == LINK_READING) link->interruptRequested = TRUE;
+    pthread_cond_broadcast(&link->asyncCond);
+    pthread_mutex_unlock(&link->asyncLock);
+    return send->id;
+}
+
+int llsubmitLink(Link *link, const unsigned char *buf, int bufSize)
+{
+    return submitPacket(link, buf, bufSize, FALSE);
+}
+
+int llsubmitCloseLink(Link *link, const unsigned char *buf, int bufSize)
+{
+    return submitPacket(link, buf, bufSize, TRUE);
+}
+
+////////////////////////////////////////////////
+// LLCANCEL
+////////////////////////////////////////////////
+int llcancelLink(Link *link, int id)
+{
+    pthread_mutex_lock(&link->asyncLock);
+    int ret = -1;
+    for(int i = 0; i < link->sendCount; i++){
+        int index = (link->sendHead + i) % LL_MAX_PENDING;
+        if(link->sendQueue[index].id != id) continue;
+
+        ret = 0;
+        if(i == 0 && link->activity == LINK_WRITING){
+            // llwrite gives up, the thread posts the completion
+            link->interruptRequested = TRUE;
             break;
         }
+        postCompletion(link, LL_CANCELLED, id, -1);
+        for(int j = i; j < link->sendCount - 1; j++){
+            link->sendQueue[(link->sendHead + j) % LL_MAX_PENDING] = link->sendQueue[(link->sendHead + j + 1) % LL_MAX_PENDING];
+        }
+        link->sendCount--;
+        break;
     }
-    printf("Max retransmissions reached!\n");
-    return -1;
+    pthread_mutex_unlock(&link->asyncLock);
+    return ret;
 }
 
-
 ////////////////////////////////////////////////
-// LLREAD
+// LLCOMPLETE
 ////////////////////////////////////////////////
-int llread(unsigned char *packet)
+int llcompleteLink(Link *link, LlCompletion *completion)
 {
-    LinkLayerState llState = START;
-    Message message;
-    int bytesReceived = 0;
-    unsigned char bcc2_input = 0x0;
+    pthread_mutex_lock(&link->asyncLock);
+    if(link->completionCount == 0){
+        pthread_mutex_unlock(&link->asyncLock);
+        return FALSE;
+    }
+    *completion = link->completions[link->completionHead];
+    link->completionHead = (link->completionHead + 1) % LL_MAX_COMPLETIONS;
+    link->completionCount--;
+    unsigned char byte;
+    if(read(link->completionPipe[0], &byte, 1) != 1) perror("Error reading completion");
+    pthread_cond_broadcast(&link->asyncCond);
+    pthread_mutex_unlock(&link->asyncLock);
+    return TRUE;
+}
 
-    // receives a packet, that could be a SET frame(return to llopen) or a I frame containing data
-    while(TRUE){
-        unsigned char byteRCV;
-        // receive bytes
-        int ret = readByteSerialPort(&byteRCV);
-        if(ret != 1 && llState != STOP) continue;
+////////////////////////////////////////////////
+// LLSTOP
+////////////////////////////////////////////////
+int llstopLink(Link *link)
+{
+    if(!link->asyncRunning) return -1;
 
-        switch (llState)
-        {
-        // this should receive a valid flag
-        case START:
-            if(byteRCV == FLAG){
-                bytesReceived = 0;
-                memset(&message, 0, sizeof(Message));
-                llState = FLAG_RCV;
-                message.flag = FLAG;
-            } 
-            break;
-        // this should receive a valid address 0x03 (from transmitter)
-        case FLAG_RCV:
-            bytesReceived = 0;
-            if(byteRCV == FLAG) break;
-            else if(byteRCV == A_TX){
-                llState = A_RCV;
-                message.address = byteRCV;
-                break;
-            }
-            llState = START;
-            break;
-        // this should receive a valid control (0x03 if it is a set frame, 0 or 0x80 for a info frame)
-        case A_RCV:
-            // received a set frame (llopen did not go through)
-            if(byteRCV == C_SET){
-                llState = C_RCV;
-                message.control = C_SET;
-                break;
-            }
-            // received data
-            else if(byteRCV == 0 || byteRCV == 0x80){
-                llState = C_RCV;
-                message.control = byteRCV;
-                break;
-            }
-            else if(byteRCV == FLAG){llState = FLAG_RCV; break;}
-            llState = START;
-            break;
-        // this should receive a valid BCC1 
-        // if it receives a valid BCC1 then proceeds to read data
-        case C_RCV: 
-            if(byteRCV == BCC1(message.control, message.address)){
-                if(message.control == C_SET){llState = BCC1_OK; break;}
-                bcc2_input = 0;
-                llState = READING_DATA;
-                break;
-            }
-            else if(byteRCV == FLAG){llState = FLAG_RCV; break;}
-            else llState = START;
-            break;
-        // BCC is ok (this state only reaches when control = SET frame)
-        case BCC1_OK:
-            // error llread cant continue because llopen did not go through
-            if(byteRCV == FLAG){return -1;}
-            llState = START;
-            break;
-        // READING DATA
-        case READING_DATA:
-            // if its escaped data
-            if(byteRCV == ESC){
-                llState = ESCAPED_DATA;
-                break;
-            }
-            // if flag is received, last byte was BCC2 (end of frame)
-            else if(byteRCV == FLAG){
-                llState = STOP;
-                break;
-            }else{
-                packet[bytesReceived++] = byteRCV;
-                bcc2_input ^= byteRCV;
-                break;
-            }
-            break;
-        // ESCAPED DATA (byteRCV is not a special character)
-        case ESCAPED_DATA:
-            packet[bytesReceived++] = byteRCV ^ 0x20;
-            bcc2_input ^= (byteRCV ^ 0x20);
-            llState = READING_DATA;
-            break;
-        case STOP:
-            // overwrite bcc2 that was inputed with 0
-            packet[bytesReceived--] = 0;
-
-            // should be 0, because the bcc2_input was xor'd with bcc2
-            if(bcc2_input == 0 && message.control == (frameNr << 7)){
-                // acknowledge frame
-                sendSupervisionMessage(A_TX, C_RR0 + ((message.control >> 7) ^ 0x1));
-                frameNr = frameNr ^ 0x1;
-                return bytesReceived;
-            }
-            else{
-                // reject frame
-                sendSupervisionMessage(A_TX, C_REJ0 + (message.control >> 7));
-                memset(packet, 0, bytesReceived);
-                llState = START;
-                break;
-            }
+    pthread_mutex_lock(&link->asyncLock);
+    link->asyncStopping = TRUE;
+    if(link->activity == LINK_READING) link->interruptRequested = TRUE;
+    // nobody collects the completions anymore
+    link->completionCount = 0;
+    pthread_cond_broadcast(&link->asyncCond);
+    pthread_mutex_unlock(&link->asyncLock);
 
-        default:
-            break;
-        }
-    }
+    pthread_join(link->linkThread, NULL);
+    link->asyncRunning = FALSE;
+    close(link->completionPipe[0]);
+    close(link->completionPipe[1]);
     return 0;
 }
 
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
-int llclose(int showStatistics)
+int llcloseLink(Link *link, int showStatistics)
 {
-    alarmEnabled = FALSE;
-    alarmCount = 0;
-    (void) signal(SIGALRM, alarmHandler);   
+    llstopLink(link);
+    traceEvent(link, TRACE_CLOSE, 0, 0);
+    link->alarmEnabled = FALSE;
+    link->alarmCount = 0;
+    link->timerArmed = FALSE;
 
-    LinkLayerState llState = START;
+    // the DISC / UA exchange already went with the last I-frame
+    LinkLayerState llState = link->closeState == CLOSE_DONE ? STOP : START;
     Message received;
+
+    // the last frame received was never acknowledged by reverse data
+    if(link->curLL.duplex && link->ackPending) duplexSendAck(link, C_RR0 + link->recvSeq);
     
-    if(curLL.role == LlTx){
+    if(link->curLL.role == LlTx){
         // transmitter
 
 
-        while(alarmCount <= retransmissions && llState != STOP){
+        while(link->alarmCount <= link->retransmissions && llState != STOP){
 
-            if(alarmEnabled == FALSE){
-                alarm(alarmTimeout);
-                if(alarmCount > 0){
-                    nrRetransmissions++;
-                    sendSupervisionMessage(A_TX, C_DISC);
+            if(link->alarmEnabled == FALSE){
+                setTimer(link, link->alarmTimeout);
+                if(link->alarmCount > 0){
+                    link->nrRetransmissions++;
+                    sendSupervisionMessage(link, A_TX, C_DISC);
                 } 
-                alarmEnabled = TRUE;
+                link->alarmEnabled = TRUE;
             }
 
             unsigned char byteRCV;
-            int ret = readByteSerialPort(&byteRCV);
+            int ret = readByte(link, &byteRCV);
             if(ret != 1) continue;
 
             switch (llState)
@@ -605,7 +2020,8 @@ int llclose(int showStatistics)
             case BCC1_OK:
                 if(byteRCV == FLAG){
                     // received correct DISC frame and send UA frame
-                    sendSupervisionMessage(A_RX, C_UA);   
+                    traceEvent(link, TRACE_RECEIVED, received.control, 0);
+                    sendSupervisionMessage(link, A_RX, C_UA);   
                     llState = STOP;
                     break;  
                 }
@@ -617,25 +2033,32 @@ int llclose(int showStatistics)
         }
         
     }
+    else if(link->linkDown){
+        // the keepalive gave up on the transmitter, nobody would answer a DISC
+    }
     else{
         // receiver
-        // block alarm until i have sent a DISC frame
-        alarmEnabled = TRUE;
-        sendSupervisionMessage(A_RX, C_DISC);
+        // block alarm until i have sent a DISC frame. If it already went with
+        // the acknowledgement of the last I-frame, wait a timeout for its UA
+        // before sending it again.
+        if(link->closeState == CLOSE_NONE){
+            link->alarmEnabled = TRUE;
+            sendSupervisionMessage(link, A_RX, C_DISC);
+        }
 
-        while(alarmCount <= retransmissions && llState != STOP){
+        while(link->alarmCount <= link->retransmissions && llState != STOP){
             // receive the DISC FRAME
-            if(alarmEnabled == FALSE){
-                alarm(alarmTimeout);
-                if(alarmCount > 0){
-                    sendSupervisionMessage(A_RX, C_DISC);
-                    nrRetransmissions++;
+            if(link->alarmEnabled == FALSE){
+                setTimer(link, link->alarmTimeout);
+                if(link->alarmCount > 0){
+                    sendSupervisionMessage(link, A_RX, C_DISC);
+                    link->nrRetransmissions++;
                 } 
-                alarmEnabled = TRUE;
+                link->alarmEnabled = TRUE;
             }
 
             unsigned char byteRCV;
-            int ret = readByteSerialPort(&byteRCV);
+            int ret = readByte(link, &byteRCV);
             if(ret != 1) continue;
             
             switch (llState)
@@ -673,14 +2096,15 @@ int llclose(int showStatistics)
                 break;
             case BCC1_OK:
                 if(byteRCV == FLAG){
+                    traceEvent(link, TRACE_RECEIVED, received.control, 0);
                     if(received.control == C_UA){
                         llState = STOP;
                         break;
                     }
                     if(received.control == C_DISC){
                         // send C_DISC
-                        sendSupervisionMessage(A_RX, C_DISC);
-                        alarmEnabled = FALSE;
+                        sendSupervisionMessage(link, A_RX, C_DISC);
+                        link->alarmEnabled = FALSE;
                         llState = START;
                         break;
                     }
@@ -692,17 +2116,110 @@ int llclose(int showStatistics)
             }
         }
     }
+    traceEvent(link, TRACE_CLOSED, 0, llState != STOP);
+    traceDump(link);
     if(llState != STOP){
         printf("Couldn't close!\n");
+        closeSerialPortOf(&link->port);
+        freeLink(link);
         return -1;
     }
 
     if(showStatistics > 0){
         // print statistics
-        printf("# Frames: %d\n", nrFrames);
-        printf("# Retransmissions: %d\n", nrRetransmissions);
-        printf("# Timeouts: %d\n", nrTimeouts);
+        printf("# Frames: %d\n", link->nrFrames);
+        printf("# Retransmissions: %d\n", link->nrRetransmissions);
+        printf("# Timeouts: %d\n", link->nrTimeouts);
+        printf("# Duplicates: %d\n", link->nrDuplicates);
+        printf("# Reconnects: %d\n", link->nrReconnects);
+        printf("# Receiver not ready: %d\n", link->nrNotReady);
+        if(link->nrInfoBytes > 0){
+            printf("# Framing overhead: byte stuffing %.2f%%, COBS %.2f%% (%s used)\n",
+                   100.0 * (link->nrStuffedBytes - link->nrInfoBytes) / link->nrInfoBytes,
+                   100.0 * (link->nrCobsBytes - link->nrInfoBytes) / link->nrInfoBytes,
+                   (link->caps.features & FEATURE_COBS) ? "COBS" : "byte stuffing");
+        }
     }
-    int clstat = closeSerialPort();
+    int clstat = closeSerialPortOf(&link->port);
+    freeLink(link);
     return clstat;
 }
+
+////////////////////////////////////////////////
+// Process-wide connection
+////////////////////////////////////////////////
+
+Link *defaultLink = NULL;
+
+int llopen(LinkLayer connectionParameters)
+{
+    defaultLink = llopenLink(connectionParameters);
+    return defaultLink != NULL ? 0 : -1;
+}
+
+int llwrite(const unsigned char *buf, int bufSize)
+{
+    return llwriteLink(defaultLink, buf, bufSize);
+}
+
+int llwriteClose(const unsigned char *buf, int bufSize)
+{
+    return llwriteCloseLink(defaultLink, buf, bufSize);
+}
+
+int llread(unsigned char *packet)
+{
+    return llreadLink(defaultLink, packet);
+}
+
+int llpending(void)
+{
+    return llpendingLink(defaultLink);
+}
+
+void llcaps(LinkLayerCaps *agreed)
+{
+    llcapsLink(defaultLink, agreed);
+}
+
+void llstats(LinkLayerStats *stats)
+{
+    llstatsLink(defaultLink, stats);
+}
+
+int llstart(void)
+{
+    return llstartLink(defaultLink);
+}
+
+int llsubmit(const unsigned char *buf, int bufSize)
+{
+    return llsubmitLink(defaultLink, buf, bufSize);
+}
+
+int llsubmitClose(const unsigned char *buf, int bufSize)
+{
+    return llsubmitCloseLink(defaultLink, buf, bufSize);
+}
+
+int llcancel(int id)
+{
+    return llcancelLink(defaultLink, id);
+}
+
+int llcomplete(LlCompletion *completion)
+{
+    return llcompleteLink(defaultLink, completion);
+}
+
+int llstop(void)
+{
+    return llstopLink(defaultLink);
+}
+
+int llclose(int showStatistics)
+{
+    int ret = llcloseLink(defaultLink, showStatistics);
+    defaultLink = NULL;
+    return ret;
+}
@@ -0,0 +1,96 @@
+// Logical channel multiplexer implementation
+
+#include "mux.h"
+
+#include <string.h>
+
+void muxInit(Mux *mux){
+    memset(mux, 0, sizeof(Mux));
+}
+
+int muxAdd(Mux *mux, int priority, int weight, MuxSource next, void *source){
+    if(mux->count == MUX_MAX_CHANNELS) return -1;
+
+    MuxChannel *channel = &mux->channels[mux->count];
+    channel->next = next;
+    channel->source = source;
+    channel->priority = priority;
+    channel->weight = weight > 0 ? weight : 1;
+    channel->credit = channel->weight;
+    channel->finished = FALSE;
+    channel->size = 0;
+    return mux->count++;
+}
+
+int muxPayload(int channel, int payload){
+    return channel == 0 ? payload : payload - MUX_HEADER_SIZE;
+}
+
+// Pick the channel to send from, -1 if none has a packet ready or MUX_ERROR
+// if one failed
+static int schedule(Mux *mux){
+    int best = -1;
+    for(int i = 0; i < mux->count; i++){
+        MuxChannel *channel = &mux->channels[i];
+        if(!channel->finished && channel->size == 0){
+            channel->size = channel->next(channel->source, &channel->packet);
+            if(channel->size == -1 || channel->size == MUX_ERROR){
+                int failed = channel->size == MUX_ERROR;
+                channel->finished = TRUE;
+                channel->size = 0;
+                if(failed) return MUX_ERROR;
+            }
+        }
+        if(channel->size > 0 && (best == -1 || channel->priority > mux->channels[best].priority)) best = i;
+    }
+    if(best == -1) return -1;
+
+    // the current channel keeps its turn while it has credit left
+    int priority = mux->channels[best].priority;
+    MuxChannel *current = &mux->channels[mux->current];
+    if(current->size > 0 && current->priority == priority && current->credit > 0) return mux->current;
+
+    // otherwise the turn goes to the next channel with the same priority
+    for(int i = 1; i <= mux->count; i++){
+        int next = (mux->current + i) % mux->count;
+        MuxChannel *channel = &mux->channels[next];
+        if(channel->size > 0 && channel->priority == priority){
+            mux->current = next;
+            channel->credit = channel->weight;
+            return next;
+        }
+    }
+    return best;
+}
+
+int muxNext(Mux *mux, unsigned char **packet){
+    int number = schedule(mux);
+    if(number == MUX_ERROR) return -1;
+    if(number == -1) return 0;
+
+    MuxChannel *channel = &mux->channels[number];
+    int size = channel->size;
+    channel->credit--;
+    channel->size = 0;
+
+    if(number == 0){
+        *packet = channel->packet;
+        return size;
+    }
+    mux->buf[0] = MUX_PACKET;
+    mux->buf[1] = number;
+    memcpy(&mux->buf[MUX_HEADER_SIZE], channel->packet, size);
+    *packet = mux->buf;
+    return size + MUX_HEADER_SIZE;
+}
+
+int muxChannel(unsigned char **packet, int *size){
+    if(*size < 1) return -1;
+    if((*packet)[0] != MUX_PACKET) return 0;
+    if(*size <= MUX_HEADER_SIZE) return -1;
+
+    int channel = (*packet)[1];
+    *packet += MUX_HEADER_SIZE;
+    *size -= MUX_HEADER_SIZE;
+    return channel;
+}
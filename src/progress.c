@@ -0,0 +1,78 @@
+// Transfer progress renderer implementation
+
+#include "progress.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define BAR_WIDTH 20
+
+static double elapsedSince(const struct timespec *t){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+// Print a byte count or rate with a binary unit prefix
+static void printBytes(double bytes){
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while(bytes >= 1024 && unit < 4){
+        bytes /= 1024;
+        unit++;
+    }
+    printf("%.1f %s", bytes, units[unit]);
+}
+
+static void draw(Progress *progress, uint64_t done, int final){
+    double elapsed = elapsedSince(&progress->start);
+    double rate = elapsed > 0 ? done / elapsed : 0;
+    float fraction = progress->total > 0 ? (float) done / progress->total : 0;
+    LinkLayerStats stats;
+    llstats(&stats);
+
+    // in place: go back to the start of the line and clear it
+    if(progress->isTty) printf("\r\033[K");
+
+    printf("%s %s [", progress->role == LlRx ? "Receiving" : "Transmitting", progress->filename);
+    for(int i = 1; i <= BAR_WIDTH; i++){
+        putchar(((float) i / BAR_WIDTH) <= fraction ? '#' : ' ');
+    }
+    printf("] %.2f%% ", fraction * 100);
+    printBytes(rate);
+    printf("/s");
+
+    if(!final && rate > 0 && progress->total > done){
+        int eta = (progress->total - done) / rate;
+        printf(" ETA %d:%02d", eta / 60, eta % 60);
+    }
+    else if(final){
+        printf(" in %.1f s", elapsed);
+    }
+    printf(" retx %d timeouts %d RTO %ds", stats.retransmissions, stats.timeouts, stats.rto);
+
+    if(!progress->isTty || final) printf("\n");
+    fflush(stdout);
+}
+
+void progressStart(Progress *progress, const char *filename, LinkLayerRole role, uint64_t total){
+    progress->filename = filename;
+    progress->role = role;
+    progress->total = total;
+    progress->isTty = isatty(STDOUT_FILENO);
+    clock_gettime(CLOCK_MONOTONIC, &progress->start);
+    progress->lastDraw.tv_sec = 0;
+    progress->lastDraw.tv_nsec = 0;
+}
+
+void progressUpdate(Progress *progress, uint64_t done){
+    double interval = progress->isTty ? 1.0 / PROGRESS_RATE : PROGRESS_LOG_INTERVAL;
+    if(elapsedSince(&progress->lastDraw) < interval) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &progress->lastDraw);
+    draw(progress, done, FALSE);
+}
+
+void progressFinish(Progress *progress, uint64_t done){
+    draw(progress, done, TRUE);
+}
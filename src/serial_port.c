@@ -1,5 +1,4 @@
 // Serial port interface implementation
-// DO NOT CHANGE THIS FILE
 
 #include "serial_port.h"
 
@@ -14,17 +13,17 @@
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
-int fd = -1;           // File descriptor for open serial port
-struct termios oldtio; // Serial port settings to restore on closing
+SerialPort defaultPort = {-1};
 
 // Open and configure the serial port.
 // Returns -1 on error.
-int openSerialPort(const char *serialPort, int baudRate)
+int openSerialPortOf(SerialPort *port, const char *serialPort, int baudRate)
 {
+    int fd;
     // Open with O_NONBLOCK to avoid hanging when CLOCAL
     // is not yet set on the serial port (changed later)
     int oflags = O_RDWR | O_NOCTTY | O_NONBLOCK;
-    fd = open(serialPort, oflags);
+    fd = port->fd = open(serialPort, oflags);
     if (fd < 0)
     {
         perror(serialPort);
@@ -32,7 +31,7 @@ int openSerialPort(const char *serialPort, int baudRate)
     }
 
     // Save current port settings
-    if (tcgetattr(fd, &oldtio) == -1)
+    if (tcgetattr(fd, &port->oldtio) == -1)
     {
         perror("tcgetattr");
         return -1;
@@ -112,30 +111,65 @@ int openSerialPort(const char *serialPort, int baudRate)
 
 // Restore original port settings and close the serial port.
 // Returns -1 on error.
-int closeSerialPort()
+int closeSerialPortOf(SerialPort *port)
 {
     // Restore the old port settings
-    if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
+    if (tcsetattr(port->fd, TCSANOW, &port->oldtio) == -1)
     {
         perror("tcsetattr");
         return -1;
     }
 
-    return close(fd);
+    return close(port->fd);
 }
 
 // Wait up to 0.1 second (VTIME) for a byte received from the serial port (must
 // check whether a byte was actually received from the return value).
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
-int readByteSerialPort(unsigned char *byte)
+int readByteSerialPortOf(SerialPort *port, unsigned char *byte)
 {
-    return read(fd, byte, 1);
+    return read(port->fd, byte, 1);
 }
 
 // Write up to numBytes to the serial port (must check how many were actually
 // written in the return value).
 // Returns -1 on error, otherwise the number of bytes written.
+int writeBytesSerialPortOf(SerialPort *port, const unsigned char *bytes, int numBytes)
+{
+    return write(port->fd, bytes, numBytes);
+}
+
+// Write up to the numBuffers buffers of iov, in order, to the serial port
+// (must check how many bytes were actually written in the return value).
+// Returns -1 on error, otherwise the number of bytes written.
+int writeVectorSerialPortOf(SerialPort *port, const struct iovec *iov, int numBuffers)
+{
+    return writev(port->fd, iov, numBuffers);
+}
+
+// Process-wide port
+
+int openSerialPort(const char *serialPort, int baudRate)
+{
+    return openSerialPortOf(&defaultPort, serialPort, baudRate);
+}
+
+int closeSerialPort()
+{
+    return closeSerialPortOf(&defaultPort);
+}
+
+int readByteSerialPort(unsigned char *byte)
+{
+    return readByteSerialPortOf(&defaultPort, byte);
+}
+
 int writeBytesSerialPort(const unsigned char *bytes, int numBytes)
 {
-    return write(fd, bytes, numBytes);
+    return writeBytesSerialPortOf(&defaultPort, bytes, numBytes);
+}
+
+int writeVectorSerialPort(const struct iovec *iov, int numBuffers)
+{
+    return writeVectorSerialPortOf(&defaultPort, iov, numBuffers);
 }
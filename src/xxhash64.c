@@ -0,0 +1,129 @@
+// Streaming XXH64 implementation (https://github.com/Cyan4973/xxHash,
+// XXH64 specification), written for incremental use while a file is sent
+// or received.
+
+#include "xxhash64.h"
+
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian reads, independent of the host byte order
+static uint64_t read64(const unsigned char *p){
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+           (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 | (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static uint32_t read32(const unsigned char *p){
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input){
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t mergeRound(uint64_t acc, uint64_t val){
+    acc ^= xxhRound(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// Consume one 32-byte stripe
+static void consumeStripe(uint64_t *acc, const unsigned char *p){
+    acc[0] = xxhRound(acc[0], read64(p));
+    acc[1] = xxhRound(acc[1], read64(p + 8));
+    acc[2] = xxhRound(acc[2], read64(p + 16));
+    acc[3] = xxhRound(acc[3], read64(p + 24));
+}
+
+void xxh64Reset(Xxh64State *state, uint64_t seed){
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    state->acc[1] = seed + PRIME64_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME64_1;
+}
+
+void xxh64Update(Xxh64State *state, const void *input, uint64_t size){
+    const unsigned char *p = (const unsigned char *) input;
+    const unsigned char *end = p + size;
+    state->totalLen += size;
+
+    // not enough for a stripe yet
+    if(state->memSize + size < 32){
+        memcpy(state->mem + state->memSize, p, size);
+        state->memSize += size;
+        return;
+    }
+
+    // complete the stripe left over from the previous update
+    if(state->memSize > 0){
+        unsigned int fill = 32 - state->memSize;
+        memcpy(state->mem + state->memSize, p, fill);
+        consumeStripe(state->acc, state->mem);
+        p += fill;
+        state->memSize = 0;
+    }
+
+    while(p + 32 <= end){
+        consumeStripe(state->acc, p);
+        p += 32;
+    }
+
+    if(p < end){
+        memcpy(state->mem, p, end - p);
+        state->memSize = end - p;
+    }
+}
+
+uint64_t xxh64Digest(const Xxh64State *state){
+    uint64_t h;
+    if(state->totalLen >= 32){
+        h = rotl64(state->acc[0], 1) + rotl64(state->acc[1], 7) + rotl64(state->acc[2], 12) +
+            rotl64(state->acc[3], 18);
+        for(int i = 0; i < 4; i++){
+            h = mergeRound(h, state->acc[i]);
+        }
+    }
+    else{
+        h = state->seed + PRIME64_5;
+    }
+    h += state->totalLen;
+
+    // remaining bytes (less than a stripe)
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->memSize;
+    while(p + 8 <= end){
+        h ^= xxhRound(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if(p + 4 <= end){
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while(p < end){
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
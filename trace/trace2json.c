@@ -0,0 +1,299 @@
+// Converter of link layer event traces to the Chrome trace event format
+// (JSON), which chrome://tracing and https://ui.perfetto.dev show as a
+// timeline. Traces come from main's "trace" option, LinkLayer.traceFile or
+// sim -T.
+//
+// Usage: trace2json file.trace... > transfer.json
+//
+// Each trace becomes a process. The timestamps of all of them are on the
+// same clock, so both ends of a transfer on one machine line up (traces from
+// two machines do not). Its threads show:
+//   link  : llopen, each llwrite from the packet given to its acknowledgement
+//           (with the frames sent, timeouts and REJs it took), the time the
+//           application took between two llwrites, and llclose
+//   sent  : frames written to the port, as long as they take on the wire
+//   recv  : frames received, packets delivered by llread, header (BCC1) and
+//           BCC2 errors
+//   timer : retransmission timeouts, and when the keepalive found the link
+//           down and up again
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link_layer.h"
+#include "macros.h"
+#include "trace.h"
+
+#define TID_LINK 1
+#define TID_SENT 2
+#define TID_RECV 3
+#define TID_TIMER 4
+
+typedef struct
+{
+    const char *filename;
+    TraceHeader header;
+    TraceEvent *events;
+} Trace;
+
+int firstRecord = TRUE;
+
+
+// Load a trace file. Returns 0 on success or -1 on error
+int loadTrace(const char *filename, Trace *trace)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    trace->filename = filename;
+    trace->events = NULL;
+    int ok = fread(&trace->header, sizeof(TraceHeader), 1, fp) == 1 &&
+             memcmp(trace->header.magic, TRACE_MAGIC, sizeof(trace->header.magic)) == 0 &&
+             trace->header.version == TRACE_VERSION && trace->header.eventSize == sizeof(TraceEvent);
+    if (ok)
+    {
+        trace->events = malloc((trace->header.count > 0 ? trace->header.count : 1) * sizeof(TraceEvent));
+        ok = fread(trace->events, sizeof(TraceEvent), trace->header.count, fp) == trace->header.count;
+    }
+    fclose(fp);
+    if (!ok)
+    {
+        fprintf(stderr, "%s: not a trace file or truncated\n", filename);
+        free(trace->events);
+        return -1;
+    }
+    if (trace->header.lost > 0)
+    {
+        fprintf(stderr, "%s: the first %u events were overwritten\n", filename, trace->header.lost);
+    }
+    return 0;
+}
+
+// Name of a frame by its control field
+const char *frameName(unsigned char control, char *buf)
+{
+    switch (control)
+    {
+    case C_SET:
+        return "SET";
+    case C_UA:
+        return "UA";
+    case C_DISC:
+        return "DISC";
+    case C_POLL:
+        return "POLL";
+    case C_I0:
+    case C_I1:
+        sprintf(buf, "I%d", control >> 7);
+        return buf;
+    case C_RR0:
+    case C_RR1:
+        sprintf(buf, "RR%d", control & 0x1);
+        return buf;
+    case C_REJ0:
+    case C_REJ1:
+        sprintf(buf, "REJ%d", control & 0x1);
+        return buf;
+    case C_RNR0:
+    case C_RNR1:
+        sprintf(buf, "RNR%d", control & 0x1);
+        return buf;
+    }
+    if (IS_C_I(control))
+    {
+        // the last I-frame, which also asks for the disconnection
+        sprintf(buf, "I%d close", control >> 7);
+        return buf;
+    }
+    if (IS_C_IP(control))
+    {
+        sprintf(buf, "I%d(%d)", C_IP_NS(control), C_IP_NR(control));
+        return buf;
+    }
+    sprintf(buf, "0x%02X", control);
+    return buf;
+}
+
+// Start a record of the traceEvents array, the caller writes its fields
+void beginRecord(const char *name, const char *phase, int pid, int tid, double ts)
+{
+    printf("%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+           firstRecord ? "" : ",", name, phase, pid, tid, ts);
+    firstRecord = FALSE;
+}
+
+void span(const char *name, int pid, int tid, double start, double end)
+{
+    beginRecord(name, "X", pid, tid, start);
+    printf(",\"dur\":%.3f", end > start ? end - start : 0);
+}
+
+void instant(const char *name, int pid, int tid, double ts)
+{
+    beginRecord(name, "i", pid, tid, ts);
+    printf(",\"s\":\"t\"");
+}
+
+void metadata(const char *kind, int pid, int tid, const char *name)
+{
+    printf("%s\n{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+           firstRecord ? "" : ",", kind, pid, tid, name);
+    firstRecord = FALSE;
+}
+
+// Write the records of a trace, with timestamps in usec since base (nsec)
+void convert(const Trace *trace, int pid, int64_t base)
+{
+    const TraceHeader *header = &trace->header;
+    int64_t start = header->startSec * 1000000000 + header->startNsec - base;
+    char name[300];
+    snprintf(name, sizeof(name), "%s (%s)", header->role == LlTx ? "tx" : "rx", trace->filename);
+    metadata("process_name", pid, 0, name);
+    metadata("thread_name", pid, TID_LINK, "link");
+    metadata("thread_name", pid, TID_SENT, "sent");
+    metadata("thread_name", pid, TID_RECV, "recv");
+    metadata("thread_name", pid, TID_TIMER, "timer");
+
+    double openTs = -1, closeTs = -1, writeTs = -1, ackTs = -1;
+    int writeSize = 0, sends = 0, timeouts = 0, rejects = 0;
+    char frame[16];
+
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        const TraceEvent *event = &trace->events[i];
+        double ts = (start + (int64_t) event->nsec) / 1000.0;
+
+        switch (event->event)
+        {
+        case TRACE_OPEN:
+            openTs = ts;
+            break;
+        case TRACE_CONNECTED:
+            if (openTs >= 0)
+            {
+                span("llopen", pid, TID_LINK, openTs, ts);
+                printf(",\"args\":{\"features\":%d}}", event->arg);
+            }
+            openTs = -1;
+            break;
+        case TRACE_CLOSE:
+            closeTs = ts;
+            break;
+        case TRACE_CLOSED:
+            if (closeTs >= 0)
+            {
+                span("llclose", pid, TID_LINK, closeTs, ts);
+                printf(",\"args\":{\"answered\":%s}}", event->arg == 0 ? "true" : "false");
+            }
+            closeTs = -1;
+            break;
+        case TRACE_QUEUED:
+            if (ackTs >= 0 && ts > ackTs)
+            {
+                span("application", pid, TID_LINK, ackTs, ts);
+                printf("}");
+            }
+            writeTs = ts;
+            writeSize = event->arg;
+            sends = timeouts = rejects = 0;
+            break;
+        case TRACE_ACKED:
+            if (writeTs >= 0)
+            {
+                span(event->arg >= 0 ? "llwrite" : "llwrite failed", pid, TID_LINK, writeTs, ts);
+                printf(",\"args\":{\"bytes\":%d,\"frames\":%d,\"timeouts\":%d,\"rejects\":%d}}",
+                       writeSize, sends, timeouts, rejects);
+            }
+            writeTs = -1;
+            ackTs = ts;
+            break;
+        case TRACE_SENT:
+        {
+            // the bytes were written at once, they leave at the baud rate
+            double wire = header->baudRate > 0 ? event->arg * 10 * 1e6 / header->baudRate : 0;
+            span(frameName(event->control, frame), pid, TID_SENT, ts, ts + wire);
+            printf(",\"args\":{\"bytes\":%d}}", event->arg);
+            if (IS_C_I(event->control) || IS_C_IP(event->control))
+            {
+                sends++;
+            }
+            break;
+        }
+        case TRACE_RECEIVED:
+            instant(frameName(event->control, frame), pid, TID_RECV, ts);
+            printf(",\"args\":{\"info\":%d}}", event->arg);
+            if (event->control == C_REJ0 || event->control == C_REJ1)
+            {
+                rejects++;
+            }
+            break;
+        case TRACE_DELIVERED:
+            instant("delivered", pid, TID_RECV, ts);
+            printf(",\"args\":{\"bytes\":%d}}", event->arg);
+            break;
+        case TRACE_HEADER_ERROR:
+            instant("BCC1 error", pid, TID_RECV, ts);
+            printf(",\"args\":{\"control\":\"%s\"}}", frameName(event->control, frame));
+            break;
+        case TRACE_BCC2_ERROR:
+            instant("BCC2 error", pid, TID_RECV, ts);
+            printf(",\"args\":{\"frame\":\"%s\",\"info\":%d}}", frameName(event->control, frame), event->arg);
+            break;
+        case TRACE_TIMEOUT:
+            instant("timeout", pid, TID_TIMER, ts);
+            printf(",\"args\":{\"in a row\":%d}}", event->arg);
+            timeouts++;
+            break;
+        case TRACE_LINK_DOWN:
+            instant("link down", pid, TID_TIMER, ts);
+            printf(",\"args\":{\"silent ms\":%d}}", event->arg);
+            break;
+        case TRACE_LINK_UP:
+            instant("link up", pid, TID_TIMER, ts);
+            printf(",\"args\":{\"down ms\":%d}}", event->arg);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s file.trace... > transfer.json\n", argv[0]);
+        return 1;
+    }
+
+    int count = argc - 1;
+    Trace *traces = malloc(count * sizeof(Trace));
+    int64_t base = INT64_MAX;
+    for (int i = 0; i < count; i++)
+    {
+        if (loadTrace(argv[i + 1], &traces[i]) == -1)
+        {
+            return 1;
+        }
+        int64_t start = traces[i].header.startSec * 1000000000 + traces[i].header.startNsec;
+        if (start < base)
+        {
+            base = start;
+        }
+    }
+
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int i = 0; i < count; i++)
+    {
+        convert(&traces[i], i + 1, base);
+        free(traces[i].events);
+    }
+    printf("\n]}\n");
+    free(traces);
+    return 0;
+}